@@ -0,0 +1,98 @@
+/*
+ * Backs up a generated world-like directory with tar -zcf and with Archive on
+ * one and on every thread, and checks each archive lists the same files.
+ *
+ * Usage: archive [megabytes] [directory]
+ */
+#include <chrono>
+#include <fcntl.h>
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "archive.hpp"
+
+static double elapsed(std::chrono::steady_clock::time_point since) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+static off_t fileSize(std::string path) {
+	struct stat st;
+	return stat(path.c_str(), &st) == -1 ? -1 : st.st_size;
+}
+
+static std::string listing(std::string file) {
+	std::string output;
+	FILE *list = popen(("tar -tzf '" + file + "' | sort").c_str(), "r");
+	if (list == NULL)
+		return output;
+	char buf[4096];
+	size_t bytes;
+	while ((bytes = fread(buf, 1, sizeof(buf), list)) > 0)
+		output.append(buf, bytes);
+	return pclose(list) == 0 ? output : "";
+}
+
+// Region files are mostly small repeated records with some noise, which
+// compresses about as well as the real thing
+static void generate(std::string dir, size_t megabytes) {
+	mkdir(dir.c_str(), 0755);
+	mkdir((dir + "/region").c_str(), 0755);
+	mkdir((dir + "/playerdata").c_str(), 0755);
+	unsigned int seed = 1;
+	std::vector<char> data(4 * 1024 * 1024);
+	for (size_t file = 0; file * 4 < megabytes; ++file) {
+		for (size_t i = 0; i < data.size(); i += 64) {
+			for (size_t j = 0; j < 64; ++j)
+				data[i + j] = j < 48 ? "chunk,block,sections,biome "[j % 27] : rand_r(&seed) % 16;
+		}
+		int fd = open((dir + "/region/r." + std::to_string(file) + ".0.mca").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (write(fd, data.data(), data.size()) == -1)
+			std::cerr << "Could not write test data" << std::endl;
+		close(fd);
+	}
+	for (size_t player = 0; player < 200; ++player) {
+		int fd = open((dir + "/playerdata/player-" + std::to_string(player) + ".dat").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (write(fd, data.data() + player * 64, 2048) == -1)
+			std::cerr << "Could not write test data" << std::endl;
+		close(fd);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+	std::string dir = argc > 2 ? argv[2] : "/tmp/mcd-bench-archive";
+	std::string source = dir + "/world";
+	size_t cpus = std::thread::hardware_concurrency();
+
+	mkdir(dir.c_str(), 0755);
+	generate(source, megabytes);
+	std::cout << "World: " << megabytes << " MiB of region files, " << cpus << " CPUs" << std::endl;
+
+	// What Server::archive used to run
+	std::string file = dir + "/tar.tgz";
+	auto start = std::chrono::steady_clock::now();
+	int status = system(("cd '" + source + "' && tar -zcf '" + file + "' .").c_str());
+	double seconds = elapsed(start);
+	std::string expected = listing(file);
+	std::cout << "tar -zcf:       " << (status ? "failed" : "ok") << " in " << seconds * 1000 << " ms, " << megabytes / seconds << " MiB/s, " << fileSize(file) << " bytes" << std::endl;
+
+	std::vector<size_t> counts = { 1 };
+	if (cpus > 1)
+		counts.push_back(cpus);
+	for (size_t threads : counts) {
+		file = dir + "/archive-" + std::to_string(threads) + ".tgz";
+		Archive archive(threads);
+		start = std::chrono::steady_clock::now();
+		bool ok = archive.write(source, file);
+		seconds = elapsed(start);
+		bool same = !expected.empty() && listing(file) == expected;
+		std::cout << "Archive (" << threads << (threads == 1 ? " thread):  " : " threads): ") << (ok ? "ok" : "failed") << " in " << seconds * 1000 << " ms, " << megabytes / seconds << " MiB/s, " << fileSize(file) << " bytes" << (same ? "" : ", DIFFERENT FILES") << std::endl;
+	}
+
+	status = system(("rm -rf '" + dir + "'").c_str());
+	return status;
+}
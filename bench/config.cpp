@@ -0,0 +1,90 @@
+/*
+ * Loads a generated config file with thousands of [server] blocks, then times
+ * reloading it unchanged and with a single block edited.
+ *
+ * Usage: config [sections] [directory]
+ */
+#include <chrono>
+#include <fstream>
+#include <grp.h>
+#include <iostream>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "config.hpp"
+
+#define RELOADS 20
+
+static double elapsed(std::chrono::steady_clock::time_point since) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Every block runs as the same user, as most real configs do
+static void generate(std::string file, size_t sections, size_t edited) {
+	struct passwd *pwd_ent = getpwuid(getuid());
+	struct group *grp_ent = getgrgid(getgid());
+	std::ofstream out(file, std::ios_base::trunc);
+	out << "# Generated by bench/config" << std::endl << "jobs=8" << std::endl << "backup_jobs=2" << std::endl;
+	for (size_t i = 0; i < sections; ++i) {
+		std::string name = "server-" + std::to_string(i);
+		out << std::endl << "[" << name << "]" << std::endl;
+		out << "default=" << (i % 2 ? "yes" : "no") << std::endl;
+		out << "user=" << (pwd_ent ? pwd_ent->pw_name : "root") << std::endl;
+		out << "group=" << (grp_ent ? grp_ent->gr_name : "root") << std::endl;
+		out << "path=/srv/minecraft/" << name << std::endl;
+		out << "world=world" << std::endl << "world=world_nether" << std::endl;
+		out << "backup=/srv/backups/" << name << std::endl;
+		out << "backup_format=" << (i % 3 ? "dedup" : "tar") << std::endl;
+		out << "backup_schedule=" << i % 60 << " */6 * * *" << std::endl;
+		out << "keep_daily=" << (i == edited ? 14 : 7) << std::endl;
+		out << "keep_weekly=4" << std::endl;
+		out << "log_size=10M" << std::endl << "log_age=7d" << std::endl;
+		out << "input_timeout=30s" << std::endl;
+		out << "run=java -Xmx2G -jar server.jar nogui" << std::endl;
+		out << "after=/usr/local/bin/notify-stopped " << name << std::endl;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	size_t sections = argc > 1 ? strtoul(argv[1], NULL, 10) : 5000;
+	std::string dir = argc > 2 ? argv[2] : "/tmp/mcd-bench-config";
+	std::string file = dir + "/mc-daemon.conf";
+
+	mkdir(dir.c_str(), 0755);
+	generate(file, sections, sections);
+	struct stat st;
+	stat(file.c_str(), &st);
+	std::cout << "Config: " << sections << " servers, " << st.st_size / 1024 << " KiB" << std::endl;
+
+	auto start = std::chrono::steady_clock::now();
+	Config config(file);
+	double seconds = elapsed(start);
+	if (config.error() || config.getServers().size() != sections) {
+		std::cerr << "Could not load the config" << std::endl;
+		return 1;
+	}
+	std::cout << "  First load:          " << seconds * 1000 << " ms" << std::endl;
+
+	bool ok = true;
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < RELOADS; ++i)
+		ok = config.parseConfigFile() && ok;
+	seconds = elapsed(start) / RELOADS;
+	std::cout << "  Reload, unchanged:   " << seconds * 1000 << " ms" << (ok ? "" : ", FAILED") << std::endl;
+
+	// Alternate between two versions, so every reload has something to apply
+	seconds = 0;
+	for (size_t i = 0; i < RELOADS; ++i) {
+		generate(file, sections, i % 2 ? sections : sections / 2);
+		start = std::chrono::steady_clock::now();
+		ok = config.parseConfigFile() && ok;
+		seconds += elapsed(start);
+	}
+	seconds /= RELOADS;
+	std::cout << "  Reload, one edited:  " << seconds * 1000 << " ms" << (ok ? "" : ", FAILED") << std::endl;
+
+	int status = system(("rm -rf '" + dir + "'").c_str());
+	return status || !ok;
+}
@@ -0,0 +1,100 @@
+/*
+ * Restores a generated world-like directory from a .tgz with tar -xzf and
+ * with Extractor on one and on every thread, from both an archive made by tar
+ * and one made by Archive, and checks each copy matches the original.
+ *
+ * Usage: extract [megabytes] [directory]
+ */
+#include <chrono>
+#include <fcntl.h>
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "archive.hpp"
+#include "extract.hpp"
+
+static double elapsed(std::chrono::steady_clock::time_point since) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+static bool same(std::string a, std::string b) {
+	return system(("diff -r '" + a + "' '" + b + "' > /dev/null").c_str()) == 0;
+}
+
+// Region files are mostly small repeated records with some noise, which
+// compresses about as well as the real thing
+static void generate(std::string dir, size_t megabytes) {
+	mkdir(dir.c_str(), 0755);
+	mkdir((dir + "/region").c_str(), 0755);
+	mkdir((dir + "/playerdata").c_str(), 0755);
+	unsigned int seed = 1;
+	std::vector<char> data(4 * 1024 * 1024);
+	for (size_t file = 0; file * 4 < megabytes; ++file) {
+		for (size_t i = 0; i < data.size(); i += 64) {
+			for (size_t j = 0; j < 64; ++j)
+				data[i + j] = j < 48 ? "chunk,block,sections,biome "[j % 27] : rand_r(&seed) % 16;
+		}
+		int fd = open((dir + "/region/r." + std::to_string(file) + ".0.mca").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (write(fd, data.data(), data.size()) == -1)
+			std::cerr << "Could not write test data" << std::endl;
+		close(fd);
+	}
+	for (size_t player = 0; player < 200; ++player) {
+		int fd = open((dir + "/playerdata/player-" + std::to_string(player) + ".dat").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (write(fd, data.data() + player * 64, 2048) == -1)
+			std::cerr << "Could not write test data" << std::endl;
+		close(fd);
+	}
+	if (symlink("region/r.0.0.mca", (dir + "/latest").c_str()) == -1)
+		std::cerr << "Could not write test data" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+	size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+	std::string dir = argc > 2 ? argv[2] : "/tmp/mcd-bench-extract";
+	std::string source = dir + "/world";
+	size_t cpus = std::thread::hardware_concurrency();
+
+	mkdir(dir.c_str(), 0755);
+	generate(source, megabytes);
+	std::cout << "World: " << megabytes << " MiB of region files, " << cpus << " CPUs" << std::endl;
+	std::string tar_file = dir + "/tar.tgz", archive_file = dir + "/archive.tgz";
+	int status = system(("cd '" + source + "' && tar -zcf '" + tar_file + "' .").c_str());
+	Archive archive;
+	if (status || !archive.write(source, archive_file)) {
+		std::cerr << "Could not make the archives" << std::endl;
+		return 1;
+	}
+
+	for (std::string file : { tar_file, archive_file }) {
+		std::cout << (file == tar_file ? "Made by tar -zcf:" : "Made by Archive:") << std::endl;
+		// What restoring a backup took before
+		std::string dest = dir + "/tar";
+		mkdir(dest.c_str(), 0755);
+		auto start = std::chrono::steady_clock::now();
+		status = system(("cd '" + dest + "' && tar -xzf '" + file + "'").c_str());
+		double seconds = elapsed(start);
+		std::cout << "  tar -xzf:         " << (status ? "failed" : "ok") << " in " << seconds * 1000 << " ms, " << megabytes / seconds << " MiB/s" << (same(source, dest) ? "" : ", DIFFERENT FILES") << std::endl;
+		status = system(("rm -rf '" + dest + "'").c_str());
+
+		std::vector<size_t> counts = { 1 };
+		if (cpus > 1)
+			counts.push_back(cpus);
+		for (size_t threads : counts) {
+			dest = dir + "/extract-" + std::to_string(threads);
+			Extractor extractor(threads);
+			start = std::chrono::steady_clock::now();
+			bool ok = extractor.extract(file, dest);
+			seconds = elapsed(start);
+			std::cout << "  Extractor (" << threads << (threads == 1 ? " thread):  " : " threads): ") << (ok ? "ok" : "failed") << " in " << seconds * 1000 << " ms, " << megabytes / seconds << " MiB/s" << (same(source, dest) ? "" : ", DIFFERENT FILES") << std::endl;
+			status = system(("rm -rf '" + dest + "'").c_str());
+		}
+	}
+
+	status = system(("rm -rf '" + dir + "'").c_str());
+	return status;
+}
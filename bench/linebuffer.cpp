@@ -0,0 +1,72 @@
+/*
+ * Splits a multi-megabyte batch of control requests into lines, fed in
+ * read-sized chunks, with LineBuffer and with the old substr/erase splitter.
+ *
+ * Usage: linebuffer [megabytes] [chunk size]
+ */
+#include <chrono>
+#include <iostream>
+#include <queue>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "buffer.hpp"
+#include "protocol.hpp"
+
+static double elapsed(std::chrono::steady_clock::time_point since) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - since).count();
+}
+
+int main(int argc, char *argv[]) {
+	size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+	size_t chunk = argc > 2 ? strtoul(argv[2], NULL, 10) : 4096;
+
+	// A batch of pipelined requests
+	std::string batch;
+	for (unsigned long id = 1; batch.size() < megabytes * 1024 * 1024; ++id)
+		batch += formatRequest({ id, "user", "server" + std::to_string(id % 40), "say Maintenance in " + std::to_string(id % 60) + " minutes" }) + '\n';
+	std::cout << "Batch: " << batch.size() << " bytes, read size " << chunk << std::endl;
+
+	// LineBuffer, as used by Socket::read
+	auto start = std::chrono::steady_clock::now();
+	LineBuffer buffer(65536, 16 * 1024 * 1024);
+	size_t lines = 0, bytes = 0;
+	struct request req;
+	for (size_t pos = 0; pos < batch.size(); pos += chunk) {
+		size_t available;
+		char *space = buffer.reserve(chunk, available);
+		size_t length = std::min(chunk, batch.size() - pos);
+		memcpy(space, batch.data() + pos, length);
+		buffer.commit(length);
+		while (buffer.hasLine()) {
+			std::string_view line = buffer.nextLine();
+			bytes += line.size();
+			lines += parseRequest(line, req);
+		}
+	}
+	double seconds = elapsed(start);
+	std::cout << "LineBuffer:    " << lines << " lines (" << bytes << " bytes) in " << seconds * 1000 << " ms, " << batch.size() / seconds / 1048576 << " MiB/s" << std::endl;
+
+	// The splitter Socket::read used to have (with lines spanning chunks fixed)
+	start = std::chrono::steady_clock::now();
+	std::queue<std::string> messages;
+	std::string partial;
+	lines = bytes = 0;
+	for (size_t pos = 0; pos < batch.size(); pos += chunk) {
+		std::string data = partial + batch.substr(pos, chunk);
+		std::string::size_type line_break;
+		while (line_break = data.find_first_of('\n'), line_break != std::string::npos) {
+			messages.push(data.substr(0, line_break));
+			data.erase(0, line_break + 1);
+		}
+		partial = data;
+		while (!messages.empty()) {
+			std::string line = messages.front();
+			messages.pop();
+			bytes += line.size();
+			lines += parseRequest(line, req);
+		}
+	}
+	seconds = elapsed(start);
+	std::cout << "substr/erase:  " << lines << " lines (" << bytes << " bytes) in " << seconds * 1000 << " ms, " << batch.size() / seconds / 1048576 << " MiB/s" << std::endl;
+}
@@ -0,0 +1,58 @@
+/*
+ * Measures how long it takes to start (and reap) /bin/true with fork and with
+ * spawn, as the resident memory of the calling process grows.
+ *
+ * Usage: spawn [iterations] [max megabytes]
+ */
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include "spawn.hpp"
+
+static double forkTrue(size_t iterations) {
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < iterations; ++i) {
+		pid_t child = fork();
+		if (child == 0) {
+			execl("/bin/true", "true", (char*)NULL);
+			_exit(127);
+		}
+		waitpid(child, NULL, 0);
+	}
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+static double spawnTrue(size_t iterations) {
+	struct spawn_attr attr;
+	attr.args = { "/bin/true" };
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < iterations; ++i)
+		waitpid(spawn(attr, NULL), NULL, 0);
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+int main(int argc, char *argv[]) {
+	size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 200;
+	size_t max_mb = argc > 2 ? strtoul(argv[2], NULL, 10) : 1024;
+
+	std::vector<char*> ballast;
+	size_t resident = 0;
+	std::cout << "RSS (MiB)   fork+exec (us)   spawn (us)" << std::endl;
+	for (size_t target = 0; target <= max_mb; target = target ? target * 4 : 16) {
+		// Grow the process, and touch every page so it is really resident
+		while (resident < target) {
+			char *block = (char*)malloc(16 * 1024 * 1024);
+			memset(block, 1, 16 * 1024 * 1024);
+			ballast.push_back(block);
+			resident += 16;
+		}
+		double forked = forkTrue(iterations), spawned = spawnTrue(iterations);
+		std::cout << resident << "\t\t" << forked << "\t\t " << spawned << std::endl;
+	}
+	for (char *block : ballast)
+		free(block);
+}
@@ -0,0 +1,98 @@
+/*
+ * Supervises a number of dummy child processes, first with the pidfd based
+ * Supervisor and then with a thread blocked in waitpid per child (how servers
+ * used to be supervised), and compares memory, threads and how long it takes
+ * to notice that every child has exited.
+ *
+ * Usage: supervisor [children]
+ */
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <signal.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "supervisor.hpp"
+
+// Reads a field (in kB, or a count) from /proc/self/status
+static long status(std::string field) {
+	std::ifstream file("/proc/self/status");
+	std::string line;
+	while (getline(file, line))
+		if (line.compare(0, field.size() + 1, field + ":") == 0)
+			return strtol(line.c_str() + field.size() + 1, NULL, 10);
+	return -1;
+}
+
+static std::vector<pid_t> spawn(size_t count) {
+	std::vector<pid_t> children;
+	for (size_t i = 0; i < count; ++i) {
+		pid_t child = fork();
+		if (child == 0) {
+			while (true)
+				pause();
+		}
+		if (child == -1) {
+			std::cerr << "fork error after " << i << " children" << std::endl;
+			break;
+		}
+		children.push_back(child);
+	}
+	return children;
+}
+
+static double since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+	size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+
+	// Every supervised child needs a pidfd
+	struct rlimit files;
+	getrlimit(RLIMIT_NOFILE, &files);
+	files.rlim_cur = files.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &files);
+
+	Supervisor *supervisor = Supervisor::get();
+
+	// pidfds and a single reactor thread
+	std::vector<pid_t> children = spawn(count);
+	long rss = status("VmRSS");
+	std::atomic<size_t> exited = 0;
+	std::promise<void> all_exited;
+	supervisor->call([&]() {
+		for (pid_t child : children)
+			supervisor->watch(child, [&](int) {
+				if (++exited == children.size())
+					all_exited.set_value();
+			});
+	});
+	std::cout << "Supervisor:       " << children.size() << " children, " << status("Threads") << " threads, +" << status("VmRSS") - rss << " kB RSS" << std::endl;
+	auto start = std::chrono::steady_clock::now();
+	for (pid_t child : children)
+		kill(child, SIGKILL);
+	all_exited.get_future().wait();
+	std::cout << "                  all exits noticed " << since(start) << " ms after killing" << std::endl;
+
+	// A thread per child
+	children = spawn(count);
+	rss = status("VmRSS");
+	std::vector<std::thread> threads;
+	for (pid_t child : children)
+		threads.emplace_back([child]() { while (waitpid(child, NULL, 0) == -1 && errno == EINTR); });
+	std::cout << "Thread per child: " << children.size() << " children, " << status("Threads") << " threads, +" << status("VmRSS") - rss << " kB RSS" << std::endl;
+	start = std::chrono::steady_clock::now();
+	for (pid_t child : children)
+		kill(child, SIGKILL);
+	for (std::thread &thread : threads)
+		thread.join();
+	std::cout << "                  all exits noticed " << since(start) << " ms after killing" << std::endl;
+}
@@ -0,0 +1,102 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <vector>
+
+class ThreadPool;
+class Throttle;
+struct archive_block;
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+
+/*
+ * Writes a directory as a gzip compressed tar file (the same thing tar -zcf
+ * makes), compressing on several threads at once.
+ *
+ * The tar stream is cut into blocks which are deflated in parallel, each
+ * primed with the end of the block before it, and written in order as a
+ * single gzip member (like pigz does). Reading, compressing and writing
+ * overlap, and only a bounded number of blocks are in memory at a time.
+ *
+ * Given directories to archive, each is read and compressed on its own, at
+ * the same time as the others, and the results joined into one archive.
+ */
+class Archive {
+	size_t threads;
+	size_t memory;
+	int level = 6;
+	uid_t user = -1;
+	gid_t group = -1;
+	Throttle *throttle = nullptr;
+	std::vector<std::string> directories;
+
+	// Pipeline state, for the archive being written
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<struct archive_block*> blocks; // In flight, oldest first
+	struct archive_block *current = nullptr;  // Being filled
+	std::vector<unsigned char> tail;          // Dictionary for the next block
+	size_t max_blocks = 0;
+	ThreadPool *workers = nullptr;
+	bool failed = false;
+	unsigned long long total = 0;             // Bytes of tar stream
+	unsigned long long archive_size = 0;      // Bytes written
+	EVP_MD_CTX *digest = nullptr;
+	std::string checksum;
+
+	bool addDirectory(std::string, std::string);
+	bool addEntry(std::string, std::string, const struct stat&);
+	bool addParents(std::string);
+	void append(const void*, size_t);
+	bool appendFile(int, off_t);
+	bool appendHeader(std::string, const struct stat&, char, std::string);
+	bool appendPart(int, std::string);
+	void compress(struct archive_block*);
+	bool stream(int, std::function<bool()>, unsigned long long&, bool);
+	void submit(bool);
+	bool writeBlocks(int);
+	bool writePart(std::string, std::string, std::string, unsigned long long&);
+
+public:
+	/*
+	 * SHA-256 (in hex) and size of the last archive written.
+	 */
+	std::string getChecksum();
+	unsigned long long getSize();
+
+	/*
+	 * Archive everything in a directory (as ./<path>) to a file. Returns false
+	 * on error, in which case the file is not created.
+	 */
+	bool write(std::string, std::string);
+
+	/*
+	 * Only archive these directories (relative to the one given to write),
+	 * in parallel. Empty for everything.
+	 */
+	void setDirectories(std::vector<std::string>);
+
+	/*
+	 * Set the owner of the archives written.
+	 */
+	void setOwner(uid_t, gid_t);
+
+	/*
+	 * Limit how fast files are read (nullptr for no limit).
+	 */
+	void setThrottle(Throttle*);
+
+	/*
+	 * Compress on this many threads, using at most this much memory for
+	 * blocks in flight (0 for the defaults: every CPU, and 64 MiB).
+	 */
+	Archive(size_t = 0, size_t = 0);
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef BACKUP_H
+#define BACKUP_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <sys/types.h>
+#include <time.h>
+#include <vector>
+
+class Throttle;
+
+/*
+ * A file, directory or symbolic link in a snapshot.
+ */
+struct backup_entry {
+	char type; // 'f', 'd' or 'l'
+	mode_t mode;
+	uid_t user;
+	gid_t group;
+	struct timespec mtime;
+	off_t size;
+	std::vector<std::string> chunks; // Content hashes, in order (files only)
+	std::string target;              // Symbolic links only
+	std::string path;                // Relative to the backed up directory
+};
+
+struct backup_stats {
+	size_t files = 0;
+	size_t unchanged = 0; // Files taken from the previous snapshot without reading them
+	size_t chunks = 0;
+	size_t new_chunks = 0;
+	unsigned long long bytes_read = 0;
+	unsigned long long bytes_stored = 0;
+	std::string parent;   // Snapshot unchanged files were taken from, "" if none
+};
+
+/*
+ * Content addressed, deduplicating backup store.
+ *
+ * Files are cut into chunks at content defined boundaries (so data inserted in
+ * a file only changes the chunks around it), and every chunk is compressed and
+ * stored once, named by its SHA-256 hash:
+ *   <dir>/chunks/<first 2 hex digits>/<other 62>
+ * A snapshot is a manifest listing every file and the chunks it is made of:
+ *   <dir>/snapshots/<name>.manifest
+ * Files with the same size and modification time as in the previous snapshot
+ * are not read at all, so unchanged files cost nothing.
+ *
+ * Given what changed since the last snapshot, only that is looked at, and the
+ * rest is taken from the last snapshot without even a stat.
+ *
+ * Chunks are shared, so removing a snapshot only removes its manifest; collect
+ * then deletes the chunks no snapshot uses. <dir>/lock keeps it from running
+ * while snapshots are made.
+ */
+class BackupStore {
+	std::string dir;
+	Throttle *throttle = nullptr;
+	std::vector<std::string> directories;
+	const std::set<std::string> *changes = nullptr;
+	std::string base;
+
+	bool addEntry(std::string, std::string, const std::map<std::string, const struct backup_entry*>&, std::vector<struct backup_entry>&, struct backup_stats&);
+	int lock(int);
+	bool restoreFile(const struct backup_entry&, std::string);
+	bool storeChunk(const unsigned char*, size_t, std::string&, struct backup_stats&);
+	bool storeFile(std::string, struct backup_entry&, struct backup_stats&);
+	bool walk(std::string, std::string, const std::map<std::string, const struct backup_entry*>&, std::vector<struct backup_entry>&, struct backup_stats&);
+	bool walkChanges(std::string, const std::vector<struct backup_entry>&, const std::map<std::string, const struct backup_entry*>&, std::vector<struct backup_entry>&, struct backup_stats&);
+	bool walkDirectory(std::string, std::string, const std::map<std::string, const struct backup_entry*>&, std::vector<struct backup_entry>&, struct backup_stats&);
+	bool writeSnapshot(std::string, std::string, std::string&, struct backup_stats&);
+
+public:
+	/*
+	 * Path of the file holding a chunk.
+	 */
+	std::string chunkPath(std::string);
+
+	/*
+	 * Delete every chunk no snapshot uses, waiting for snapshots being made
+	 * to finish first. Adds the bytes freed. Returns false if any manifest
+	 * can't be read (nothing is deleted then).
+	 */
+	bool collect(unsigned long long&);
+
+	/*
+	 * Name of the newest snapshot made with the given prefix, or "" if none.
+	 */
+	std::string latest(std::string);
+
+	/*
+	 * Read a snapshot's manifest. Returns false if it can't be read.
+	 */
+	bool readManifest(std::string, std::vector<struct backup_entry>&);
+
+	/*
+	 * Remove a snapshot (its chunks stay until collected).
+	 */
+	bool remove(std::string);
+
+	/*
+	 * Write a snapshot out to a new directory, on this many threads (0 for
+	 * every CPU), checking every chunk against its hash. Returns false on
+	 * error, leaving what was written to be removed.
+	 */
+	bool restore(std::string, std::string, size_t);
+
+	/*
+	 * Back up a directory as a new snapshot, named <prefix>_<date>-<time>.
+	 * Returns false on error, in which case no snapshot is recorded (chunks
+	 * already stored are kept, and reused by the next attempt).
+	 */
+	bool snapshot(std::string, std::string, std::string&, struct backup_stats&);
+
+	/*
+	 * Paths (relative to the directory backed up) changed since the snapshot
+	 * named, which is all snapshot reads. The directory may hold only these,
+	 * so snapshot fails if that is no longer the newest snapshot. nullptr to
+	 * read everything.
+	 */
+	void setChanges(const std::set<std::string>*, std::string);
+
+	/*
+	 * Only back up these directories (relative to the one given to
+	 * snapshot), each read at the same time as the others. Empty for
+	 * everything.
+	 */
+	void setDirectories(std::vector<std::string>);
+
+	/*
+	 * Limit how fast files are read (nullptr for no limit).
+	 */
+	void setThrottle(Throttle*);
+
+	BackupStore(std::string);
+};
+
+#endif
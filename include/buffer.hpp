@@ -0,0 +1,76 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+#include <string_view>
+
+/*
+ * A receive buffer that splits incoming data into lines without copying them.
+ *
+ * Data is written straight into the buffer (see reserve and commit), and lines
+ * are handed out as views into it. Only a trailing partial line is ever moved,
+ * so splitting is linear in the amount of data received.
+ */
+class LineBuffer {
+	char *data;
+	size_t capacity;
+	size_t limit;
+
+	size_t start = 0;  // First byte not yet handed out
+	size_t scanned = 0; // Everything before this is known not to contain '\n'
+	size_t end = 0;    // One past the last byte written
+	size_t line_end;   // Position of the next '\n', if found by hasLine
+	bool found = false;
+	bool finished = false;
+
+public:
+	/*
+	 * Returns a pointer to at least `min` bytes of free space, and sets
+	 * `available` to the actual amount. Invalidates views returned by nextLine.
+	 * Returns NULL if a single line would grow beyond the buffer's limit.
+	 */
+	char *reserve(size_t min, size_t &available);
+
+	/*
+	 * Mark `bytes` of the reserved space as written.
+	 */
+	void commit(size_t bytes);
+
+	/*
+	 * No more data will be written, so whatever follows the last line break is
+	 * returned by nextLine as a final line.
+	 */
+	void finish();
+
+	/*
+	 * Returns true if nextLine has a line to return.
+	 */
+	bool hasLine();
+
+	/*
+	 * Returns the next line, without its line break. The view remains valid
+	 * until the next call to reserve.
+	 */
+	std::string_view nextLine();
+
+	/*
+	 * Returns everything buffered that was not returned as a line yet, as if it
+	 * ended with a line break. The view remains valid until the next call to
+	 * reserve.
+	 */
+	std::string_view take();
+
+	/*
+	 * Number of buffered bytes not yet returned as lines.
+	 */
+	size_t size();
+
+	/*
+	 * Create a buffer with the given initial capacity, that will grow to hold
+	 * lines of up to `limit` bytes.
+	 */
+	LineBuffer(size_t capacity, size_t limit);
+	~LineBuffer();
+};
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <time.h>
+#include <vector>
+
+/*
+ * A backup recorded in a catalog.
+ */
+struct catalog_entry {
+	std::string server;
+	std::string name;     // File in the backup directory (tar), or snapshot name (dedup)
+	std::string format;   // "tar" or "dedup"
+	time_t time = 0;      // When it was made
+	unsigned long long size = 0; // Bytes it added to the backup directory
+	unsigned long duration = 0;  // Milliseconds it took
+	std::string checksum; // SHA-256 of the archive or manifest, "-" if unknown
+	std::string parent;   // Snapshot it was made on top of, "-" if none
+};
+
+/*
+ * How many backups to keep: the newest `last`, and the newest one in each of
+ * the newest `hourly` hours, `daily` days, and so on, that have a backup
+ * (grandfather-father-son). All 0 keeps everything.
+ */
+struct retention {
+	size_t last = 0;
+	size_t hourly = 0;
+	size_t daily = 0;
+	size_t weekly = 0;
+	size_t monthly = 0;
+};
+
+/*
+ * Index of the backups in a backup directory, kept in <dir>/catalog.
+ *
+ * The file is only ever appended to, a line for every backup added or
+ * removed, and is read once when the catalog is first used. Listing backups
+ * and deciding which to prune never touches the backups themselves. Backups
+ * made before there was a catalog are added the first time it is created.
+ *
+ * There is one catalog per directory, shared by every server backing up
+ * there, and safe to use from any thread.
+ */
+class Catalog {
+	std::string dir;
+	std::mutex mtx;
+	std::vector<struct catalog_entry> entries; // Oldest first
+	size_t records = 0; // Lines in the file, compacted once mostly removals
+
+	bool append(std::string);
+	void compact();
+	void import();
+	bool load();
+
+public:
+	/*
+	 * Record a new backup.
+	 */
+	bool add(const struct catalog_entry&);
+
+	/*
+	 * The backups of a server the retention policy no longer keeps, oldest
+	 * first.
+	 */
+	std::vector<struct catalog_entry> expired(std::string, const struct retention&);
+
+	/*
+	 * Every backup of a server, oldest first.
+	 */
+	std::vector<struct catalog_entry> list(std::string);
+
+	/*
+	 * Record that a backup was deleted.
+	 */
+	bool remove(std::string, std::string);
+
+	/*
+	 * SHA-256 of a file, in hex, or "-" if it can't be read.
+	 */
+	static std::string checksum(std::string);
+
+	/*
+	 * The catalog of a backup directory, read the first time it is asked for.
+	 * nullptr if there is a file in its place that isn't a catalog, which is
+	 * left alone rather than added to.
+	 */
+	static Catalog *get(std::string);
+
+	Catalog(std::string);
+};
+
+#endif
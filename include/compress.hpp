@@ -0,0 +1,40 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <string>
+#include "pool.hpp"
+
+/*
+ * Compresses files (e.g. rotated logs) with gzip in the background.
+ *
+ * A small, fixed number of worker threads do the work at the lowest CPU
+ * priority and in the idle IO class, so compression only uses what the
+ * servers leave over.
+ */
+class Compressor {
+	ThreadPool *pool;
+
+public:
+	/*
+	 * Queue a file to be compressed to <file>.gz at the given level (1-9).
+	 * The original is removed once the compressed file is complete.
+	 */
+	void compress(std::string, int);
+
+	/*
+	 * Returns the compressor, starting its threads the first time.
+	 */
+	static Compressor *get();
+
+	Compressor();
+	~Compressor();
+};
+
+/*
+ * Lower the calling thread to the lowest CPU priority and the idle IO class,
+ * for good (raising it again takes privileges the daemon may not have), so
+ * only on threads that do nothing else.
+ */
+void becomeIdle();
+
+#endif
@@ -1,17 +1,55 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
 #include <map>
 #include <string>
+#include <sys/types.h>
+#include <time.h>
+#include <utility>
 #include "server.hpp"
 
+struct conf_section;
+
+/*
+ * The config file, and the servers it defines.
+ *
+ * Reading it again only touches servers whose [server] block changed since
+ * it was last applied, and each of those is restarted at most once. User and
+ * group names are looked up once, not for every block, and kept for a while
+ * so reloads don't go back to NSS (which may mean LDAP) each time.
+ */
 class Config {
 	bool parse_error;
 	std::string path;
+	size_t jobs;
+	size_t backup_jobs;
+	time_t backup_stagger;
+	size_t start_jobs;
 	std::map<std::string, Server*> servers;
+	std::map<std::string, struct conf_section*> sections; // As last applied to each server
+	std::map<std::string, std::pair<uid_t, time_t>> users; // Looked up, and when
+	std::map<std::string, std::pair<gid_t, time_t>> groups;
+
+	bool lookupGroup(std::string, size_t, gid_t&);
+	bool lookupUser(std::string, size_t, uid_t&);
 
 public:
 	bool error();
+	size_t getBackupJobs();
+	time_t getBackupStagger();
+	size_t getJobs();
+	std::string getPath();
+	size_t getStartJobs();
 	std::map<std::string, Server*> getServers();
+
+	/*
+	 * Read the config file again and apply it. Returns false, changing
+	 * nothing, if it can't be read or has an error.
+	 */
 	bool parseConfigFile();
 
 	Config(std::string);
 	~Config();
 };
+
+#endif
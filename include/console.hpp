@@ -0,0 +1,86 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <functional>
+#include <string>
+#include <time.h>
+
+/*
+ * The pipe a server's processes read their input (console commands) from.
+ *
+ * Commands are queued and written without blocking as the server reads them,
+ * picking up after partial writes. A server that stops reading can't stall the
+ * supervisor: once too much input is queued further commands are dropped, and
+ * if it accepts nothing for too long the queue is thrown away.
+ *
+ * Everything but the constructor and setters runs on the supervisor thread.
+ */
+class Console {
+	int pipefd[2] = { -1, -1 };
+	std::string queue;
+	size_t sent = 0; // Bytes at the front of the queue already written
+	size_t limit = 0; // 0 for no limit
+	time_t timeout = 0; // 0 to wait forever
+	unsigned long timer = 0;
+	std::function<void(size_t)> on_stall;
+
+	// Bytes ever written to the pipe, and how many of them had been read at
+	// the last stall check
+	unsigned long written = 0;
+	unsigned long consumed = 0;
+
+	void check();
+	void flush();
+	void stall();
+	size_t unread();
+	void watchStall();
+	void watchWritable(bool);
+
+public:
+	/*
+	 * Create the pipe.
+	 */
+	bool open();
+
+	/*
+	 * Read end of the pipe, to be given to child processes as stdin. -1 if not
+	 * open.
+	 */
+	int output();
+
+	/*
+	 * Close the pipe, dropping anything still queued.
+	 */
+	void close();
+
+	/*
+	 * Queue input for the server. Returns false if it was dropped because too
+	 * much is already queued, unless forced (for commands the daemon itself
+	 * depends on, like stop).
+	 */
+	bool write(std::string, bool = false);
+
+	/*
+	 * Number of bytes the server has not read yet, whether still queued or
+	 * already in the pipe.
+	 */
+	size_t pending();
+
+	/*
+	 * Drop new input once this many bytes are queued (0 for no limit).
+	 */
+	void setLimit(size_t);
+
+	/*
+	 * Throw away queued input if the server reads none of its input for this
+	 * many seconds (0 to wait forever), then call the stall callback with the
+	 * number of bytes thrown away.
+	 */
+	void setTimeout(time_t);
+	void onStall(std::function<void(size_t)>);
+
+	Console();
+	~Console();
+};
+
+#endif
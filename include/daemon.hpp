@@ -0,0 +1,92 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "config.hpp"
+#include "event.hpp"
+#include "pool.hpp"
+#include "protocol.hpp"
+#include "scheduler.hpp"
+#include "server.hpp"
+#include "startup.hpp"
+#include "usock.hpp"
+#include "watcher.hpp"
+
+// Sends a reply (partial or final) to the request being handled
+typedef std::function<void(enum status, std::string)> Reply;
+
+class Daemon {
+	Config *config;
+	std::map<std::string, Server*> servers;
+
+	// Control socket and connected clients, keyed by connection number (file
+	// descriptors get reused, so replies to a closed client are dropped)
+	Socket *sock;
+	unsigned long next_client = 1;
+	std::map<unsigned long, Socket*> clients;
+	// Clients following a server's logs, cleared when the client goes away
+	std::multimap<unsigned long, std::shared_ptr<std::atomic<bool>>> followers;
+
+	EventLoop loop;
+	// Anything that may block (stopping a server, reloading) runs here, so the
+	// event loop only ever parses and dispatches
+	ThreadPool *actions;
+	// Actions on every server are fanned out here, `jobs` at a time
+	ThreadPool *fanout;
+	size_t jobs;
+	// Starts scheduled backups
+	Scheduler *scheduler;
+	// Starts default servers a few at a time
+	Startup *startup;
+	// Reloads the config when it changes
+	Watcher *watcher;
+	// Servers being restored (on a backup worker), with the commands for them
+	// held until it is done. Only used on the actions thread.
+	std::map<std::string, std::vector<std::function<void()>>> restoring;
+	// Restores still to hand their replies to the actions thread
+	std::mutex restores_mtx;
+	std::condition_variable restores_cv;
+	size_t restores = 0;
+
+	// Event handlers
+	void acceptClient();
+	void clientEvent(unsigned long, uint32_t);
+	void closeClient(unsigned long);
+	void configChanged();
+
+	// Command handling
+	size_t forEachServer(std::function<bool(Server*)>, std::function<void(Server*)>);
+	void handleRequest(unsigned long, std::string_view);
+	void runCommand(struct request, Reply);
+	Reply replyTo(unsigned long, unsigned long);
+	void restored(std::string, std::string, bool, bool, Reply);
+	void sendBackups(unsigned long, struct request);
+	void sendLogs(unsigned long, struct request);
+	void sendOutput(unsigned long, unsigned long, std::string, std::shared_ptr<std::atomic<bool>>);
+	void sendReply(unsigned long, struct reply);
+	void sendStatus(unsigned long, struct request);
+	void updateConfig();
+
+public:
+	/*
+	 * Serve clients on the control socket until a quit command is received.
+	 */
+	void run();
+
+	/*
+	 * Stop every running server.
+	 */
+	void stopAll();
+
+	Daemon(Config*, Socket*);
+	~Daemon();
+};
+
+#endif
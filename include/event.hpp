@@ -0,0 +1,87 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <stdint.h>
+
+/*
+ * An epoll based event loop. Apart from post and stop, members must only be
+ * called from the thread running the loop (or before it starts).
+ */
+class EventLoop {
+	int epfd;
+	int wakefd;
+	bool stopped = false;
+
+	// Registered file descriptors, keyed by a registration id so that stale
+	// events for a removed (and possibly reused) fd are never misdelivered
+	uint64_t next_id = 1;
+	std::map<uint64_t, std::function<void(uint32_t)>> handlers;
+	std::map<int, uint64_t> ids;
+
+	// Timers, by id and by deadline
+	typedef std::chrono::steady_clock::time_point time_point;
+	unsigned long next_timer = 1;
+	std::map<unsigned long, std::pair<time_point, std::function<void()>>> timers;
+	std::multimap<time_point, unsigned long> deadlines;
+
+	// Functions queued from other threads
+	std::mutex post_mtx;
+	std::queue<std::function<void()>> posted;
+
+	void runPosted();
+	void runTimers();
+	int timeout();
+
+public:
+	/*
+	 * Watch a file descriptor for the given epoll events. The handler is called
+	 * (on the loop's thread) with the events that occurred.
+	 */
+	bool add(int, uint32_t, std::function<void(uint32_t)>);
+
+	/*
+	 * Call a function (on the loop's thread) after the given number of
+	 * milliseconds. Returns an id for cancel.
+	 */
+	unsigned long after(unsigned long, std::function<void()>);
+
+	/*
+	 * Cancel a timer that has not fired yet.
+	 */
+	void cancel(unsigned long);
+
+	/*
+	 * Change the events watched for on a file descriptor.
+	 */
+	bool modify(int, uint32_t);
+
+	/*
+	 * Stop watching a file descriptor. Does not close it.
+	 */
+	void remove(int);
+
+	/*
+	 * Queue a function to be run on the loop's thread. Safe to call from any thread.
+	 */
+	void post(std::function<void()>);
+
+	/*
+	 * Dispatch events until stop is called.
+	 */
+	void run();
+
+	/*
+	 * Make run return after the current iteration. Safe to call from any thread.
+	 */
+	void stop();
+
+	EventLoop();
+	~EventLoop();
+};
+
+#endif
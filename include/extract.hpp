@@ -0,0 +1,80 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+class ThreadPool;
+struct extract_file;
+
+/*
+ * A symbolic ('2') or hard ('1') link, made once every file is extracted.
+ */
+struct extract_link {
+	char type;
+	std::string path;   // Relative to the directory extracted to
+	std::string target; // For hard links, relative to it too
+	struct stat st;
+};
+
+/*
+ * Extracts a gzip compressed tar file (as written by Archive, or tar -zcf)
+ * into a new directory.
+ *
+ * Decompressing, reading the tar stream and writing files overlap: one thread
+ * inflates the archive (every gzip member in turn), the caller's thread reads
+ * entries from what it inflated, and file contents are written out by several
+ * threads at once. Only a bounded amount of data is in memory at a time.
+ *
+ * Entries may not leave the directory (absolute paths, ".."), and links are
+ * only made once every file is written, so nothing is ever written through
+ * one.
+ */
+class Extractor {
+	size_t threads;
+	size_t memory;
+
+	// Pipeline state, for the archive being extracted
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<std::vector<unsigned char>> inflated; // Waiting to be read, oldest first
+	bool inflating = false;
+	bool failed = false;
+	size_t pending = 0;                     // Bytes handed to workers, not written yet
+	ThreadPool *workers = nullptr;
+	std::vector<unsigned char> block;       // Being read
+	size_t position = 0;
+	std::string dest;
+	std::set<std::string> made;             // Directories created so far
+	std::vector<std::pair<std::string, struct stat>> directories; // To give their attributes at the end
+	std::vector<struct extract_link> links;
+
+	bool decompress(int);
+	void fail();
+	void finishFile(struct extract_file*);
+	bool makeDirectory(std::string);
+	bool read(unsigned char*, size_t);
+	bool readEntries();
+	bool writeFile(std::string, const struct stat&, unsigned long long);
+
+public:
+	/*
+	 * Extract an archive into a directory, which must not exist yet. Returns
+	 * false on error (including a damaged archive), leaving whatever was
+	 * extracted to be removed.
+	 */
+	bool extract(std::string, std::string);
+
+	/*
+	 * Write files on this many threads, using at most this much memory for
+	 * data not yet written (0 for the defaults: every CPU, and 64 MiB).
+	 */
+	Extractor(size_t = 0, size_t = 0);
+};
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <vector>
+#include "buffer.hpp"
+
+/*
+ * Collects the output of a server's processes through a pipe, and appends it
+ * to the server's log file with a timestamp on every line.
+ *
+ * Lines are written straight out of the receive buffer in batches with writev.
+ * The file is rotated (renamed, and a new one opened) once it grows past a size
+ * or age limit, which never blocks the processes writing to the pipe. Rotated
+ * files may be handed to the Compressor, so that never blocks them either.
+ *
+ * The most recent output is also kept in a fixed size ring in memory, and can
+ * be followed as it is written, so it can be shown without reading the file.
+ *
+ * Everything but the constructor and setters runs on the supervisor thread.
+ */
+class Log {
+	std::string file;
+	uid_t user;
+	gid_t group;
+	size_t max_size = 0; // 0 for no limit
+	time_t max_age = 0;
+	int compress = 0; // gzip level for rotated files, 0 to keep them as is
+
+	int fd = -1;
+	size_t size = 0;
+	time_t opened = 0;
+	int pipefd[2] = { -1, -1 };
+	LineBuffer buffer;
+
+	// Cached timestamp prefix, and the second it is for
+	time_t stamped = -1;
+	char stamp[32];
+	size_t stamp_length = 0;
+
+	// Ring of the most recent output, exactly as written to the file
+	std::vector<char> ring;
+	size_t ring_end = 0;
+	bool ring_full = false;
+	std::vector<std::function<bool(std::string_view)>> followers;
+	std::function<bool(std::string_view)> watcher;
+
+	void keep(const struct iovec*, size_t);
+	bool openFile();
+	void readOutput(bool);
+	void rotate();
+	void writeLines(bool);
+
+public:
+	/*
+	 * Create the pipe and log file, and start collecting output.
+	 */
+	bool open();
+
+	/*
+	 * Write end of the pipe, to be given to child processes as stdout and
+	 * stderr. -1 if not open.
+	 */
+	int input();
+
+	/*
+	 * Write out whatever output is left, and close the pipe and file. Done on
+	 * the supervisor thread, so it may be called from any thread.
+	 */
+	void close();
+
+	/*
+	 * Set the log file, and the owner it is created with.
+	 */
+	void setFile(std::string, uid_t, gid_t);
+
+	/*
+	 * Rotate the log file once it reaches this size (0 to disable).
+	 */
+	void setMaxSize(size_t);
+
+	/*
+	 * Rotate the log file once it is this many seconds old (0 to disable).
+	 */
+	void setMaxAge(time_t);
+
+	/*
+	 * Compress rotated files in the background at this gzip level (0 to
+	 * disable).
+	 */
+	void setCompress(int);
+
+	/*
+	 * Pass the recent output kept in memory (whole lines only) to a callback,
+	 * and if following, every batch of lines written after that until the
+	 * callback returns false. Followers are called with an empty view when
+	 * the log is destroyed.
+	 */
+	void tail(std::function<bool(std::string_view)>, bool);
+
+	/*
+	 * Pass every line read from now on (without its timestamp) to a callback,
+	 * until it returns false or another is set (nullptr for none).
+	 */
+	void watch(std::function<bool(std::string_view)>);
+
+	Log();
+	~Log();
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * A regular expression to look for in lines of server output.
+ *
+ * Running a regex over every line is slow, so the plain text every match must
+ * contain (e.g. "Saved the game" in "^.*Saved the game.*$") is picked out when
+ * the pattern is compiled. Lines without it are skipped with a simple search,
+ * and the regex only runs on the few lines that might match.
+ */
+class Pattern {
+	std::string source;
+	std::regex regex;
+	bool compiled = false;
+	std::vector<std::string> literals; // A match contains one of these (if any)
+
+public:
+	/*
+	 * Use a new regular expression (ECMAScript syntax). An empty one never
+	 * matches. Returns false, and keeps the old one, if it isn't valid.
+	 */
+	bool compile(std::string);
+
+	/*
+	 * The regular expression, as given to compile.
+	 */
+	std::string getSource();
+
+	/*
+	 * The plain text every match contains one of, empty if a match may contain
+	 * anything.
+	 */
+	std::vector<std::string> getLiterals();
+
+	/*
+	 * Whether the regular expression matches anywhere in a line.
+	 */
+	bool match(std::string_view);
+
+	/*
+	 * Same as match, without first looking for the plain text (for when the
+	 * caller already found it).
+	 */
+	bool search(std::string_view);
+};
+
+#endif
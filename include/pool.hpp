@@ -0,0 +1,38 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+	std::vector<std::thread> workers;
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::queue<std::function<void()>> jobs;
+	bool stopping = false;
+
+	// Thread function
+	void work();
+
+public:
+	/*
+	 * Queue a job to be run by the next free worker.
+	 */
+	void submit(std::function<void()>);
+
+	/*
+	 * Start the given number of worker threads (at least one).
+	 */
+	ThreadPool(size_t);
+
+	/*
+	 * Finishes every queued job, then joins the workers.
+	 */
+	~ThreadPool();
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+#include <string_view>
+
+/*
+ * Control protocol
+ *
+ * Every message is a single line, with fields separated by tabs. A client may
+ * send any number of requests without waiting for replies:
+ *   <id> TAB <command> [TAB <server> [TAB <argument>]]
+ * No field may contain a line break, and only the argument may contain tabs.
+ * Requests with a line break in them are rejected rather than split.
+ * The daemon answers each request with zero or more partial replies, followed
+ * by exactly one final reply, all carrying the id of the request:
+ *   <id> TAB <status> TAB <text>
+ * Replies to different requests may be interleaved. A client must keep the
+ * connection open until it has the final reply to every request it sent.
+ *
+ * The logs command (with argument "-f" to keep following) sends a server's
+ * recent output as one partial reply per line. When following, the final reply
+ * only comes if the server is removed or the client falls too far behind.
+ *
+ * The backups command lists a server's backups, oldest first, one partial reply
+ * each, from the catalog of its backup directory.
+ *
+ * The restore command (with the name of one of those backups as argument)
+ * stops the server if it is running, replaces its directory (or just its
+ * worlds) with the backup, and starts it again. Later commands for the same
+ * server wait until it is done; commands for other servers don't.
+ */
+
+enum status {
+	st_partial   = 100, // More replies will follow for this request
+	st_ok        = 200,
+	st_bad       = 400, // Malformed or unknown request
+	st_not_found = 404, // No such server
+	st_conflict  = 409, // Server is not in the right state (e.g. already running)
+	st_error     = 500,
+};
+
+struct request {
+	unsigned long id;
+	std::string command;
+	std::string server;
+	std::string argument;
+};
+
+struct reply {
+	unsigned long id;
+	enum status code;
+	std::string text;
+};
+
+/*
+ * Returns true if this status ends a request.
+ */
+bool isFinal(enum status);
+
+/*
+ * Returns true if this status ends a request successfully.
+ */
+bool isSuccess(enum status);
+
+std::string formatRequest(const struct request&);
+bool parseRequest(std::string_view, struct request&);
+
+std::string formatReply(const struct reply&);
+bool parseReply(std::string_view, struct reply&);
+
+#endif
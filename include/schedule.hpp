@@ -0,0 +1,40 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdint.h>
+#include <string>
+#include <time.h>
+
+/*
+ * When something should happen, as a crontab(5) style line in local time:
+ *   <minute> <hour> <day of month> <month> <day of week>
+ * Each field is *, a number, a range (a-b), any of those with a step (*\/15,
+ * 8-18/2), or a comma separated list of them. Days of the week are 0-7, with
+ * Sunday as both 0 and 7. As in cron, if both day fields are restricted a day
+ * matching either one counts. @hourly, @daily, @weekly and @monthly work too.
+ */
+class Schedule {
+	uint64_t minutes = 0;
+	uint32_t hours = 0;
+	uint32_t days = 0;
+	uint16_t months = 0;
+	uint8_t weekdays = 0;
+	bool any_day = false;
+	bool any_weekday = false;
+
+	bool matchesDay(const struct tm&);
+
+public:
+	/*
+	 * Read a schedule. Returns false, leaving the old one, if it isn't valid.
+	 */
+	bool parse(std::string);
+
+	/*
+	 * The first time after the given one (to the minute) the schedule matches,
+	 * or -1 if it never does (e.g. 30 February).
+	 */
+	time_t next(time_t);
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <time.h>
+#include <vector>
+#include "event.hpp"
+#include "pool.hpp"
+#include "schedule.hpp"
+#include "server.hpp"
+
+/*
+ * A backup waiting for its minute in the timer wheel.
+ */
+struct schedule_entry {
+	std::string server;
+	time_t minute; // Minutes since the epoch
+};
+
+/*
+ * Starts backups of servers on the schedule set in their config, by calling
+ * Server::backup just like the backup command does.
+ *
+ * Upcoming backups sit in a timer wheel of one slot per minute of the hour, so
+ * every minute only the backups in that minute's slot are looked at. Backups
+ * that come due are queued, and started `jobs` at a time, at least `stagger`
+ * seconds apart, so servers sharing a schedule don't all hit the disk at once.
+ *
+ * Everything but the constructor runs on the daemon's actions thread, like
+ * config reloads, so servers can't be removed under it.
+ */
+class Scheduler {
+	EventLoop *loop;
+	ThreadPool *actions;
+	std::map<std::string, Server*> servers;
+	std::map<std::string, Schedule> schedules;
+	size_t jobs = 1;
+	time_t stagger = 0;
+
+	std::vector<std::vector<struct schedule_entry>> wheel;
+	time_t current = 0; // The last minute handled
+	std::deque<std::string> waiting;
+	std::set<std::string> running;
+	time_t last_start = 0;
+	bool retry_armed = false;
+	std::set<unsigned long> timers; // Armed by at, only touched on the loop's thread
+
+	void at(time_t, std::function<void()>);
+	void dispatch();
+	void finished(std::string);
+	void insert(std::string, time_t);
+	void tick();
+
+public:
+	/*
+	 * Use new servers and settings (after the config is read). Schedules are
+	 * taken from the servers, and counted again from now.
+	 */
+	void update(std::map<std::string, Server*>, size_t, time_t);
+
+	/*
+	 * Timers are run on the event loop, and their work on the actions pool.
+	 */
+	Scheduler(EventLoop*, ThreadPool*);
+	~Scheduler();
+};
+
+#endif
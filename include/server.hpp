@@ -1,43 +1,132 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-#include <condition_variable>
-#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
 #include <queue>
+#include <set>
 #include <string>
-#include <thread>
 #include <vector>
+#include "catalog.hpp"
+#include "console.hpp"
+#include "log.hpp"
+#include "pattern.hpp"
+#include "tracker.hpp"
+
+class ThreadPool;
+
+/*
+ * What a server is doing, as far as its output tells.
+ */
+enum server_state {
+	ss_stopped,    // Not running
+	ss_starting,   // Running, and has not said it is ready yet
+	ss_ready,      // Said it is ready for players
+	ss_stopping,   // Told to stop, or said it is stopping
+	ss_backing_up, // Saves are off for a backup
+	ss_crashed     // Said it crashed, or exited without being told to
+};
+
+/*
+ * The name of a state, as shown by --status.
+ */
+std::string stateName(enum server_state);
 
 class Server {
 	// Config related variables
 	std::string name;
-	bool default_startup;
+	bool default_startup = true;
 	uid_t user = -1;
 	gid_t group = -1;
 	std::string path;
+	std::vector<std::string> worlds;
 	std::string backup_dir;
+	std::string backup_format = "tar";
+	size_t backup_threads = 0;
+	size_t backup_memory = 0;
+	bool backup_snapshot = true;
+	size_t backup_rate = 0;
+	std::string backup_schedule;
+	struct retention retention;
+	Pattern save_pattern;
+	time_t save_timeout = 2 * 60;
 	std::string log;
+	size_t log_size = 0;
+	time_t log_age = 0;
+	int log_compress = 0;
+	size_t input_limit = 1024 * 1024;
+	time_t input_timeout = 0;
 	std::vector<std::string> before;
 	std::string run;
 	std::vector<std::string> after;
 	std::string notify;
+	int start_priority = 0;
+	std::vector<std::string> start_after;
+	Pattern ready_pattern;
+	time_t ready_timeout = 3 * 60;
+	Pattern stop_pattern;
+	Pattern crash_pattern;
+	std::vector<time_t> restart_countdown = { 10 }; // Warnings before a restart, longest first
+	time_t stop_timeout = 2 * 60;
+	time_t kill_timeout = 30;
 
-	//std::vector<std::string> worlds;
-
-	// Thread related variables
-	bool running = false;
-	std::thread *thread;
-	std::mutex *mtx;
-	std::condition_variable *cv;
+	// Supervision state, only changed on the supervisor's thread
+	std::atomic<bool> running = false;
+	enum server_state state = ss_stopped;
+	bool busy = false;         // Starting, backing up or restarting; commands wait
+	bool ready = false;        // Said it's ready for players since it was launched
+	bool ready_told = false;   // on_ready was called for this launch
+	bool stop_queued = false;
+	bool stopping = false;
+	bool restarting = false;
+	bool saves_off = false;     // Sent save-off for a backup, and not save-on yet
+	bool archiving = false;     // A backup is being written, maybe after saves are back on
+	bool restoring = false;     // Its directory is being replaced, so it can't start
+	unsigned long generation = 0; // Changes whenever the server starts or stops
+	unsigned long save_timer = 0; // Waiting for the server to finish saving before a backup
+	unsigned long ready_timer = 0; // Waiting for the server to say it's ready
+	unsigned long restart_timer = 0; // Counting down to a restart
+	unsigned long stop_timer = 0;  // Waiting for the server to stop before signalling it
+	pid_t child = -1;
+	std::chrono::steady_clock::time_point launched;
+	long ready_time = -1;       // Milliseconds from launch to ready, -1 until then
 	std::queue<std::string> commands;
-	int fds[2];
+	std::vector<std::promise<void>> stop_waiters;
+	std::atomic<unsigned> jobs = 0; // Run by a thread pool, and not done posting back
+	std::vector<std::promise<void>> job_waiters;
+	std::function<void(bool)> on_backup;
+	std::function<void(bool)> on_ready;
+	Tracker tracker;            // Files written since last_backup
+	std::string last_backup;    // Made while tracking, "" if none yet
+	std::shared_ptr<std::set<std::string>> backup_changes; // All the backup being made reads, nullptr for everything
+	Console console;
+	Log output;
 
-	// Thread utilities
-	bool hasCommand();
-	std::string popCommand();
-	// Thread function
-	void runServer();
-	pid_t execute(std::vector<std::string>);
+	// Supervision steps
+	void archive(unsigned long);
+	void archived(unsigned long, bool, std::string);
+	void becameReady(bool);
+	void childExited(int);
+	void countdown(time_t);
+	void escalate(int);
+	void finish();
+	void launch();
+	std::string logFile();
+	void runCommands();
+	void runJob(ThreadPool*, std::function<void()>);
+	void runThen(std::vector<std::string>, std::function<void()>);
+	void saved(unsigned long, bool);
+	void scan(std::string_view);
+	bool setPattern(Pattern&, std::string);
+	void shutdown();
+	void snapshotted(unsigned long, std::string);
+	void stalled(size_t);
+	void store(unsigned long, std::string, bool);
+	void track();
+	pid_t execute(std::vector<std::string>, std::function<void(int)>);
 
 public:
 	// Config related getters and setters
@@ -46,28 +135,58 @@ public:
 	bool setUser(uid_t);                      uid_t getUser();
 	bool setGroup(gid_t);                     gid_t getGroup();
 	bool setPath(std::string);                std::string getPath();
-	void setBackup(std::string);
+	void setWorlds(std::vector<std::string>); std::vector<std::string> getWorlds();
+	void setBackup(std::string);              std::string getBackup();
+	void setBackupFormat(std::string);        std::string getBackupFormat();
+	void setBackupThreads(size_t);            size_t getBackupThreads();
+	void setBackupMemory(size_t);             size_t getBackupMemory();
+	void setBackupSnapshot(bool);             bool getBackupSnapshot();
+	void setBackupRate(size_t);               size_t getBackupRate();
+	void setBackupSchedule(std::string);      std::string getBackupSchedule();
+	void setRetention(struct retention);      struct retention getRetention();
+	bool setSavePattern(std::string);         std::string getSavePattern();
+	void setSaveTimeout(time_t);              time_t getSaveTimeout();
 	bool setLog(std::string);                 std::string getLog();
+	void setLogSize(size_t);                  size_t getLogSize();
+	void setLogAge(time_t);                   time_t getLogAge();
+	void setLogCompress(int);                 int getLogCompress();
+	void setInputLimit(size_t);               size_t getInputLimit();
+	void setInputTimeout(time_t);             time_t getInputTimeout();
 	void setBefore(std::vector<std::string>); std::vector<std::string> getBefore();
 	bool setRun(std::string);                 std::string getRun();
 	void setAfter(std::vector<std::string>);  std::vector<std::string> getAfter();
 	void setNotify(std::string);              std::string getNotify();
-
-	//void addWorld(std::string);
-
-	// Thread related getters
-	std::mutex *getMtx();
-	std::condition_variable *getCv();
+	void setStartPriority(int);               int getStartPriority();
+	void setStartAfter(std::vector<std::string>); std::vector<std::string> getStartAfter();
+	bool setReadyPattern(std::string);        std::string getReadyPattern();
+	void setReadyTimeout(time_t);             time_t getReadyTimeout();
+	bool setStopPattern(std::string);         std::string getStopPattern();
+	bool setCrashPattern(std::string);        std::string getCrashPattern();
+	void setRestartCountdown(std::vector<time_t>); std::vector<time_t> getRestartCountdown();
+	void setStopTimeout(time_t);              time_t getStopTimeout();
+	void setKillTimeout(time_t);              time_t getKillTimeout();
 
 	// Server communication/running
 	bool start();
 	bool restart();
+	bool cancelRestart();
 	bool stop();
 	void send(std::string);
+	size_t pendingInput();
+	enum server_state getState();
+	long getReadyTime();
 	bool backup();
+	bool restore(struct catalog_entry, std::function<void(bool)>);
+	void onBackup(std::function<void(bool)>);
+	void onReady(std::function<void(bool)>);
+	void tail(std::function<bool(std::string_view)>, bool);
 
 	// Constructors and Destructors
 	Server(std::string);
+	/*
+	 * Waits for backup jobs still running for this server (after stop) to
+	 * finish, since they post back to it.
+	 */
 	~Server();
 };
 
@@ -0,0 +1,82 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+class ThreadPool;
+
+/*
+ * Makes a point in time copy of a directory, so it can be backed up at leisure
+ * while the original keeps changing.
+ *
+ * Files are cloned (FICLONE, the ioctl behind cp --reflink) where the
+ * filesystem supports it, which shares their data until either copy is
+ * written and takes about as long as creating an empty file. Elsewhere they
+ * are copied, on several threads at once. Owners, permissions and
+ * modification times are kept, so the copy backs up exactly like the
+ * original.
+ */
+class Snapshot {
+	size_t threads;
+	std::vector<std::string> directories;
+	const std::set<std::string> *changes = nullptr;
+
+	// State of the snapshot being taken
+	std::mutex mtx;
+	std::condition_variable cv;
+	ThreadPool *workers = nullptr;
+	size_t pending = 0;
+	bool failed = false;
+	size_t cloned = 0;
+	size_t copied = 0;
+	// Directories to give their attributes once everything is copied into them
+	std::vector<std::pair<std::string, struct stat>> made;
+
+	bool copyDirectory(std::string, std::string);
+	bool copyEntry(std::string, std::string);
+	void copyFile(std::string, std::string, struct stat);
+
+public:
+	/*
+	 * Number of files cloned and copied by the last take().
+	 */
+	size_t getCloned();
+	size_t getCopied();
+
+	/*
+	 * Delete a snapshot (or anything else) and everything in it. Returns false
+	 * if something couldn't be deleted.
+	 */
+	static bool remove(std::string);
+
+	/*
+	 * Only copy these paths (relative to the directory given to take, and
+	 * whatever is under them), with the directories leading to them, for a
+	 * backup that takes the rest from the one before. nullptr for everything.
+	 */
+	void setChanges(const std::set<std::string>*);
+
+	/*
+	 * Only copy these directories (relative to the one given to take), with
+	 * the directories leading to them. Empty for everything.
+	 */
+	void setDirectories(std::vector<std::string>);
+
+	/*
+	 * Copy a directory to a new snapshot directory, replacing whatever was
+	 * there. Returns false on error, leaving a partial snapshot to remove().
+	 */
+	bool take(std::string, std::string);
+
+	/*
+	 * Copy on this many threads (0 for every CPU).
+	 */
+	Snapshot(size_t = 0);
+};
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+struct spawn_attr {
+	std::vector<std::string> args;
+	uid_t user = -1;      // Run as this user/group (-1 to keep the daemon's)
+	gid_t group = -1;
+	std::string cwd;      // Directory to run in (empty to keep the daemon's)
+	std::string output;   // File that stdout and stderr are appended to,
+	                      // relative to cwd (empty to keep the daemon's)
+	int input = -1;       // Becomes stdin (-1 to keep the daemon's)
+	int output_fd = -1;   // Becomes stdout and stderr, instead of `output`
+	bool session = false; // Start a new session (and process group), so it and
+	                      // everything it starts can be signalled together
+};
+
+/*
+ * Start a process without copying the daemon's address space.
+ *
+ * The child is created with clone(CLONE_VM | CLONE_VFORK), and only makes
+ * async-signal-safe system calls (everything is prepared beforehand) until it
+ * execs. Credentials, working directory and output are set up before exec.
+ *
+ * Returns the pid of the child, or -1 if it could not be created. If the child
+ * was created, but failed to exec, the reason is logged and the child exits
+ * with status 127. When pidfd is not NULL, it is set to a pidfd for the child
+ * (or -1, if the kernel does not support them).
+ */
+pid_t spawn(const struct spawn_attr&, int *pidfd);
+
+#endif
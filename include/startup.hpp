@@ -0,0 +1,64 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "event.hpp"
+#include "pool.hpp"
+#include "server.hpp"
+
+/*
+ * Starts the servers that start with the daemon (default=yes) a few at a
+ * time, instead of warming them all up at once.
+ *
+ * At most `jobs` servers are starting at a time. The next one is let go once
+ * one of them says it is ready (ready_pattern), takes longer than its
+ * ready_timeout, or stops. Servers waiting go in order of start_priority
+ * (highest first), but never before the servers in their start_after are
+ * ready. If those can never be ready (they wait for each other) the first
+ * one in line is started anyway.
+ *
+ * Everything but the constructor runs on the daemon's actions thread, like
+ * config reloads, so servers can't be removed under it.
+ */
+class Startup {
+	EventLoop *loop;
+	ThreadPool *actions;
+	std::map<std::string, Server*> servers;
+	size_t jobs = 1;
+
+	std::vector<std::string> waiting; // Not started yet, by name
+	std::set<std::string> starting;   // Started, and not ready yet
+
+	void dispatch();
+	void finished(std::string);
+	bool startable(std::string);
+
+public:
+	/*
+	 * Stop waiting to start a server ("" for every one), as it was started or
+	 * stopped by hand.
+	 */
+	void cancel(std::string);
+
+	/*
+	 * Start every default server. Returns how many there are.
+	 */
+	size_t start();
+
+	/*
+	 * Use new servers and settings (after the config is read).
+	 */
+	void update(std::map<std::string, Server*>, size_t);
+
+	/*
+	 * Readiness is heard of on the event loop, and acted on in the actions
+	 * pool.
+	 */
+	Startup(EventLoop*, ThreadPool*);
+	~Startup();
+};
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include <functional>
+#include <sys/types.h>
+#include <thread>
+#include "event.hpp"
+
+/*
+ * A single reactor thread that supervises every child process of the daemon.
+ *
+ * Child exits are noticed through pidfds, so supervising a process costs one
+ * file descriptor instead of a thread blocked in waitpid. Servers do all of
+ * their work (spawning, timers, writing to the console) on this thread.
+ */
+class Supervisor {
+	EventLoop loop;
+	std::thread *thread;
+
+public:
+	/*
+	 * Run a function on the supervisor thread, and wait for it to return.
+	 */
+	void call(std::function<void()>);
+
+	/*
+	 * Access the event loop. Only use from the supervisor thread!
+	 */
+	EventLoop *events();
+
+	/*
+	 * Returns true if called from the supervisor thread.
+	 */
+	bool inThread();
+
+	/*
+	 * Run a function on the supervisor thread, without waiting for it.
+	 */
+	void post(std::function<void()>);
+
+	/*
+	 * Call a function (on the supervisor thread) with the wait status of the
+	 * given child once it exits, and reap it. Only use from the supervisor
+	 * thread! If a pidfd for the child is given, the supervisor takes ownership
+	 * of it. Returns false if the child can't be watched.
+	 */
+	bool watch(pid_t, std::function<void(int)>, int pidfd = -1);
+
+	/*
+	 * Returns the supervisor, starting its thread the first time.
+	 */
+	static Supervisor *get();
+
+	Supervisor();
+	~Supervisor();
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <chrono>
+#include <mutex>
+#include <stddef.h>
+
+/*
+ * Limits how fast data is read, e.g. by a backup, so it leaves the disk to
+ * the servers.
+ *
+ * A token bucket: tokens (bytes) are added at a fixed rate, up to a small
+ * burst, and every read takes what it used. Once they run out, readers sleep
+ * until the bucket has refilled enough to pay for what they took. Safe to
+ * share between threads, which then share the rate.
+ */
+class Throttle {
+	std::mutex mtx;
+	double rate;   // Bytes per second, 0 for no limit
+	double burst;
+	double tokens;
+	std::chrono::steady_clock::time_point filled;
+
+public:
+	/*
+	 * Account for bytes read, sleeping if they went over the rate.
+	 */
+	void take(size_t);
+
+	/*
+	 * Allow this many bytes per second (0 for no limit).
+	 */
+	Throttle(size_t);
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef TRACKER_H
+#define TRACKER_H
+
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+ * Keeps track of what changed under a server's directory (or just its
+ * worlds) with inotify, so a backup can tell whether there is anything to do,
+ * and only look at what changed instead of every file.
+ *
+ * Changes are paths relative to the directory. A changed directory stands for
+ * everything under it (it was created or moved in). Every directory gets a
+ * watch, added as directories appear. If events are lost (the kernel's queue
+ * overflowed, or there are more directories than allowed watches) everything
+ * counts as changed, until the next take.
+ *
+ * Everything runs on the supervisor thread, except for the first walk over
+ * the tree adding watches, which open hands back to be run elsewhere.
+ */
+class Tracker {
+	int fd = -1;
+	std::string root;
+	std::vector<std::string> directories; // Relative to root, empty for all of it
+	std::vector<std::string> excludes;    // Never tracked, nor anything named after them
+	std::set<std::string> missing;        // In directories, but not there (yet)
+	std::map<int, std::string> watches;   // Watch descriptor to directory, relative to root
+	std::set<std::string> changed;
+	bool everything = true;               // What changed isn't known
+	bool exhausted = false;               // Ran out of watches, stop trying
+	bool building = false;                // The first walk hasn't been handed over yet
+	unsigned long generation = 0;         // Changes whenever it is opened
+
+	void built(unsigned long, std::map<int, std::string>, std::set<std::string>, bool);
+	void mark(std::string);
+	void readEvents();
+	bool watch(std::string);
+	static bool watchTree(int, std::string, std::string, const std::vector<std::string>&, std::map<int, std::string>&);
+
+public:
+	/*
+	 * Stop tracking.
+	 */
+	void close();
+
+	/*
+	 * Start tracking a directory, or only the given directories in it, but
+	 * never the excluded paths. Until the first take after the watches are
+	 * built, everything counts as changed.
+	 *
+	 * Returns the walk that builds them, to be run off the supervisor thread
+	 * while the tracker is kept around, or nullptr if it can't track at all.
+	 */
+	std::function<void()> open(std::string, std::vector<std::string>, std::vector<std::string>);
+
+	/*
+	 * Count everything as changed, as if the last take never happened (for
+	 * when the backup it was for failed).
+	 */
+	void reset();
+
+	/*
+	 * Hand over what changed since the last take, and start counting again.
+	 * Returns false if that isn't known, and everything should be read.
+	 */
+	bool take(std::set<std::string>&);
+
+	~Tracker();
+};
+
+#endif
@@ -1,16 +1,22 @@
-#include <queue>
+#ifndef USOCK_H
+#define USOCK_H
+
 #include <string>
+#include <string_view>
 #include <sys/un.h>
+#include "buffer.hpp"
 
 class Socket {
-	int connectfd;
-	std::queue<std::string> messages;
+	LineBuffer incoming;
+	std::string outgoing;
+	size_t sent = 0; // Bytes at the front of outgoing already written
 	struct sockaddr_un sock;
 	int sockfd;
 
 public:
 	/*
-	 * Wait for, and accept the next connection.
+	 * Accept the next pending connection, returning a non-blocking file
+	 * descriptor for it (see Socket(int)).
 	 */
 	int accept();
 
@@ -34,28 +40,45 @@ public:
 	 */
 	int fd();
 
+	/*
+	 * Write as much queued output as possible. Returns false on error.
+	 */
+	bool flush();
+
 	/*
 	 * After calling read, this will return true until there all messages have been received.
 	 */
 	bool hasMessage();
 
 	/*
-	 * Listen for connections to the socket.
+	 * Listen for connections to the socket. The listening socket is made
+	 * non-blocking, so it can be watched by an EventLoop.
 	 */
 	int listen();
 
 	/*
-	 * Returns the next message in the queue (see hasMessage).
+	 * Returns the next message in the queue (see hasMessage). The view is only
+	 * valid until the next call to read.
 	 */
-	std::string nextMessage();
+	std::string_view nextMessage();
 
 	/*
-	 * Read a string from the socket, after a connection was accepted.
+	 * Returns how much output sendLine has queued that could not be written yet.
 	 */
-	void read();
+	size_t pending();
 
 	/*
-	 * Send a string through the socket followed by a new line.
+	 * Read everything currently available into the message queue. Does not
+	 * block on a non-blocking connection, and blocks until at least some data
+	 * arrives otherwise. Returns false once the peer has closed the connection
+	 * (or on error).
+	 */
+	bool read();
+
+	/*
+	 * Send a string through the socket followed by a new line. On a
+	 * non-blocking connection, whatever can't be written right away is queued
+	 * (see flush).
 	 */
 	void sendLine(std::string);
 
@@ -65,6 +88,11 @@ public:
 	 */
 	Socket(std::string);
 
+	/*
+	 * Wrap an already connected file descriptor (e.g. one returned by accept).
+	 */
+	Socket(int);
+
 	/*
 	 * Destructor that closes the open file descriptor for you.
 	 */
@@ -72,3 +100,5 @@ public:
 
 	//friend std::istream &operator>> (std::istream &in, Socket &s);
 };
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <functional>
+#include <string>
+#include "event.hpp"
+
+/*
+ * Watches a file (the config) with inotify, and calls back once it has been
+ * left alone for a couple of seconds, so a file written in several steps is
+ * only looked at when it is done.
+ *
+ * Both the file and its directory are watched: the file for changes made in
+ * place (and wherever a symbolic link to it points), the directory for the
+ * file being replaced by a rename, or deleted and written again.
+ *
+ * Everything runs on the event loop's thread.
+ */
+class Watcher {
+	EventLoop *loop;
+	std::function<void()> on_change;
+	std::string path;
+	std::string name;          // In its directory
+	int fd = -1;
+	int directory_wd = -1;
+	int file_wd = -1;
+	unsigned long timer = 0;   // Waiting for the file to settle
+
+	void changed();
+	void readEvents();
+	void watchFile();
+
+public:
+	/*
+	 * Stop watching.
+	 */
+	void close();
+
+	/*
+	 * Start watching a file, which need not exist yet.
+	 */
+	bool open(std::string);
+
+	/*
+	 * Calls back on the event loop's thread.
+	 */
+	Watcher(EventLoop*, std::function<void()>);
+	~Watcher();
+};
+
+#endif
@@ -0,0 +1,524 @@
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <openssl/evp.h>
+#include <set>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <zlib.h>
+#include "archive.hpp"
+#include "pool.hpp"
+#include "throttle.hpp"
+
+#define ARCHIVE_BLOCK  (1024 * 1024)
+#define ARCHIVE_DICT   32768
+#define ARCHIVE_MEMORY (64 * 1024 * 1024)
+// tar pads archives to a multiple of this
+#define TAR_RECORD     10240
+
+struct archive_block {
+	std::vector<unsigned char> input;
+	size_t used = 0;
+	std::vector<unsigned char> dict; // End of the block before this one
+	std::vector<unsigned char> output;
+	uLong crc = 0;
+	bool last = false;
+	bool done = false;
+	bool ok = false;
+};
+
+static struct archive_block *newBlock() {
+	struct archive_block *block = new struct archive_block;
+	block->input.resize(ARCHIVE_BLOCK);
+	return block;
+}
+
+static bool writeAll(int fd, const unsigned char *data, size_t size, EVP_MD_CTX *digest) {
+	if (digest && !EVP_DigestUpdate(digest, data, size))
+		return false;
+	while (size) {
+		ssize_t bytes = write(fd, data, size);
+		if (bytes == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += bytes;
+		size -= bytes;
+	}
+	return true;
+}
+
+// Fills a tar header field with an octal number, or base-256 if it won't fit
+static void octal(char *field, size_t size, unsigned long long value) {
+	if (value >> (3 * (size - 1))) {
+		for (size_t i = size - 1; i > 0; --i, value >>= 8)
+			field[i] = value & 0xff;
+		field[0] = (char)0x80;
+		return;
+	}
+	snprintf(field, size, "%0*llo", (int)size - 1, value);
+}
+
+bool Archive::addDirectory(std::string directory, std::string name) {
+	DIR *dirp = opendir(directory.c_str());
+	if (dirp == NULL) {
+		std::cerr << "Could not open " << directory << " for backup (" << errno << ")" << std::endl;
+		return false;
+	}
+	std::vector<std::string> names;
+	struct dirent *ent;
+	while ((ent = readdir(dirp)) != NULL)
+		if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."))
+			names.push_back(ent->d_name);
+	closedir(dirp);
+	std::sort(names.begin(), names.end());
+
+	for (const std::string &file : names) {
+		{
+			// Nothing more to do if the archive can't be written
+			std::lock_guard<std::mutex> lck(mtx);
+			if (failed)
+				return false;
+		}
+		std::string full = directory + '/' + file;
+		struct stat st;
+		if (lstat(full.c_str(), &st) == -1) {
+			// Deleted since the directory was read
+			if (errno == ENOENT)
+				continue;
+			std::cerr << "Could not stat " << full << " (" << errno << ")" << std::endl;
+			return false;
+		}
+		if (!addEntry(full, name + '/' + file, st))
+			return false;
+	}
+	return true;
+}
+
+bool Archive::addEntry(std::string full, std::string name, const struct stat &st) {
+	if (S_ISDIR(st.st_mode))
+		return appendHeader(name + '/', st, '5', "") && addDirectory(full, name);
+	if (S_ISLNK(st.st_mode)) {
+		std::vector<char> target(st.st_size + 1);
+		ssize_t length = readlink(full.c_str(), target.data(), target.size());
+		if (length == -1)
+			return true;
+		return appendHeader(name, st, '2', std::string(target.data(), length));
+	}
+	if (!S_ISREG(st.st_mode))
+		return true;
+	int fd = open(full.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return true;
+		std::cerr << "Could not open " << full << " for backup (" << errno << ")" << std::endl;
+		return false;
+	}
+	bool ok = appendHeader(name, st, '0', "") && appendFile(fd, st.st_size);
+	if (!ok)
+		std::cerr << "Could not read " << full << " (" << errno << ")" << std::endl;
+	close(fd);
+	return ok;
+}
+
+bool Archive::addParents(std::string source) {
+	// Directories worlds are in, which no part has an entry for, outer first
+	std::set<std::string> parents;
+	for (const std::string &directory : directories)
+		for (size_t slash = directory.find('/'); slash != std::string::npos; slash = directory.find('/', slash + 1))
+			parents.insert(directory.substr(0, slash));
+	for (const std::string &parent : parents) {
+		struct stat st;
+		if (stat((source + '/' + parent).c_str(), &st) == -1) {
+			// The worlds in it are skipped too
+			if (errno == ENOENT)
+				continue;
+			std::cerr << "Could not stat " << source << '/' << parent << " (" << errno << ")" << std::endl;
+			return false;
+		}
+		if (!appendHeader("./" + parent + '/', st, '5', ""))
+			return false;
+	}
+	return true;
+}
+
+void Archive::append(const void *data, size_t size) {
+	const unsigned char *next = (const unsigned char*)data;
+	while (size) {
+		if (current == nullptr)
+			current = newBlock();
+		size_t bytes = std::min(size, ARCHIVE_BLOCK - current->used);
+		if (next == NULL)
+			memset(current->input.data() + current->used, 0, bytes);
+		else {
+			memcpy(current->input.data() + current->used, next, bytes);
+			next += bytes;
+		}
+		current->used += bytes;
+		total += bytes;
+		size -= bytes;
+		if (current->used == ARCHIVE_BLOCK)
+			submit(false);
+	}
+}
+
+bool Archive::appendFile(int fd, off_t size) {
+	off_t remaining = size;
+	while (remaining > 0) {
+		if (current == nullptr)
+			current = newBlock();
+		// Read straight into the block
+		size_t want = std::min((off_t)(ARCHIVE_BLOCK - current->used), remaining);
+		ssize_t bytes = read(fd, current->input.data() + current->used, want);
+		if (bytes == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		// The file shrank since it was listed, the header promised the rest
+		if (bytes == 0) {
+			append(NULL, remaining);
+			break;
+		}
+		if (throttle)
+			throttle->take(bytes);
+		current->used += bytes;
+		total += bytes;
+		remaining -= bytes;
+		if (current->used == ARCHIVE_BLOCK)
+			submit(false);
+	}
+	append(NULL, (512 - size % 512) % 512);
+	return true;
+}
+
+bool Archive::appendHeader(std::string name, const struct stat &st, char type, std::string link) {
+	// GNU extension for names that don't fit: a pseudo file holding the name
+	if (name.size() > 100 || link.size() > 100) {
+		struct stat empty = {};
+		if (name.size() > 100) {
+			empty.st_size = name.size() + 1;
+			appendHeader("././@LongLink", empty, 'L', "");
+			append(name.c_str(), name.size() + 1);
+			append(NULL, (512 - empty.st_size % 512) % 512);
+		}
+		if (link.size() > 100) {
+			empty.st_size = link.size() + 1;
+			appendHeader("././@LongLink", empty, 'K', "");
+			append(link.c_str(), link.size() + 1);
+			append(NULL, (512 - empty.st_size % 512) % 512);
+		}
+	}
+
+	char header[512] = {};
+	memcpy(header, name.data(), std::min(name.size(), (size_t)100));
+	octal(header + 100, 8, st.st_mode & 07777);
+	octal(header + 108, 8, st.st_uid);
+	octal(header + 116, 8, st.st_gid);
+	octal(header + 124, 12, type == '0' || type == 'L' || type == 'K' ? st.st_size : 0);
+	octal(header + 136, 12, st.st_mtime);
+	header[156] = type;
+	memcpy(header + 157, link.data(), std::min(link.size(), (size_t)100));
+	memcpy(header + 257, "ustar  ", 8);
+	memset(header + 148, ' ', 8);
+	unsigned int sum = 0;
+	for (unsigned char c : header)
+		sum += c;
+	snprintf(header + 148, 8, "%06o", sum);
+	header[155] = ' ';
+	append(header, sizeof (header));
+	return true;
+}
+
+// Copies a finished part into the archive, hashing it on the way
+bool Archive::appendPart(int fd, std::string file) {
+	int in = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in == -1) {
+		std::cerr << "Could not open " << file << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	std::vector<unsigned char> buf(ARCHIVE_BLOCK);
+	bool ok = true;
+	for (;;) {
+		ssize_t bytes = read(in, buf.data(), buf.size());
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes <= 0) {
+			ok = bytes == 0;
+			break;
+		}
+		if (!writeAll(fd, buf.data(), bytes, digest)) {
+			ok = false;
+			break;
+		}
+		archive_size += bytes;
+	}
+	close(in);
+	return ok;
+}
+
+void Archive::compress(struct archive_block *block) {
+	z_stream strm = {};
+	bool ok = deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+	if (ok) {
+		if (!block->dict.empty())
+			deflateSetDictionary(&strm, block->dict.data(), block->dict.size());
+		// Room for the worst case, plus the flush marker
+		block->output.resize(deflateBound(&strm, block->used) + 64);
+		strm.next_in = block->input.data();
+		strm.avail_in = block->used;
+		strm.next_out = block->output.data();
+		strm.avail_out = block->output.size();
+		// Blocks end on a byte boundary (sync flush), so they can just be concatenated
+		int ret = deflate(&strm, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+		ok = block->last ? ret == Z_STREAM_END : ret == Z_OK && strm.avail_in == 0;
+		block->output.resize(block->output.size() - strm.avail_out);
+		deflateEnd(&strm);
+	}
+	block->crc = crc32(0, block->input.data(), block->used);
+	// The writer only needs the output
+	std::vector<unsigned char>().swap(block->input);
+	std::vector<unsigned char>().swap(block->dict);
+
+	std::lock_guard<std::mutex> lck(mtx);
+	block->ok = ok;
+	block->done = true;
+	cv.notify_all();
+}
+
+std::string Archive::getChecksum() {
+	return checksum;
+}
+
+unsigned long long Archive::getSize() {
+	return archive_size;
+}
+
+void Archive::setDirectories(std::vector<std::string> directories) {
+	this->directories = directories;
+}
+
+void Archive::setOwner(uid_t user, gid_t group) {
+	this->user = user;
+	this->group = group;
+}
+
+void Archive::setThrottle(Throttle *throttle) {
+	this->throttle = throttle;
+}
+
+bool Archive::stream(int fd, std::function<bool()> fill, unsigned long long &offset, bool end) {
+	// Enough blocks in flight to keep every thread busy, if memory allows
+	// (each block takes about twice its size, input and output)
+	max_blocks = std::max((size_t)2, std::min(threads * 2, memory / (2 * ARCHIVE_BLOCK)));
+	failed = false;
+	total = 0;
+	tail.clear();
+	workers = new ThreadPool(threads);
+	bool written = false;
+	std::thread writer([this, fd, &written]() { written = writeBlocks(fd); });
+
+	bool ok = fill();
+	if (ok) {
+		if (end) {
+			// End of archive: two empty records, padded out like tar does
+			append(NULL, 1024);
+			append(NULL, (TAR_RECORD - (offset + total) % TAR_RECORD) % TAR_RECORD);
+		}
+		submit(false);
+		submit(true);
+	}
+	else {
+		std::lock_guard<std::mutex> lck(mtx);
+		failed = true;
+		cv.notify_all();
+	}
+	writer.join();
+	// Waits for any blocks still being compressed
+	delete workers;
+	workers = nullptr;
+	for (struct archive_block *block : blocks)
+		delete block;
+	blocks.clear();
+	delete current;
+	current = nullptr;
+	offset += total;
+	return ok && written;
+}
+
+void Archive::submit(bool last) {
+	if (current == nullptr)
+		current = newBlock();
+	struct archive_block *block = current;
+	current = nullptr;
+	block->last = last;
+	block->dict = tail;
+	// Keep the end of this block for the next one
+	if (block->used >= ARCHIVE_DICT)
+		tail.assign(block->input.begin() + block->used - ARCHIVE_DICT, block->input.begin() + block->used);
+	else {
+		tail.insert(tail.end(), block->input.begin(), block->input.begin() + block->used);
+		if (tail.size() > ARCHIVE_DICT)
+			tail.erase(tail.begin(), tail.end() - ARCHIVE_DICT);
+	}
+
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		while (blocks.size() >= max_blocks && !failed)
+			cv.wait(lck);
+		if (failed) {
+			delete block;
+			return;
+		}
+		blocks.push_back(block);
+	}
+	workers->submit([this, block]() { compress(block); });
+}
+
+bool Archive::write(std::string source, std::string file) {
+	struct stat st;
+	if (stat(source.c_str(), &st) == -1) {
+		std::cerr << "Could not stat " << source << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	std::string temp = file + ".tmp";
+	int fd = open(temp.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == -1) {
+		std::cerr << "Could not create " << temp << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	if (user != (uid_t)-1 && fchown(fd, user, group) == -1 && errno != EPERM)
+		std::cerr << "Could not change owner of " << temp << " (" << errno << ")" << std::endl;
+
+	// Hashed on the way out, so the archive is never read back for it
+	digest = EVP_MD_CTX_new();
+	bool ok = EVP_DigestInit_ex(digest, EVP_sha256(), NULL);
+	archive_size = 0;
+	unsigned long long offset = 0;
+	if (directories.empty())
+		ok = ok && stream(fd, [&]() { return appendHeader("./", st, '5', "") && addDirectory(source, "."); }, offset, true);
+	else {
+		// Every directory is read and compressed at once, into a file of its
+		// own. Each is a gzip member of tar entries without an end, so they
+		// are simply joined, after the root entry and before the end.
+		size_t count = directories.size();
+		std::vector<Archive*> parts;
+		std::vector<std::thread> readers;
+		std::vector<char> written(count, false);
+		std::vector<unsigned long long> lengths(count, 0);
+		for (size_t i = 0; i < count; ++i) {
+			Archive *part = new Archive(std::max((size_t)1, threads / count), std::max((size_t)2 * ARCHIVE_BLOCK, memory / count));
+			part->level = level;
+			part->throttle = throttle;
+			parts.push_back(part);
+			readers.emplace_back([&, part, i]() { written[i] = part->writePart(source, directories[i], temp + '.' + std::to_string(i), lengths[i]); });
+		}
+		ok = ok && stream(fd, [&]() { return appendHeader("./", st, '5', "") && addParents(source); }, offset, false);
+		for (size_t i = 0; i < count; ++i) {
+			readers[i].join();
+			delete parts[i];
+			std::string part = temp + '.' + std::to_string(i);
+			ok = ok && written[i] && appendPart(fd, part);
+			offset += lengths[i];
+			unlink(part.c_str());
+		}
+		ok = ok && stream(fd, []() { return true; }, offset, true);
+	}
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	unsigned int hash_size = 0;
+	ok = ok && EVP_DigestFinal_ex(digest, hash, &hash_size);
+	EVP_MD_CTX_free(digest);
+	digest = nullptr;
+	static const char hex[] = "0123456789abcdef";
+	checksum.clear();
+	for (unsigned int i = 0; ok && i < hash_size; ++i) {
+		checksum += hex[hash[i] >> 4];
+		checksum += hex[hash[i] & 15];
+	}
+
+	if (close(fd) == -1)
+		ok = false;
+	if (!ok || rename(temp.c_str(), file.c_str()) == -1) {
+		std::cerr << "Could not write archive " << file << std::endl;
+		unlink(temp.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool Archive::writeBlocks(int fd) {
+	// gzip header: no name, made on Unix
+	static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+	bool ok = writeAll(fd, header, sizeof (header), digest);
+	archive_size += sizeof (header);
+	uLong crc = crc32(0, NULL, 0);
+	while (ok) {
+		struct archive_block *block;
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			while (!failed && (blocks.empty() || !blocks.front()->done))
+				cv.wait(lck);
+			if (failed)
+				return false;
+			block = blocks.front();
+			blocks.pop_front();
+			cv.notify_all();
+		}
+		ok = block->ok && writeAll(fd, block->output.data(), block->output.size(), digest);
+		archive_size += block->output.size();
+		crc = crc32_combine(crc, block->crc, block->used);
+		bool last = block->last;
+		delete block;
+		if (last)
+			break;
+	}
+	if (ok) {
+		unsigned char trailer[8];
+		for (int i = 0; i < 4; ++i) {
+			trailer[i] = crc >> (8 * i);
+			trailer[4 + i] = total >> (8 * i);
+		}
+		ok = writeAll(fd, trailer, sizeof (trailer), digest);
+		archive_size += sizeof (trailer);
+	}
+	if (!ok) {
+		std::lock_guard<std::mutex> lck(mtx);
+		failed = true;
+		cv.notify_all();
+	}
+	return ok;
+}
+
+bool Archive::writePart(std::string source, std::string directory, std::string file, unsigned long long &length) {
+	int fd = open(file.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		std::cerr << "Could not create " << file << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	std::string full = source + '/' + directory;
+	bool ok = stream(fd, [&]() {
+		struct stat st;
+		if (stat(full.c_str(), &st) == -1) {
+			// Not made by the server yet (a dimension nobody visited)
+			if (errno == ENOENT) {
+				std::cerr << "Skipped " << full << " in backup, it does not exist" << std::endl;
+				return true;
+			}
+			std::cerr << "Could not stat " << full << " (" << errno << ")" << std::endl;
+			return false;
+		}
+		return appendHeader("./" + directory + '/', st, '5', "") && addDirectory(full, "./" + directory);
+	}, length, false);
+	if (close(fd) == -1)
+		ok = false;
+	return ok;
+}
+
+Archive::Archive(size_t threads, size_t memory) {
+	this->threads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+	this->memory = memory ? memory : ARCHIVE_MEMORY;
+}
@@ -0,0 +1,794 @@
+#include <algorithm>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <openssl/evp.h>
+#include <stdlib.h>
+#include <set>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <zlib.h>
+#include "backup.hpp"
+#include "pool.hpp"
+#include "throttle.hpp"
+
+// Chunk sizes: cut points are searched for between MIN and MAX, and are found
+// on average every AVG bytes
+#define CHUNK_MIN  (16 * 1024)
+#define CHUNK_AVG  (64 * 1024)
+#define CHUNK_MAX  (256 * 1024)
+#define CHUNK_READ (1024 * 1024)
+
+#define MANIFEST_HEADER "mcd-snapshot 1"
+
+// Random values for the gear rolling hash. Generated from a fixed seed, since
+// cut points (and so deduplication) depend on them
+static const uint64_t *gearTable() {
+	static uint64_t table[256];
+	static bool filled = false;
+	if (!filled) {
+		uint64_t seed = 0x6d63642d63686b73; // splitmix64
+		for (uint64_t &value : table) {
+			uint64_t z = (seed += 0x9e3779b97f4a7c15);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+			value = z ^ (z >> 31);
+		}
+		filled = true;
+	}
+	return table;
+}
+
+// Finds the end of the next chunk in data (len is only short of CHUNK_MAX at
+// the end of a file)
+static size_t findCut(const unsigned char *data, size_t len) {
+	if (len <= CHUNK_MIN)
+		return len;
+	static const uint64_t *gear = gearTable();
+	const uint64_t mask = CHUNK_AVG - 1;
+	size_t end = std::min(len, (size_t)CHUNK_MAX);
+	uint64_t hash = 0;
+	// The hash only depends on the last 64 bytes, so start just before MIN
+	for (size_t i = CHUNK_MIN - 64; i < end; ++i) {
+		hash = (hash << 1) + gear[data[i]];
+		if (i >= CHUNK_MIN && !(hash & mask))
+			return i + 1;
+	}
+	return end;
+}
+
+// Paths may contain anything but NUL, so tabs and line breaks are escaped
+static std::string escape(std::string text) {
+	std::string escaped;
+	for (char c : text) {
+		if (c == '\\')
+			escaped += "\\\\";
+		else if (c == '\t')
+			escaped += "\\t";
+		else if (c == '\n')
+			escaped += "\\n";
+		else
+			escaped += c;
+	}
+	return escaped;
+}
+
+static std::string unescape(std::string text) {
+	std::string unescaped;
+	for (size_t i = 0; i < text.size(); ++i) {
+		if (text[i] != '\\' || i + 1 == text.size()) {
+			unescaped += text[i];
+			continue;
+		}
+		char c = text[++i];
+		unescaped += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+	}
+	return unescaped;
+}
+
+static std::string toHex(const unsigned char *digest, unsigned int size) {
+	static const char hex[] = "0123456789abcdef";
+	std::string text;
+	for (unsigned int i = 0; i < size; ++i) {
+		text += hex[digest[i] >> 4];
+		text += hex[digest[i] & 15];
+	}
+	return text;
+}
+
+static bool readFile(std::string path, std::vector<unsigned char> &data) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+	struct stat st;
+	bool ok = fstat(fd, &st) == 0;
+	data.resize(ok ? st.st_size : 0);
+	for (size_t done = 0; ok && done < data.size();) {
+		ssize_t bytes = read(fd, data.data() + done, data.size() - done);
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		ok = bytes > 0;
+		done += ok ? bytes : 0;
+	}
+	close(fd);
+	return ok;
+}
+
+static std::vector<std::string> split(std::string line, char separator) {
+	std::vector<std::string> fields;
+	std::string::size_type start = 0, end;
+	while ((end = line.find(separator, start)) != std::string::npos) {
+		fields.push_back(line.substr(start, end - start));
+		start = end + 1;
+	}
+	fields.push_back(line.substr(start));
+	return fields;
+}
+
+// Whether text is all digits (and not empty)
+static bool isNumber(std::string_view text) {
+	return !text.empty() && std::all_of(text.begin(), text.end(), [](char c) { return isdigit((unsigned char)c); });
+}
+
+// Whether text is a snapshot's <date>-<time>, as given by snapshot, with the
+// -<n> it gets when there already is one from the same second
+static bool isStamp(std::string_view text) {
+	if (text.size() < 15 || !isNumber(text.substr(0, 8)) || text[8] != '-' || !isNumber(text.substr(9, 6)))
+		return false;
+	return text.size() == 15 || (text[15] == '-' && isNumber(text.substr(16)));
+}
+
+static void keepAttributes(int fd, const struct backup_entry &entry) {
+	// Changing the owner clears set-id bits, so the mode goes after it
+	if (fchown(fd, entry.user, entry.group) == -1 && errno != EPERM)
+		std::cerr << "Could not change owner of restored " << entry.path << " (" << errno << ")" << std::endl;
+	fchmod(fd, entry.mode);
+	struct timespec times[2] = { { 0, UTIME_OMIT }, entry.mtime };
+	futimens(fd, times);
+}
+
+static bool makeDirectory(std::string path) {
+	if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+		std::cerr << "Could not create " << path << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool BackupStore::addEntry(std::string source, std::string path, const std::map<std::string, const struct backup_entry*> &unchanged, std::vector<struct backup_entry> &entries, struct backup_stats &stats) {
+	std::string full = source + '/' + path;
+	// Never back up the backups
+	if (full == dir)
+		return true;
+	struct stat st;
+	if (lstat(full.c_str(), &st) == -1) {
+		// Deleted since the directory was read
+		if (errno == ENOENT)
+			return true;
+		std::cerr << "Could not stat " << full << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	struct backup_entry entry = {};
+	entry.mode = st.st_mode & 07777;
+	entry.user = st.st_uid;
+	entry.group = st.st_gid;
+	entry.mtime = st.st_mtim;
+	entry.path = path;
+	if (S_ISDIR(st.st_mode)) {
+		entry.type = 'd';
+		entries.push_back(entry);
+		return walk(source, path, unchanged, entries, stats);
+	}
+	if (S_ISLNK(st.st_mode)) {
+		entry.type = 'l';
+		std::vector<char> target(st.st_size + 1);
+		ssize_t length = readlink(full.c_str(), target.data(), target.size());
+		if (length == -1)
+			return true;
+		entry.target.assign(target.data(), length);
+		entries.push_back(entry);
+		return true;
+	}
+	// Sockets, pipes and devices aren't backed up
+	if (!S_ISREG(st.st_mode))
+		return true;
+	entry.type = 'f';
+	entry.size = st.st_size;
+	++stats.files;
+	auto previous_it = unchanged.find(path);
+	if (previous_it != unchanged.end() && previous_it->second->size == st.st_size &&
+			previous_it->second->mtime.tv_sec == st.st_mtim.tv_sec && previous_it->second->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+		entry.chunks = previous_it->second->chunks;
+		stats.chunks += entry.chunks.size();
+		++stats.unchanged;
+	}
+	else if (!storeFile(full, entry, stats))
+		return false;
+	entries.push_back(entry);
+	return true;
+}
+
+std::string BackupStore::chunkPath(std::string hash) {
+	return dir + "/chunks/" + hash.substr(0, 2) + '/' + hash.substr(2);
+}
+
+bool BackupStore::collect(unsigned long long &freed) {
+	int fd = lock(LOCK_EX);
+	if (fd == -1)
+		return false;
+	std::set<std::string> used;
+	DIR *dirp = opendir((dir + "/snapshots").c_str());
+	if (dirp != NULL) {
+		const std::string suffix = ".manifest";
+		struct dirent *ent;
+		while ((ent = readdir(dirp)) != NULL) {
+			std::string file = ent->d_name;
+			if (file.size() <= suffix.size() || file.compare(file.size() - suffix.size(), suffix.size(), suffix) != 0)
+				continue;
+			std::vector<struct backup_entry> entries;
+			if (!readManifest(file.substr(0, file.size() - suffix.size()), entries)) {
+				std::cerr << "Could not read snapshot " << file << ", not deleting any chunks" << std::endl;
+				closedir(dirp);
+				close(fd);
+				return false;
+			}
+			for (const struct backup_entry &entry : entries)
+				used.insert(entry.chunks.begin(), entry.chunks.end());
+		}
+		closedir(dirp);
+	}
+
+	DIR *chunks = opendir((dir + "/chunks").c_str());
+	if (chunks != NULL) {
+		struct dirent *ent;
+		while ((ent = readdir(chunks)) != NULL) {
+			std::string prefix = ent->d_name;
+			if (prefix.size() != 2)
+				continue;
+			std::string subdir = dir + "/chunks/" + prefix;
+			DIR *dirp = opendir(subdir.c_str());
+			if (dirp == NULL)
+				continue;
+			struct dirent *chunk;
+			while ((chunk = readdir(dirp)) != NULL) {
+				std::string file = chunk->d_name;
+				// Leftovers of interrupted writes (.XXXXXX) go too, nothing is writing now
+				if (file[0] == '.' || used.count(prefix + file))
+					continue;
+				struct stat st;
+				std::string path = subdir + '/' + file;
+				if (lstat(path.c_str(), &st) == 0 && unlink(path.c_str()) == 0)
+					freed += st.st_size;
+			}
+			closedir(dirp);
+		}
+		closedir(chunks);
+	}
+	close(fd);
+	return true;
+}
+
+std::string BackupStore::latest(std::string prefix) {
+	std::string newest;
+	DIR *snapshots = opendir((dir + "/snapshots").c_str());
+	if (snapshots == NULL)
+		return newest;
+	const std::string suffix = ".manifest";
+	struct dirent *ent;
+	while ((ent = readdir(snapshots)) != NULL) {
+		std::string file = ent->d_name;
+		// <prefix>_<date>-<time>.manifest, and not some other server whose
+		// name starts with prefix (e.g. "mc_1" for "mc")
+		if (file.size() <= prefix.size() + 1 + suffix.size() || file.compare(0, prefix.size() + 1, prefix + '_') != 0)
+			continue;
+		if (file.compare(file.size() - suffix.size(), suffix.size(), suffix) != 0)
+			continue;
+		file.erase(file.size() - suffix.size());
+		if (!isStamp(std::string_view(file).substr(prefix.size() + 1)))
+			continue;
+		if (file > newest)
+			newest = file;
+	}
+	closedir(snapshots);
+	return newest;
+}
+
+// Snapshots share the lock, collecting chunks takes it alone
+int BackupStore::lock(int operation) {
+	std::string path = dir + "/lock";
+	int fd = open(path.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		std::cerr << "Could not open " << path << " (" << errno << ")" << std::endl;
+		return -1;
+	}
+	while (flock(fd, operation) == -1) {
+		if (errno == EINTR)
+			continue;
+		std::cerr << "Could not lock " << path << " (" << errno << ")" << std::endl;
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool BackupStore::readManifest(std::string name, std::vector<struct backup_entry> &entries) {
+	std::ifstream manifest(dir + "/snapshots/" + name + ".manifest");
+	std::string line;
+	if (!std::getline(manifest, line) || line != MANIFEST_HEADER)
+		return false;
+	while (std::getline(manifest, line)) {
+		std::vector<std::string> fields = split(line, '\t');
+		if (fields.size() != 9 || fields[0].size() != 1)
+			return false;
+		struct backup_entry entry;
+		entry.type = fields[0][0];
+		entry.mode = strtoul(fields[1].c_str(), NULL, 8);
+		entry.user = strtoul(fields[2].c_str(), NULL, 10);
+		entry.group = strtoul(fields[3].c_str(), NULL, 10);
+		std::vector<std::string> mtime = split(fields[4], '.');
+		entry.mtime.tv_sec = strtoll(mtime[0].c_str(), NULL, 10);
+		entry.mtime.tv_nsec = mtime.size() > 1 ? strtol(mtime[1].c_str(), NULL, 10) : 0;
+		entry.size = strtoll(fields[5].c_str(), NULL, 10);
+		if (!fields[6].empty())
+			entry.chunks = split(fields[6], ' ');
+		entry.target = unescape(fields[7]);
+		entry.path = unescape(fields[8]);
+		entries.push_back(entry);
+	}
+	return true;
+}
+
+bool BackupStore::remove(std::string name) {
+	std::string path = dir + "/snapshots/" + name + ".manifest";
+	if (unlink(path.c_str()) == -1 && errno != ENOENT) {
+		std::cerr << "Could not remove " << path << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool BackupStore::restore(std::string name, std::string dest, size_t threads) {
+	// Chunks can't be collected while they're being read
+	int lock_fd = lock(LOCK_SH);
+	if (lock_fd == -1)
+		return false;
+	std::vector<struct backup_entry> entries;
+	if (!readManifest(name, entries)) {
+		std::cerr << "Could not read snapshot " << name << std::endl;
+		close(lock_fd);
+		return false;
+	}
+	if (mkdir(dest.c_str(), 0755) == -1) {
+		std::cerr << "Could not create " << dest << " (" << errno << ")" << std::endl;
+		close(lock_fd);
+		return false;
+	}
+
+	// Directories are made as they come (before anything in them), files
+	// are written by the workers
+	std::mutex mtx;
+	bool ok = true;
+	{
+		ThreadPool workers(threads ? threads : std::max(1u, std::thread::hardware_concurrency()));
+		for (const struct backup_entry &entry : entries) {
+			std::vector<std::string> parts = split(entry.path, '/');
+			if (std::any_of(parts.begin(), parts.end(), [](const std::string &part) { return part.empty() || part == "." || part == ".."; })) {
+				std::cerr << "Snapshot " << name << " has " << entry.path << " in it, outside of where it is restored" << std::endl;
+				std::lock_guard<std::mutex> lck(mtx);
+				ok = false;
+				break;
+			}
+			std::string path = dest + '/' + entry.path;
+			if (entry.type == 'd' && mkdir(path.c_str(), 0700) == -1 && errno != EEXIST) {
+				std::cerr << "Could not create " << path << " (" << errno << ")" << std::endl;
+				std::lock_guard<std::mutex> lck(mtx);
+				ok = false;
+				break;
+			}
+			if (entry.type == 'f')
+				workers.submit([this, &entry, path, &mtx, &ok]() {
+					{
+						std::lock_guard<std::mutex> lck(mtx);
+						if (!ok)
+							return;
+					}
+					bool written = restoreFile(entry, path);
+					std::lock_guard<std::mutex> lck(mtx);
+					ok = ok && written;
+				});
+		}
+	}
+	close(lock_fd);
+
+	// Links once every file is written, so nothing is written through one,
+	// and directory times last, as filling them in changed them
+	for (const struct backup_entry &entry : entries) {
+		if (!ok || entry.type != 'l')
+			continue;
+		std::string path = dest + '/' + entry.path;
+		if (symlink(entry.target.c_str(), path.c_str()) == -1) {
+			std::cerr << "Could not create " << path << " (" << errno << ")" << std::endl;
+			ok = false;
+			break;
+		}
+		lchown(path.c_str(), entry.user, entry.group);
+		struct timespec times[2] = { { 0, UTIME_OMIT }, entry.mtime };
+		utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+	}
+	for (auto entry_it = entries.rbegin(); ok && entry_it != entries.rend(); ++entry_it) {
+		if (entry_it->type != 'd')
+			continue;
+		int fd = open((dest + '/' + entry_it->path).c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd != -1) {
+			keepAttributes(fd, *entry_it);
+			close(fd);
+		}
+	}
+	return ok;
+}
+
+bool BackupStore::restoreFile(const struct backup_entry &entry, std::string path) {
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		std::cerr << "Could not create " << path << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	std::vector<unsigned char> compressed, data(CHUNK_MAX);
+	off_t size = 0;
+	bool ok = true;
+	for (const std::string &hash : entry.chunks) {
+		if (!readFile(chunkPath(hash), compressed)) {
+			std::cerr << "Could not read chunk " << hash << " of " << entry.path << " (" << errno << ")" << std::endl;
+			ok = false;
+			break;
+		}
+		// Every chunk is checked, a damaged one would go unnoticed otherwise
+		uLongf length = data.size();
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		unsigned int digest_size = 0;
+		if (uncompress(data.data(), &length, compressed.data(), compressed.size()) != Z_OK ||
+				!EVP_Digest(data.data(), length, digest, &digest_size, EVP_sha256(), NULL) || toHex(digest, digest_size) != hash) {
+			std::cerr << "Chunk " << hash << " of " << entry.path << " is damaged" << std::endl;
+			ok = false;
+			break;
+		}
+		for (size_t done = 0; ok && done < length;) {
+			ssize_t bytes = write(fd, data.data() + done, length - done);
+			if (bytes == -1 && errno != EINTR) {
+				std::cerr << "Could not write " << path << " (" << errno << ")" << std::endl;
+				ok = false;
+			}
+			else if (bytes > 0)
+				done += bytes;
+		}
+		if (throttle)
+			throttle->take(compressed.size());
+		size += length;
+	}
+	if (ok && size != entry.size) {
+		std::cerr << "Snapshot has " << entry.path << " as " << entry.size << " bytes, but its chunks make " << size << std::endl;
+		ok = false;
+	}
+	if (ok)
+		keepAttributes(fd, entry);
+	if (close(fd) == -1 && ok) {
+		std::cerr << "Could not write " << path << " (" << errno << ")" << std::endl;
+		ok = false;
+	}
+	return ok;
+}
+
+void BackupStore::setChanges(const std::set<std::string> *changes, std::string base) {
+	this->changes = changes;
+	this->base = base;
+}
+
+void BackupStore::setDirectories(std::vector<std::string> directories) {
+	this->directories = directories;
+}
+
+void BackupStore::setThrottle(Throttle *throttle) {
+	this->throttle = throttle;
+}
+
+bool BackupStore::snapshot(std::string source, std::string prefix, std::string &name, struct backup_stats &stats) {
+	if (!makeDirectory(dir) || !makeDirectory(dir + "/chunks") || !makeDirectory(dir + "/snapshots"))
+		return false;
+	int fd = lock(LOCK_SH);
+	if (fd == -1)
+		return false;
+	bool ok = writeSnapshot(source, prefix, name, stats);
+	close(fd);
+	return ok;
+}
+
+bool BackupStore::storeChunk(const unsigned char *data, size_t size, std::string &hash, struct backup_stats &stats) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_size;
+	if (!EVP_Digest(data, size, digest, &digest_size, EVP_sha256(), NULL))
+		return false;
+	hash = toHex(digest, digest_size);
+	++stats.chunks;
+
+	// Already stored, by this or any earlier snapshot
+	std::string path = chunkPath(hash);
+	if (access(path.c_str(), F_OK) == 0)
+		return true;
+
+	if (!makeDirectory(dir + "/chunks/" + hash.substr(0, 2)))
+		return false;
+	uLongf compressed_size = compressBound(size);
+	std::vector<unsigned char> compressed(compressed_size);
+	if (compress2(compressed.data(), &compressed_size, data, size, Z_BEST_SPEED) != Z_OK)
+		return false;
+	// Another backup may be storing the same chunk, so write to a file of our own first
+	std::string temp = path + ".XXXXXX";
+	int fd = mkstemp(temp.data());
+	if (fd == -1) {
+		std::cerr << "Could not create " << temp << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	fchmod(fd, 0644);
+	const unsigned char *next = compressed.data();
+	size_t remaining = compressed_size;
+	while (remaining) {
+		ssize_t bytes = write(fd, next, remaining);
+		if (bytes == -1) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << "Could not write " << temp << " (" << errno << ")" << std::endl;
+			close(fd);
+			unlink(temp.c_str());
+			return false;
+		}
+		next += bytes;
+		remaining -= bytes;
+	}
+	close(fd);
+	if (rename(temp.c_str(), path.c_str()) == -1) {
+		unlink(temp.c_str());
+		return false;
+	}
+	++stats.new_chunks;
+	stats.bytes_stored += compressed_size;
+	return true;
+}
+
+bool BackupStore::storeFile(std::string file, struct backup_entry &entry, struct backup_stats &stats) {
+	int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd == -1) {
+		std::cerr << "Could not open " << file << " for backup (" << errno << ")" << std::endl;
+		return false;
+	}
+	std::vector<unsigned char> buffer(CHUNK_MAX + CHUNK_READ);
+	size_t length = 0;
+	bool eof = false;
+	while (true) {
+		// Always have a whole chunk to look at, unless the file ends first
+		while (!eof && length < CHUNK_MAX) {
+			ssize_t bytes = read(fd, buffer.data() + length, buffer.size() - length);
+			if (bytes == -1) {
+				if (errno == EINTR)
+					continue;
+				std::cerr << "Could not read " << file << " (" << errno << ")" << std::endl;
+				close(fd);
+				return false;
+			}
+			if (throttle)
+				throttle->take(bytes);
+			eof = bytes == 0;
+			length += bytes;
+			stats.bytes_read += bytes;
+		}
+		if (length == 0)
+			break;
+		size_t cut = findCut(buffer.data(), length);
+		std::string hash;
+		if (!storeChunk(buffer.data(), cut, hash, stats)) {
+			close(fd);
+			return false;
+		}
+		entry.chunks.push_back(hash);
+		memmove(buffer.data(), buffer.data() + cut, length - cut);
+		length -= cut;
+	}
+	close(fd);
+	return true;
+}
+
+bool BackupStore::walk(std::string source, std::string relative, const std::map<std::string, const struct backup_entry*> &unchanged, std::vector<struct backup_entry> &entries, struct backup_stats &stats) {
+	std::string directory = relative.empty() ? source : source + '/' + relative;
+	DIR *dirp = opendir(directory.c_str());
+	if (dirp == NULL) {
+		std::cerr << "Could not open " << directory << " for backup (" << errno << ")" << std::endl;
+		return false;
+	}
+	std::vector<std::string> names;
+	struct dirent *ent;
+	while ((ent = readdir(dirp)) != NULL)
+		if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."))
+			names.push_back(ent->d_name);
+	closedir(dirp);
+	std::sort(names.begin(), names.end());
+
+	for (const std::string &file : names)
+		if (!addEntry(source, relative.empty() ? file : relative + '/' + file, unchanged, entries, stats))
+			return false;
+	return true;
+}
+
+bool BackupStore::walkChanges(std::string source, const std::vector<struct backup_entry> &previous, const std::map<std::string, const struct backup_entry*> &unchanged, std::vector<struct backup_entry> &entries, struct backup_stats &stats) {
+	// Everything under a changed path is read again
+	auto covered = [this](std::string path) {
+		for (;;) {
+			if (changes->count(path))
+				return true;
+			std::string::size_type slash = path.rfind('/');
+			if (slash == std::string::npos)
+				return false;
+			path.erase(slash);
+		}
+	};
+	// and the directories holding them get new modification times
+	std::set<std::string> parents;
+	for (const std::string &path : *changes)
+		for (std::string::size_type slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1))
+			parents.insert(path.substr(0, slash));
+
+	for (struct backup_entry entry : previous) {
+		if (covered(entry.path))
+			continue;
+		struct stat st;
+		if (entry.type == 'd' && parents.count(entry.path) && lstat((source + '/' + entry.path).c_str(), &st) == 0) {
+			entry.mode = st.st_mode & 07777;
+			entry.user = st.st_uid;
+			entry.group = st.st_gid;
+			entry.mtime = st.st_mtim;
+		}
+		if (entry.type == 'f') {
+			++stats.files;
+			++stats.unchanged;
+			stats.chunks += entry.chunks.size();
+		}
+		entries.push_back(entry);
+	}
+	for (const std::string &path : *changes) {
+		std::string::size_type slash = path.rfind('/');
+		if (slash != std::string::npos && covered(path.substr(0, slash)))
+			continue;
+		if (!addEntry(source, path, unchanged, entries, stats))
+			return false;
+	}
+	// In the order walk lists them, every directory before what's in it
+	std::sort(entries.begin(), entries.end(), [](const struct backup_entry &a, const struct backup_entry &b) {
+		return std::lexicographical_compare(a.path.begin(), a.path.end(), b.path.begin(), b.path.end(), [](char x, char y) {
+			return (x == '/' ? '\0' : x) < (y == '/' ? '\0' : y);
+		});
+	});
+	return true;
+}
+
+bool BackupStore::walkDirectory(std::string source, std::string directory, const std::map<std::string, const struct backup_entry*> &unchanged, std::vector<struct backup_entry> &entries, struct backup_stats &stats) {
+	// The directory and every one on the way to it
+	std::string::size_type slash = 0;
+	while (slash != std::string::npos) {
+		slash = directory.find('/', slash + 1);
+		std::string relative = directory.substr(0, slash), full = source + '/' + relative;
+		struct stat st;
+		if (stat(full.c_str(), &st) == -1 || !S_ISDIR(st.st_mode)) {
+			// Not made by the server yet (a dimension nobody visited)
+			std::cerr << "Skipped " << full << " in backup, it is not a directory" << std::endl;
+			return true;
+		}
+		struct backup_entry entry = {};
+		entry.type = 'd';
+		entry.mode = st.st_mode & 07777;
+		entry.user = st.st_uid;
+		entry.group = st.st_gid;
+		entry.mtime = st.st_mtim;
+		entry.path = relative;
+		entries.push_back(entry);
+	}
+	return walk(source, directory, unchanged, entries, stats);
+}
+
+bool BackupStore::writeSnapshot(std::string source, std::string prefix, std::string &name, struct backup_stats &stats) {
+	// Whatever didn't change since the last snapshot is taken from it
+	std::vector<struct backup_entry> previous;
+	std::string last = latest(prefix);
+	if (!last.empty() && !readManifest(last, previous)) {
+		std::cerr << "Could not read snapshot " << last << ", every file will be read" << std::endl;
+		previous.clear();
+	}
+	else
+		stats.parent = last;
+	std::map<std::string, const struct backup_entry*> unchanged;
+	for (const struct backup_entry &entry : previous)
+		if (entry.type == 'f')
+			unchanged[entry.path] = &entry;
+
+	std::vector<struct backup_entry> entries;
+	if (changes) {
+		// The source may only hold the changes (see Snapshot::setChanges), so
+		// without the snapshot they were tracked from there is no rest to take
+		if (last.empty() || last != base || stats.parent != last) {
+			std::cerr << "Only what changed in " << prefix << " since " << base << " was given, but " <<
+					(last.empty() ? "there is no snapshot to take the rest from" : stats.parent != last ? last + " can't be read" : "the newest snapshot is " + last) << std::endl;
+			return false;
+		}
+		if (!walkChanges(source, previous, unchanged, entries, stats))
+			return false;
+	}
+	else if (directories.empty()) {
+		if (!walk(source, "", unchanged, entries, stats))
+			return false;
+	}
+	else {
+		// Each directory is read on a thread of its own, and listed in the
+		// order given
+		size_t count = directories.size();
+		std::vector<std::vector<struct backup_entry>> found(count);
+		std::vector<struct backup_stats> found_stats(count);
+		std::vector<char> walked(count, false);
+		std::vector<std::thread> walkers;
+		for (size_t i = 0; i < count; ++i)
+			walkers.emplace_back([&, i]() { walked[i] = walkDirectory(source, directories[i], unchanged, found[i], found_stats[i]); });
+		bool ok = true;
+		std::set<std::string> listed;
+		for (size_t i = 0; i < count; ++i) {
+			walkers[i].join();
+			ok = ok && walked[i];
+			for (const struct backup_entry &entry : found[i])
+				// Parents shared by several directories are only listed once
+				if (entry.type != 'd' || listed.insert(entry.path).second)
+					entries.push_back(entry);
+			stats.files += found_stats[i].files;
+			stats.unchanged += found_stats[i].unchanged;
+			stats.chunks += found_stats[i].chunks;
+			stats.new_chunks += found_stats[i].new_chunks;
+			stats.bytes_read += found_stats[i].bytes_read;
+			stats.bytes_stored += found_stats[i].bytes_stored;
+		}
+		if (!ok)
+			return false;
+	}
+
+	char stamp[32];
+	time_t now = time(NULL);
+	struct tm local;
+	strftime(stamp, sizeof (stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &local));
+	name = prefix + '_' + stamp;
+	for (int n = 1; access((dir + "/snapshots/" + name + ".manifest").c_str(), F_OK) == 0; ++n)
+		name = prefix + '_' + stamp + '-' + std::to_string(n);
+
+	// Written in full before it appears under its real name
+	std::string path = dir + "/snapshots/" + name + ".manifest", temp = path + ".tmp";
+	std::ofstream manifest(temp, std::ios_base::out | std::ios_base::trunc);
+	manifest << MANIFEST_HEADER << '\n';
+	for (const struct backup_entry &entry : entries) {
+		char mode[16], mtime[48];
+		snprintf(mode, sizeof (mode), "%o", (unsigned)entry.mode);
+		snprintf(mtime, sizeof (mtime), "%lld.%09ld", (long long)entry.mtime.tv_sec, (long)entry.mtime.tv_nsec);
+		std::string chunks;
+		for (const std::string &hash : entry.chunks)
+			chunks += (chunks.empty() ? "" : " ") + hash;
+		manifest << entry.type << '\t' << mode << '\t' << entry.user << '\t' << entry.group << '\t' << mtime << '\t' << entry.size << '\t' << chunks << '\t' << escape(entry.target) << '\t' << escape(entry.path) << '\n';
+	}
+	manifest.close();
+	if (manifest.fail() || rename(temp.c_str(), path.c_str()) == -1) {
+		std::cerr << "Could not write snapshot manifest " << path << std::endl;
+		unlink(temp.c_str());
+		return false;
+	}
+	return true;
+}
+
+BackupStore::BackupStore(std::string dir) {
+	this->dir = dir;
+}
@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.hpp"
+
+void LineBuffer::commit(size_t bytes) {
+	end += bytes;
+}
+
+void LineBuffer::finish() {
+	finished = true;
+}
+
+bool LineBuffer::hasLine() {
+	if (found)
+		return true;
+	if (scanned < end) {
+		const char *line_break = (const char*)memchr(data + scanned, '\n', end - scanned);
+		if (line_break != NULL) {
+			line_end = line_break - data;
+			scanned = line_end + 1;
+			return found = true;
+		}
+		scanned = end;
+	}
+	// The final line has no line break
+	if (finished && start < end) {
+		line_end = end;
+		return found = true;
+	}
+	return false;
+}
+
+std::string_view LineBuffer::nextLine() {
+	if (!hasLine())
+		return std::string_view();
+	std::string_view line(data + start, line_end - start);
+	start = line_end < end ? line_end + 1 : end;
+	found = false;
+	return line;
+}
+
+char *LineBuffer::reserve(size_t min, size_t &available) {
+	// Everything was handed out, start over at the front
+	if (start == end && !found)
+		start = scanned = end = 0;
+	if (capacity - end < min && start > 0) {
+		// Move whatever hasn't been handed out yet to the front
+		memmove(data, data + start, end - start);
+		end -= start;
+		scanned -= start;
+		if (found)
+			line_end -= start;
+		start = 0;
+	}
+	if (capacity - end < min) {
+		size_t grown = capacity;
+		while (grown - end < min)
+			grown *= 2;
+		if (grown > limit)
+			return NULL;
+		char *larger = (char*)realloc(data, grown);
+		if (larger == NULL)
+			return NULL;
+		data = larger;
+		capacity = grown;
+	}
+	available = capacity - end;
+	return data + end;
+}
+
+size_t LineBuffer::size() {
+	return end - start;
+}
+
+std::string_view LineBuffer::take() {
+	std::string_view rest(data + start, end - start);
+	start = scanned = end;
+	found = false;
+	return rest;
+}
+
+LineBuffer::LineBuffer(size_t capacity, size_t limit) {
+	this->capacity = capacity == 0 ? 1 : capacity;
+	this->limit = limit < this->capacity ? this->capacity : limit;
+	data = (char*)malloc(this->capacity);
+}
+
+LineBuffer::~LineBuffer() {
+	free(data);
+}
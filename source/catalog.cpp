@@ -0,0 +1,274 @@
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <openssl/evp.h>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "catalog.hpp"
+
+#define CATALOG_HEADER "mcd-catalog 1"
+// Compact the file once it has this many more lines than backups
+#define CATALOG_SLACK  256
+
+static std::string format(const struct catalog_entry &entry) {
+	std::stringstream line;
+	line << "+\t" << entry.server << '\t' << entry.name << '\t' << entry.format << '\t' << entry.time << '\t' << entry.size << '\t' << entry.duration << '\t' << entry.checksum << '\t' << entry.parent << '\n';
+	return line.str();
+}
+
+// <server>_<date>, where only the server may contain '_'
+static bool serverOf(std::string name, std::string &server) {
+	std::string::size_type underscore = name.rfind('_');
+	if (underscore == std::string::npos || underscore == 0 || underscore + 1 == name.size() || !isdigit(name[underscore + 1]))
+		return false;
+	server = name.substr(0, underscore);
+	return true;
+}
+
+bool Catalog::add(const struct catalog_entry &entry) {
+	std::lock_guard<std::mutex> lck(mtx);
+	// Loading the catalog for the first time may have imported this backup
+	// already, without its details
+	entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const struct catalog_entry &other) {
+		return other.server == entry.server && other.name == entry.name;
+	}), entries.end());
+	entries.push_back(entry);
+	return append(format(entry));
+}
+
+bool Catalog::append(std::string line) {
+	int fd = open((dir + "/catalog").c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		std::cerr << "Could not open " << dir << "/catalog (" << errno << ")" << std::endl;
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size == 0)
+		line = std::string(CATALOG_HEADER) + '\n' + line;
+	bool ok = write(fd, line.data(), line.size()) == (ssize_t)line.size();
+	if (close(fd) == -1 || !ok) {
+		std::cerr << "Could not write " << dir << "/catalog" << std::endl;
+		return false;
+	}
+	++records;
+	return true;
+}
+
+std::string Catalog::checksum(std::string file) {
+	int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return "-";
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	bool ok = EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+	char buf[65536];
+	ssize_t bytes;
+	while (ok && ((bytes = read(fd, buf, sizeof (buf))) > 0 || (bytes == -1 && errno == EINTR)))
+		if (bytes > 0)
+			ok = EVP_DigestUpdate(ctx, buf, bytes);
+	close(fd);
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_size = 0;
+	ok = ok && bytes == 0 && EVP_DigestFinal_ex(ctx, digest, &digest_size);
+	EVP_MD_CTX_free(ctx);
+	if (!ok)
+		return "-";
+	static const char hex[] = "0123456789abcdef";
+	std::string hash;
+	for (unsigned int i = 0; i < digest_size; ++i) {
+		hash += hex[digest[i] >> 4];
+		hash += hex[digest[i] & 15];
+	}
+	return hash;
+}
+
+void Catalog::compact() {
+	std::string path = dir + "/catalog", temp = path + ".tmp";
+	std::ofstream file(temp, std::ios_base::out | std::ios_base::trunc);
+	file << CATALOG_HEADER << '\n';
+	for (const struct catalog_entry &entry : entries)
+		file << format(entry);
+	file.close();
+	if (file.fail() || rename(temp.c_str(), path.c_str()) == -1) {
+		unlink(temp.c_str());
+		return;
+	}
+	records = entries.size();
+}
+
+std::vector<struct catalog_entry> Catalog::expired(std::string server, const struct retention &keep) {
+	std::vector<struct catalog_entry> expired;
+	if (!keep.last && !keep.hourly && !keep.daily && !keep.weekly && !keep.monthly)
+		return expired;
+	std::vector<struct catalog_entry> backups = list(server);
+	std::reverse(backups.begin(), backups.end());
+
+	// The newest backup in each period is kept, for as many periods as asked
+	std::vector<bool> kept(backups.size(), false);
+	for (size_t i = 0; i < backups.size() && i < keep.last; ++i)
+		kept[i] = true;
+	const std::pair<size_t, const char*> periods[] = {
+		{ keep.hourly, "%Y-%m-%d %H" },
+		{ keep.daily, "%Y-%m-%d" },
+		{ keep.weekly, "%G-%V" },
+		{ keep.monthly, "%Y-%m" }
+	};
+	for (const auto &period : periods) {
+		std::string last;
+		size_t count = 0;
+		for (size_t i = 0; i < backups.size() && count < period.first; ++i) {
+			char key[32];
+			struct tm local;
+			strftime(key, sizeof (key), period.second, localtime_r(&backups[i].time, &local));
+			if (key == last)
+				continue;
+			last = key;
+			kept[i] = true;
+			++count;
+		}
+	}
+
+	for (size_t i = backups.size(); i-- > 0;)
+		if (!kept[i])
+			expired.push_back(backups[i]);
+	return expired;
+}
+
+Catalog *Catalog::get(std::string dir) {
+	static std::mutex catalogs_mtx;
+	static std::map<std::string, Catalog*> catalogs;
+	std::lock_guard<std::mutex> lck(catalogs_mtx);
+	auto catalog_it = catalogs.find(dir);
+	if (catalog_it != catalogs.end())
+		return catalog_it->second;
+	Catalog *catalog = new Catalog(dir);
+	// Not kept, so it is read again once it has been fixed
+	if (!catalog->load()) {
+		delete catalog;
+		return nullptr;
+	}
+	catalogs[dir] = catalog;
+	return catalog;
+}
+
+void Catalog::import() {
+	DIR *dirp = opendir(dir.c_str());
+	if (dirp != NULL) {
+		const std::string suffix = ".tgz";
+		struct dirent *ent;
+		while ((ent = readdir(dirp)) != NULL) {
+			std::string file = ent->d_name, server;
+			struct stat st;
+			if (file.size() <= suffix.size() || file.compare(file.size() - suffix.size(), suffix.size(), suffix) != 0 ||
+					!serverOf(file.substr(0, file.size() - suffix.size()), server) || stat((dir + '/' + file).c_str(), &st) == -1)
+				continue;
+			struct catalog_entry entry;
+			entry.server = server;
+			entry.name = file;
+			entry.format = "tar";
+			entry.time = st.st_mtime;
+			entry.size = st.st_size;
+			entry.checksum = entry.parent = "-";
+			entries.push_back(entry);
+		}
+		closedir(dirp);
+	}
+	dirp = opendir((dir + "/snapshots").c_str());
+	if (dirp != NULL) {
+		const std::string suffix = ".manifest";
+		struct dirent *ent;
+		while ((ent = readdir(dirp)) != NULL) {
+			std::string file = ent->d_name, server;
+			struct stat st;
+			if (file.size() <= suffix.size() || file.compare(file.size() - suffix.size(), suffix.size(), suffix) != 0 ||
+					!serverOf(file.substr(0, file.size() - suffix.size()), server) || stat((dir + "/snapshots/" + file).c_str(), &st) == -1)
+				continue;
+			struct catalog_entry entry;
+			entry.server = server;
+			entry.name = file.substr(0, file.size() - suffix.size());
+			entry.format = "dedup";
+			entry.time = st.st_mtime;
+			entry.size = st.st_size;
+			entry.checksum = entry.parent = "-";
+			entries.push_back(entry);
+		}
+		closedir(dirp);
+	}
+	std::stable_sort(entries.begin(), entries.end(), [](const struct catalog_entry &a, const struct catalog_entry &b) { return a.time < b.time; });
+}
+
+std::vector<struct catalog_entry> Catalog::list(std::string server) {
+	std::lock_guard<std::mutex> lck(mtx);
+	std::vector<struct catalog_entry> backups;
+	for (const struct catalog_entry &entry : entries)
+		if (entry.server == server)
+			backups.push_back(entry);
+	return backups;
+}
+
+bool Catalog::load() {
+	std::lock_guard<std::mutex> lck(mtx);
+	std::ifstream file(dir + "/catalog");
+	if (!file.is_open()) {
+		// First use: take in whatever is already there
+		import();
+		if (!entries.empty())
+			compact();
+		return true;
+	}
+	std::string line;
+	if (!std::getline(file, line) || line != CATALOG_HEADER) {
+		std::cerr << dir << "/catalog is not a backup catalog, move it out of the way to keep track of backups there" << std::endl;
+		return false;
+	}
+	while (std::getline(file, line)) {
+		++records;
+		std::vector<std::string> fields;
+		std::stringstream stream(line);
+		std::string field;
+		while (std::getline(stream, field, '\t'))
+			fields.push_back(field);
+		if (fields.size() == 3 && fields[0] == "-") {
+			entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const struct catalog_entry &entry) {
+				return entry.server == fields[1] && entry.name == fields[2];
+			}), entries.end());
+			continue;
+		}
+		if (fields.size() != 9 || fields[0] != "+")
+			continue;
+		struct catalog_entry entry;
+		entry.server = fields[1];
+		entry.name = fields[2];
+		entry.format = fields[3];
+		entry.time = strtoll(fields[4].c_str(), NULL, 10);
+		entry.size = strtoull(fields[5].c_str(), NULL, 10);
+		entry.duration = strtoul(fields[6].c_str(), NULL, 10);
+		entry.checksum = fields[7];
+		entry.parent = fields[8];
+		// A later line for the same backup replaces the earlier one (see add)
+		entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const struct catalog_entry &other) {
+			return other.server == entry.server && other.name == entry.name;
+		}), entries.end());
+		entries.push_back(entry);
+	}
+	return true;
+}
+
+bool Catalog::remove(std::string server, std::string name) {
+	std::lock_guard<std::mutex> lck(mtx);
+	entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const struct catalog_entry &entry) {
+		return entry.server == server && entry.name == name;
+	}), entries.end());
+	if (!append("-\t" + server + '\t' + name + '\n'))
+		return false;
+	if (records > entries.size() + CATALOG_SLACK)
+		compact();
+	return true;
+}
+
+Catalog::Catalog(std::string dir) {
+	this->dir = dir;
+}
@@ -0,0 +1,93 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "compress.hpp"
+
+#define COMPRESS_THREADS 2
+#define COMPRESS_CHUNK   (128 * 1024)
+
+// From linux/ioprio.h, which glibc doesn't wrap
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_CLASS_SHIFT 13
+
+static bool compressFile(std::string file, int level) {
+	int in = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in == -1) {
+		std::cerr << "Could not open " << file << " for compression (" << errno << ")" << std::endl;
+		return false;
+	}
+	struct stat st;
+	fstat(in, &st);
+
+	// Write to a temporary file, so a half compressed file is never mistaken for a whole one
+	std::string temp = file + ".gz.tmp";
+	int out = open(temp.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, st.st_mode & 0777);
+	if (out == -1) {
+		std::cerr << "Could not create " << temp << " (" << errno << ")" << std::endl;
+		close(in);
+		return false;
+	}
+	if (fchown(out, st.st_uid, st.st_gid) == -1 && errno != EPERM)
+		std::cerr << "Could not change owner of " << temp << " (" << errno << ")" << std::endl;
+	gzFile gz = gzdopen(out, ("wb" + std::to_string(level)).c_str());
+	if (gz == NULL) {
+		close(out);
+		close(in);
+		unlink(temp.c_str());
+		return false;
+	}
+
+	char buffer[COMPRESS_CHUNK];
+	ssize_t bytes;
+	bool ok = true;
+	while (ok && (bytes = read(in, buffer, sizeof (buffer))) != 0) {
+		if (bytes == -1) {
+			if (errno == EINTR)
+				continue;
+			ok = false;
+			break;
+		}
+		ok = gzwrite(gz, buffer, bytes) == bytes;
+	}
+	close(in);
+	ok = gzclose(gz) == Z_OK && ok;
+	if (!ok || rename(temp.c_str(), (file + ".gz").c_str()) == -1) {
+		std::cerr << "Could not compress " << file << std::endl;
+		unlink(temp.c_str());
+		return false;
+	}
+	unlink(file.c_str());
+	return true;
+}
+
+void becomeIdle() {
+	pid_t tid = syscall(SYS_gettid);
+	setpriority(PRIO_PROCESS, tid, 19);
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+}
+
+void Compressor::compress(std::string file, int level) {
+	pool->submit([file, level]() {
+		becomeIdle();
+		compressFile(file, level);
+	});
+}
+
+Compressor *Compressor::get() {
+	static Compressor compressor;
+	return &compressor;
+}
+
+Compressor::Compressor() {
+	pool = new ThreadPool(COMPRESS_THREADS);
+}
+
+Compressor::~Compressor() {
+	delete pool;
+}
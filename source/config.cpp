@@ -1,231 +1,680 @@
-#include <fstream>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
 #include <iostream>
+#include <limits.h>
 #include <pwd.h>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
 #include <vector>
 #include "config.hpp"
+#include "pattern.hpp"
+#include "schedule.hpp"
+
+#define DEFAULT_JOBS 16
+#define DEFAULT_BACKUP_JOBS 2
+#define DEFAULT_BACKUP_STAGGER 30
+#define DEFAULT_COMPRESS_LEVEL 6
+#define DEFAULT_START_JOBS 4
+// How long a user or group name looked up is trusted for
+#define LOOKUP_TIME 300
 
 enum conf_key {
 	ck_default,
 	ck_user,
 	ck_group,
 	ck_path,
-	//ck_world,
+	ck_world,
 	ck_backup,
+	ck_backup_format,
+	ck_backup_threads,
+	ck_backup_memory,
+	ck_backup_snapshot,
+	ck_backup_rate,
+	ck_backup_schedule,
+	ck_keep_last,
+	ck_keep_hourly,
+	ck_keep_daily,
+	ck_keep_weekly,
+	ck_keep_monthly,
+	ck_save_pattern,
+	ck_save_timeout,
 	ck_log,
+	ck_log_size,
+	ck_log_age,
+	ck_log_compress,
+	ck_input_limit,
+	ck_input_timeout,
 	ck_before,
 	ck_run,
 	ck_after,
-	ck_notify
+	ck_notify,
+	ck_start_priority,
+	ck_start_after,
+	ck_ready_pattern,
+	ck_ready_timeout,
+	ck_stop_pattern,
+	ck_crash_pattern,
+	ck_restart_countdown,
+	ck_stop_timeout,
+	ck_kill_timeout,
+	ck_count
+};
+
+// Daemon wide settings, which come before the first [server] block
+enum global_key {
+	gk_jobs,
+	gk_backup_jobs,
+	gk_backup_stagger,
+	gk_start_jobs
+};
+
+static const std::unordered_map<std::string_view, enum conf_key> conf_keys = {
+	{ "default", ck_default },
+	{ "user", ck_user },
+	{ "group", ck_group },
+	{ "path", ck_path },
+	{ "world", ck_world },
+	{ "backup", ck_backup },
+	{ "backup_format", ck_backup_format },
+	{ "backup_threads", ck_backup_threads },
+	{ "backup_memory", ck_backup_memory },
+	{ "backup_snapshot", ck_backup_snapshot },
+	{ "backup_rate", ck_backup_rate },
+	{ "backup_schedule", ck_backup_schedule },
+	{ "keep_last", ck_keep_last },
+	{ "keep_hourly", ck_keep_hourly },
+	{ "keep_daily", ck_keep_daily },
+	{ "keep_weekly", ck_keep_weekly },
+	{ "keep_monthly", ck_keep_monthly },
+	{ "save_pattern", ck_save_pattern },
+	{ "save_timeout", ck_save_timeout },
+	{ "log", ck_log },
+	{ "log_size", ck_log_size },
+	{ "log_age", ck_log_age },
+	{ "log_compress", ck_log_compress },
+	{ "input_limit", ck_input_limit },
+	{ "input_timeout", ck_input_timeout },
+	{ "before", ck_before },
+	{ "run", ck_run },
+	{ "after", ck_after },
+	{ "notify", ck_notify },
+	{ "start_priority", ck_start_priority },
+	{ "start_after", ck_start_after },
+	{ "ready_pattern", ck_ready_pattern },
+	{ "ready_timeout", ck_ready_timeout },
+	{ "stop_pattern", ck_stop_pattern },
+	{ "crash_pattern", ck_crash_pattern },
+	{ "restart_countdown", ck_restart_countdown },
+	{ "stop_timeout", ck_stop_timeout },
+	{ "kill_timeout", ck_kill_timeout }
+};
+
+static const std::unordered_map<std::string_view, enum global_key> global_keys = {
+	{ "jobs", gk_jobs },
+	{ "backup_jobs", gk_backup_jobs },
+	{ "backup_stagger", gk_backup_stagger },
+	{ "start_jobs", gk_start_jobs }
 };
 
 struct conf_entry {
-	size_t linenum;
+	size_t linenum = 0; // 0 if not given
 	std::string value;
 };
 
-bool Config::error() {
-	return parse_error;
+/*
+ * A [server] block, with its user and group looked up.
+ */
+struct conf_section {
+	struct conf_entry entries[ck_count];
+	std::vector<std::string> worlds;
+	uid_t user;
+	gid_t group;
+};
+
+// Parses a number with an optional unit suffix, multiplying by that unit
+static bool parseUnit(std::string value, unsigned long &number, std::map<char, unsigned long> units) {
+	if (value.empty())
+		return false;
+	unsigned long multiplier = 1;
+	auto unit_it = units.find(value.back());
+	if (unit_it != units.end()) {
+		multiplier = unit_it->second;
+		value.pop_back();
+	}
+	if (value.empty() || value.size() > 12 || value.find_first_not_of("0123456789") != std::string::npos)
+		return false;
+	number = std::stoul(value);
+	// Too big to count in once multiplied
+	if (number > ULONG_MAX / multiplier)
+		return false;
+	number *= multiplier;
+	return true;
 }
 
-std::map<std::string, Server*> Config::getServers() {
-	return servers;
+// Sizes in bytes, with an optional K, M or G suffix
+static bool parseSize(std::string value, unsigned long &bytes) {
+	return parseUnit(value, bytes, { { 'K', 1024 }, { 'M', 1024 * 1024 }, { 'G', 1024 * 1024 * 1024 } });
 }
 
-bool Config::parseConfigFile() {
-	std::map<std::string, std::map<enum conf_key, struct conf_entry>> temp_config;
-	std::map<std::string, std::vector<std::string>> temp_worlds;
+// Durations in seconds, with an optional s, m, h or d suffix
+static bool parseDuration(std::string value, unsigned long &seconds) {
+	return parseUnit(value, seconds, { { 's', 1 }, { 'm', 60 }, { 'h', 60 * 60 }, { 'd', 24 * 60 * 60 } });
+}
 
-	std::ifstream conf_file(path, std::ios_base::in);
-	std::string buffer, current_name;
-	for (size_t line = 1; getline(conf_file, buffer), !conf_file.eof(); ++line) {
+// Durations separated by spaces, longest first once parsed (none is fine)
+static bool parseCountdown(std::string value, std::vector<time_t> &steps) {
+	steps.clear();
+	while (!value.empty()) {
+		std::string::size_type space = value.find_first_of(' ');
+		unsigned long step;
+		if (space != 0) {
+			if (!parseDuration(value.substr(0, space), step) || step == 0)
+				return false;
+			steps.push_back(step);
+		}
+		value.erase(0, space == std::string::npos ? space : space + 1);
+	}
+	std::sort(steps.rbegin(), steps.rend());
+	steps.erase(std::unique(steps.begin(), steps.end()), steps.end());
+	return true;
+}
+
+// Whether a world is inside another one (or is it), "." holding every world
+static bool isInside(std::string_view world, std::string_view outer) {
+	return outer == "." || world == outer || (world.size() > outer.size() && world.compare(0, outer.size(), outer) == 0 && world[outer.size()] == '/');
+}
+
+// Retention is set as a whole, so keys taken out of the config go back to
+// keeping everything; other keys taken out leave the server as it was
+static bool isRetention(int ck) {
+	return ck == ck_keep_last || ck == ck_keep_hourly || ck == ck_keep_daily || ck == ck_keep_weekly || ck == ck_keep_monthly;
+}
+
+// Whether applying a block changes this setting of the server it was last
+// applied to (nullptr for a new server)
+static bool changes(const struct conf_section *applied, const struct conf_section &section, int ck) {
+	const struct conf_entry &entry = section.entries[ck];
+	if (applied == nullptr)
+		return entry.linenum;
+	if (ck == ck_user)
+		return applied->user != section.user;
+	if (ck == ck_group)
+		return applied->group != section.group;
+	const struct conf_entry &old = applied->entries[ck];
+	if (isRetention(ck))
+		return (entry.linenum != 0) != (old.linenum != 0) || entry.value != old.value;
+	return entry.linenum && (!old.linenum || entry.value != old.value);
+}
+
+// Whether applying a block changes anything about its server
+static bool changed(const struct conf_section *applied, const struct conf_section &section) {
+	if (applied == nullptr || applied->worlds != section.worlds)
+		return true;
+	for (int ck = 0; ck < ck_count; ++ck)
+		if (changes(applied, section, ck))
+			return true;
+	return false;
+}
+
+// Checks a value is right for its key
+static bool checkEntry(std::string path, int ck, const struct conf_entry &entry) {
+	const std::string &value = entry.value;
+	size_t line = entry.linenum;
+	if ((ck == ck_default || ck == ck_backup_snapshot) && value != "yes" && value != "no") {
+		std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected \"yes\" or \"no\", got \"" << value << "\"!" << std::endl;
+		return false;
+	}
+	if (ck == ck_backup_format && value != "tar" && value != "dedup") {
+		std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected \"tar\" or \"dedup\", got \"" << value << "\"!" << std::endl;
+		return false;
+	}
+	unsigned long number;
+	if (ck == ck_backup_threads && (value.empty() || value.size() > 6 || value.find_first_not_of("0123456789") != std::string::npos || std::stoi(value) == 0)) {
+		std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected a positive number, got \"" << value << "\"!" << std::endl;
+		return false;
+	}
+	if (isRetention(ck) && (value.empty() || value.size() > 6 || value.find_first_not_of("0123456789") != std::string::npos)) {
+		std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected a number, got \"" << value << "\"!" << std::endl;
+		return false;
+	}
+	if ((ck == ck_log_size || ck == ck_input_limit || ck == ck_backup_memory || ck == ck_backup_rate) && !parseSize(value, number)) {
+		std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected a size (e.g. 100M), got \"" << value << "\"!" << std::endl;
+		return false;
+	}
+	if (ck == ck_backup_schedule && !value.empty() && !Schedule().parse(value)) {
+		std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected a schedule (e.g. 0 */6 * * *), got \"" << value << "\"!" << std::endl;
+		return false;
+	}
+	if (ck == ck_start_priority && (value.empty() || value.size() > 6 || value.find_first_not_of("0123456789", value[0] == '-') != std::string::npos || value == "-")) {
+		std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected a number, got \"" << value << "\"!" << std::endl;
+		return false;
+	}
+	if ((ck == ck_save_pattern || ck == ck_ready_pattern || ck == ck_stop_pattern || ck == ck_crash_pattern) && !Pattern().compile(value)) {
+		std::cerr << "Error reading " << path << std::endl << "On line " << line << " - invalid regular expression \"" << value << "\"!" << std::endl;
+		return false;
+	}
+	if ((ck == ck_log_age || ck == ck_input_timeout || ck == ck_save_timeout || ck == ck_ready_timeout || ck == ck_stop_timeout || ck == ck_kill_timeout) && !parseDuration(value, number)) {
+		std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected a duration (e.g. 1d), got \"" << value << "\"!" << std::endl;
+		return false;
+	}
+	std::vector<time_t> steps;
+	if (ck == ck_restart_countdown && !parseCountdown(value, steps)) {
+		std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected durations separated by spaces (e.g. 5m 1m 10s), got \"" << value << "\"!" << std::endl;
+		return false;
+	}
+	if (ck == ck_log_compress && value != "yes" && value != "no" && (value.size() != 1 || value[0] < '1' || value[0] > '9')) {
+		std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected \"yes\", \"no\" or a level from 1 to 9, got \"" << value << "\"!" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Splits the file into blocks in one pass, checking only its syntax
+static bool readBlocks(std::string path, std::string_view text, std::map<std::string, struct conf_section> &sections, std::map<enum global_key, struct conf_entry> &global) {
+	struct conf_section *section = nullptr;
+	std::string_view::size_type pos = 0;
+	for (size_t line = 1; pos < text.size(); ++line) {
+		std::string_view::size_type newline = text.find('\n', pos);
+		if (newline == std::string_view::npos)
+			newline = text.size();
+		std::string_view buffer = text.substr(pos, newline - pos);
+		pos = newline + 1;
 		// Ignore empty lines and comments
 		if (buffer.empty() || buffer[0] == '#')
 			continue;
 		if (buffer[0] == '[') {
 			if (buffer.back() != ']') {
-				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected ']', got '" << buffer[buffer.size()] << "'!" << std::endl;
+				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected ']', got '" << buffer.back() << "'!" << std::endl;
+				return false;
+			}
+			if (buffer.size() == 2) {
+				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - server name cannot be empty!" << std::endl;
 				return false;
 			}
 			if (buffer[1] == '-') {
 				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - server name cannot start with '-'!" << std::endl;
 				return false;
 			}
-			current_name = buffer.substr(1, buffer.size() - 2);
-			if (temp_config.find(current_name) != temp_config.end()) {
-				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - A server named [" << current_name << "] was already defined!" << std::endl;
+			std::string name(buffer.substr(1, buffer.size() - 2));
+			auto inserted = sections.emplace(name, conf_section());
+			if (!inserted.second) {
+				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - A server named [" << name << "] was already defined!" << std::endl;
 				return false;
 			}
-			temp_config[current_name];
+			section = &inserted.first->second;
+			continue;
 		}
-		else {
-			if (current_name.empty()) {
-				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - no [server] block was defined yet!" << std::endl;
+		std::string_view::size_type equals = buffer.find_first_of('=');
+		if (equals == std::string_view::npos) {
+			std::cerr << "Error reading " << path << std::endl << "On line " << line << " - no '=' found!" << std::endl;
+			return false;
+		}
+		std::string_view key = buffer.substr(0, equals);
+		std::string_view value = buffer.substr(equals + 1);
+		if (section == nullptr) {
+			auto key_it = global_keys.find(key);
+			if (key_it == global_keys.end()) {
+				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - unknown daemon setting \"" << key << "\" (or no [server] block was defined yet)!" << std::endl;
 				return false;
 			}
-			std::string::size_type equals = buffer.find_first_of('=');
-			if (equals == std::string::npos) {
-				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - no '=' found!" << std::endl;
+			enum global_key gk = key_it->second;
+			auto orig_it = global.find(gk);
+			if (orig_it != global.end()) {
+				std::cerr << "Error reading " << path << std::endl;
+				std::cerr << "On line " << line << " - redefinition of \"" << key << "\" as \"" << value << "\"!" << std::endl;
+				std::cerr << "\tOriginally defined on line " << orig_it->second.linenum << " as \"" << orig_it->second.value << "\"." << std::endl;
 				return false;
 			}
-			std::string key = buffer.substr(0, equals);
-			std::string value = buffer.substr(equals + 1);
-			enum conf_key ck;
-			if (key == "default")
-				ck = ck_default;
-			else if (key == "user")
-				ck = ck_user;
-			else if (key == "group")
-				ck = ck_group;
-			else if (key == "path")
-				ck = ck_path;
-			/*else if (key == "world")
-				ck = ck_world;*/
-			else if (key == "backup")
-				ck = ck_backup;
-			else if (key == "log")
-				ck = ck_log;
-			else if (key == "before")
-				ck = ck_before;
-			else if (key == "run")
-				ck = ck_run;
-			else if (key == "after")
-				ck = ck_after;
-			else if (key == "notify")
-				ck = ck_notify;
-			else {
-				std::cerr << "Error reading " << path << std::endl << "On line " << line << " unknown key \"" << key << "\"!" << std::endl;
+			unsigned long number;
+			if (gk == gk_backup_stagger && !parseDuration(std::string(value), number)) {
+				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected a duration (e.g. 1d), got \"" << value << "\"!" << std::endl;
 				return false;
 			}
-			//if (ck != ck_world) {
-			auto orig_it = temp_config[current_name].find(ck);
-			if (orig_it != temp_config[current_name].end()) {
-				std::cerr << "Error reading " << path << std::endl;
-				std::cerr << "On line " << line << " - redefinition of \"" << key << "\" as \"" << value << "\"!" << std::endl;
-				std::cerr << "\tOriginally defined on line " << orig_it->second.linenum << " as \"" << orig_it->second.value << "\"." << std::endl;
+			if ((gk == gk_jobs || gk == gk_backup_jobs || gk == gk_start_jobs) && (value.empty() || value.size() > 6 || value.find_first_not_of("0123456789") != std::string_view::npos || std::stoi(std::string(value)) == 0)) {
+				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected a positive number, got \"" << value << "\"!" << std::endl;
+				return false;
+			}
+			global[gk] = { line, std::string(value) };
+			continue;
+		}
+		auto key_it = conf_keys.find(key);
+		if (key_it == conf_keys.end()) {
+			std::cerr << "Error reading " << path << std::endl << "On line " << line << " unknown key \"" << key << "\"!" << std::endl;
+			return false;
+		}
+		enum conf_key ck = key_it->second;
+		if (ck == ck_world) {
+			// May be given once per world
+			while (value.size() > 1 && value.back() == '/')
+				value.remove_suffix(1);
+			if (value.empty() || value[0] == '/' || value == ".." || value.compare(0, 3, "../") == 0 || value.find("/../") != std::string_view::npos ||
+					(value.size() >= 3 && value.compare(value.size() - 3, 3, "/..") == 0)) {
+				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected a directory inside the server's path, got \"" << value << "\"!" << std::endl;
 				return false;
 			}
-			if (ck == ck_default && value != "yes" && value != "no") {
-				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected \"yes\" or \"no\", got \"" << value << "\"!" << std::endl;
+			std::vector<std::string> &worlds = section->worlds;
+			if (std::find(worlds.begin(), worlds.end(), value) != worlds.end()) {
+				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - world \"" << value << "\" is listed twice!" << std::endl;
 				return false;
 			}
-			temp_config[current_name][ck] = (struct conf_entry){ .linenum = line, .value = value };
-			/*}
-			else {
-				if (value.empty()) {
-					std::cerr << "Error reading " << path << std::endl << "On line " << line << " - expected value for \"world\" key!" << std::endl;
-					return false;
-				}
-				temp_worlds[current_name].push_back(value);
-			}*/
+			// Backed up as a whole either way, and copied twice if both are listed
+			auto nested_it = std::find_if(worlds.begin(), worlds.end(), [&](const std::string &world) {
+				return isInside(value, world) || isInside(world, value);
+			});
+			if (nested_it != worlds.end()) {
+				std::cerr << "Error reading " << path << std::endl << "On line " << line << " - world \"" << value << "\" overlaps with \"" << *nested_it << "\", only list the outer one!" << std::endl;
+				return false;
+			}
+			worlds.emplace_back(value);
+			continue;
 		}
+		struct conf_entry &entry = section->entries[ck];
+		if (entry.linenum) {
+			std::cerr << "Error reading " << path << std::endl;
+			std::cerr << "On line " << line << " - redefinition of \"" << key << "\" as \"" << value << "\"!" << std::endl;
+			std::cerr << "\tOriginally defined on line " << entry.linenum << " as \"" << entry.value << "\"." << std::endl;
+			return false;
+		}
+		entry.linenum = line;
+		entry.value = value;
 	}
-	conf_file.close();
+	return true;
+}
 
-	// Make sure necessary keys were included
-	for (std::pair<std::string, std::map<enum conf_key, struct conf_entry>> block : temp_config) {
-		auto end = block.second.end();
-		// Check if we have a user
-		if (block.second.find(ck_user) == end) {
-			std::cerr << "Error in [" << block.first << "], no user defined!" << std::endl;
-			return false;
+bool Config::error() {
+	return parse_error;
+}
+
+size_t Config::getBackupJobs() {
+	return backup_jobs;
+}
+
+time_t Config::getBackupStagger() {
+	return backup_stagger;
+}
+
+size_t Config::getJobs() {
+	return jobs;
+}
+
+std::string Config::getPath() {
+	return path;
+}
+
+size_t Config::getStartJobs() {
+	return start_jobs;
+}
+
+std::map<std::string, Server*> Config::getServers() {
+	return servers;
+}
+
+bool Config::lookupGroup(std::string name, size_t linenum, gid_t &gid) {
+	time_t now = time(NULL);
+	auto cached_it = groups.find(name);
+	if (cached_it != groups.end() && now - cached_it->second.second < LOOKUP_TIME) {
+		gid = cached_it->second.first;
+		return true;
+	}
+	errno = 0;
+	struct group *grp_ent = getgrnam(name.c_str());
+	if (grp_ent == NULL) {
+		switch (errno) {
+			case EINTR:
+			case EIO:
+			case EMFILE:
+			case ENFILE:
+			case ENOMEM:
+			case ERANGE:
+				std::cerr << "getgrnam error (" << errno << ")" << std::endl;
+				break;
+			default:
+				std::cerr << "Error reading " << path << std::endl << "On line " << linenum << " - no such group with the name \"" << name << "\"!" << std::endl;
 		}
-		// Now check if user is valid
-		errno = 0;
-		struct passwd *pwd_ent = getpwnam(block.second[ck_user].value.c_str());
-		if (pwd_ent == NULL) {
-			switch (errno) {
-				case EINTR:
-				case EIO:
-				case EMFILE:
-				case ENFILE:
-				case ENOMEM:
-				case ERANGE:
-					std::cerr << "getpwnam error (" << errno << ")" << std::endl;
-					break;
-				default:
-					std::cerr << "Error reading " << path << std::endl << "On line " << block.second[ck_user].linenum << " - no such user with the name \"" << block.second[ck_user].value << "\"!" << std::endl;
-			}
+		return false;
+	}
+	gid = grp_ent->gr_gid;
+	groups[name] = { gid, now };
+	return true;
+}
+
+bool Config::lookupUser(std::string name, size_t linenum, uid_t &uid) {
+	time_t now = time(NULL);
+	auto cached_it = users.find(name);
+	if (cached_it != users.end() && now - cached_it->second.second < LOOKUP_TIME) {
+		uid = cached_it->second.first;
+		return true;
+	}
+	errno = 0;
+	struct passwd *pwd_ent = getpwnam(name.c_str());
+	if (pwd_ent == NULL) {
+		switch (errno) {
+			case EINTR:
+			case EIO:
+			case EMFILE:
+			case ENFILE:
+			case ENOMEM:
+			case ERANGE:
+				std::cerr << "getpwnam error (" << errno << ")" << std::endl;
+				break;
+			default:
+				std::cerr << "Error reading " << path << std::endl << "On line " << linenum << " - no such user with the name \"" << name << "\"!" << std::endl;
+		}
+		return false;
+	}
+	uid = pwd_ent->pw_uid;
+	users[name] = { uid, now };
+	return true;
+}
+
+bool Config::parseConfigFile() {
+	std::map<std::string, struct conf_section> read_sections;
+	std::map<enum global_key, struct conf_entry> global;
+
+	// Read whole, and parsed where it lies
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		std::cerr << "Could not read " << path << " (" << errno << ")" << std::endl;
+		if (fd != -1)
+			close(fd);
+		return false;
+	}
+	std::string text(st.st_size, '\0');
+	size_t done = 0;
+	while (done < text.size()) {
+		ssize_t bytes = read(fd, &text[done], text.size() - done);
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes == -1) {
+			std::cerr << "Could not read " << path << " (" << errno << ")" << std::endl;
+			close(fd);
 			return false;
 		}
-		temp_config[block.first][ck_user].value = std::to_string(pwd_ent->pw_uid);
+		if (bytes == 0)
+			break;
+		done += bytes;
+	}
+	close(fd);
+	text.resize(done);
+	if (!readBlocks(path, text, read_sections, global))
+		return false;
 
-		// Check if we have a group
-		if (block.second.find(ck_group) == end) {
+	// Check the blocks that changed since they were last applied
+	for (auto &block : read_sections) {
+		struct conf_section &section = block.second;
+		if (!section.entries[ck_user].linenum) {
+			std::cerr << "Error in [" << block.first << "], no user defined!" << std::endl;
+			return false;
+		}
+		if (!lookupUser(section.entries[ck_user].value, section.entries[ck_user].linenum, section.user))
+			return false;
+		if (!section.entries[ck_group].linenum) {
 			std::cerr << "Error in [" << block.first << "], no group defined!" << std::endl;
 			return false;
 		}
-		// Now check if group is valid
-		errno = 0;
-		struct group *grp_ent = getgrnam(block.second[ck_group].value.c_str());
-		if (grp_ent == NULL) {
-			switch (errno) {
-				case EINTR:
-				case EIO:
-				case EMFILE:
-				case ENFILE:
-				case ENOMEM:
-				case ERANGE:
-					std::cerr << "getgrnam error (" << errno << ")" << std::endl;
-					break;
-				default:
-					std::cerr << "Error reading " << path << std::endl << "On line " << block.second[ck_group].linenum << " - no such group with the name \"" << block.second[ck_user].value << "\"!" << std::endl;
-			}
+		if (!lookupGroup(section.entries[ck_group].value, section.entries[ck_group].linenum, section.group))
+			return false;
+		if (!section.entries[ck_path].linenum) {
+			std::cerr << "Error in [" << block.first << "], no path defined!" << std::endl;
 			return false;
 		}
-		temp_config[block.first][ck_group].value = std::to_string(grp_ent->gr_gid);
 
-		// Check if we have a path
-		if (block.second.find(ck_path) == end) {
-			std::cerr << "Error in [" << block.first << "], no path defined!" << std::endl;
+		// Entries of a block applied as it is were checked back then, but how it
+		// fits with the others is checked again, as they may have changed
+		auto applied_it = sections.find(block.first);
+		if (applied_it == sections.end() || changed(applied_it->second, section))
+			for (int ck = 0; ck < ck_count; ++ck)
+				if (section.entries[ck].linenum && !checkEntry(path, ck, section.entries[ck]))
+					return false;
+		// Servers started first need to be there
+		const struct conf_entry &start_after = section.entries[ck_start_after];
+		for (std::string::size_type pos = 0; pos < start_after.value.size();) {
+			std::string::size_type space = start_after.value.find_first_of(' ', pos);
+			std::string other = start_after.value.substr(pos, space == std::string::npos ? space : space - pos);
+			pos = space == std::string::npos ? space : space + 1;
+			if (other.empty())
+				continue;
+			if (other == block.first || read_sections.find(other) == read_sections.end()) {
+				std::cerr << "Error reading " << path << std::endl << "On line " << start_after.linenum << " - no other server named [" << other << "] to start after!" << std::endl;
+				return false;
+			}
+		}
+		// Scheduled backups need somewhere to go
+		const struct conf_entry &schedule = section.entries[ck_backup_schedule];
+		if (!schedule.value.empty() && section.entries[ck_backup].value.empty()) {
+			std::cerr << "Error reading " << path << std::endl << "On line " << schedule.linenum << " - backups are scheduled, but no backup directory is defined!" << std::endl;
 			return false;
 		}
 	}
 
-	// Set server values
-	for (std::pair<std::string, std::map<enum conf_key, struct conf_entry>> block : temp_config) {
-		bool exists = servers.find(block.first) != servers.end(), running = false;
-		if (!exists)
+	// Set daemon values
+	jobs = global.find(gk_jobs) == global.end() ? DEFAULT_JOBS : std::stoi(global[gk_jobs].value);
+	backup_jobs = global.find(gk_backup_jobs) == global.end() ? DEFAULT_BACKUP_JOBS : std::stoi(global[gk_backup_jobs].value);
+	backup_stagger = DEFAULT_BACKUP_STAGGER;
+	if (global.find(gk_backup_stagger) != global.end()) {
+		unsigned long stagger;
+		parseDuration(global[gk_backup_stagger].value, stagger);
+		backup_stagger = stagger;
+	}
+	start_jobs = global.find(gk_start_jobs) == global.end() ? DEFAULT_START_JOBS : std::stoi(global[gk_start_jobs].value);
+
+	// Set server values, only on servers whose block changed
+	for (auto &block : read_sections) {
+		struct conf_section &section = block.second;
+		auto applied_it = sections.find(block.first);
+		struct conf_section *applied = applied_it == sections.end() ? nullptr : applied_it->second;
+		if (applied != nullptr && !changed(applied, section))
+			continue;
+		if (applied == nullptr)
 			servers[block.first] = new Server(block.first);
 		Server *s = servers[block.first];
-		for (std::pair<enum conf_key, struct conf_entry> line : block.second) {
-			std::string value = line.second.value;
-			switch (line.first) {
+		// Stopped once for everything it runs with, and started again at the
+		// end. New servers aren't running, and asking would start the
+		// supervisor before the daemon forks
+		bool running = false;
+		if (applied != nullptr && (changes(applied, section, ck_user) || changes(applied, section, ck_group) || changes(applied, section, ck_path) ||
+				changes(applied, section, ck_log) || changes(applied, section, ck_run)))
+			running = s->stop();
+		if (running)
+			std::cout << "Restarting [" << block.first << "] with its new settings" << std::endl;
+		bool retention = false;
+		for (int ck = 0; ck < ck_count; ++ck) {
+			if (!changes(applied, section, ck))
+				continue;
+			std::string value = section.entries[ck].value;
+			switch (ck) {
 				case ck_default:
-					if (s->defaultStartup() == (value == "yes"))
-						break;
 					s->setDefault(value == "yes");
 					break;
-				case ck_user: {
-					uid_t uid = std::stoi(value);
-					if (s->getUser() == uid)
-						break;
-					if (s->setUser(uid))
-						running = true;
+				case ck_user:
+					s->setUser(section.user);
 					break;
-				}
-				case ck_group: {
-					gid_t gid = std::stoi(value);
-					if (s->getGroup() == gid)
-						break;
-					if (s->setGroup(gid))
-						running = true;
+				case ck_group:
+					s->setGroup(section.group);
 					break;
-				}
 				case ck_path:
-					if (s->getPath() == value)
-						break;
-					if (s->setPath(value))
-						running = true;
+					s->setPath(value);
+					break;
+				case ck_world:
+					// Kept in worlds instead, as it may repeat
 					break;
 				case ck_backup:
 					s->setBackup(value);
 					break;
+				case ck_backup_format:
+					s->setBackupFormat(value);
+					break;
+				case ck_backup_threads:
+					s->setBackupThreads(std::stoi(value));
+					break;
+				case ck_backup_memory: {
+					unsigned long backup_memory;
+					parseSize(value, backup_memory);
+					s->setBackupMemory(backup_memory);
+					break;
+				}
+				case ck_backup_snapshot:
+					s->setBackupSnapshot(value == "yes");
+					break;
+				case ck_backup_rate: {
+					unsigned long backup_rate;
+					parseSize(value, backup_rate);
+					s->setBackupRate(backup_rate);
+					break;
+				}
+				case ck_backup_schedule:
+					s->setBackupSchedule(value);
+					break;
+				case ck_keep_last:
+				case ck_keep_hourly:
+				case ck_keep_daily:
+				case ck_keep_weekly:
+				case ck_keep_monthly:
+					retention = true;
+					break;
+				case ck_save_pattern:
+					s->setSavePattern(value);
+					break;
+				case ck_save_timeout: {
+					unsigned long save_timeout;
+					parseDuration(value, save_timeout);
+					s->setSaveTimeout(save_timeout);
+					break;
+				}
 				case ck_log:
-					if (s->getLog() == value)
-						break;
-					if (s->setLog(value))
-						running = true;
+					s->setLog(value);
+					break;
+				case ck_log_size: {
+					unsigned long log_size;
+					parseSize(value, log_size);
+					s->setLogSize(log_size);
+					break;
+				}
+				case ck_log_age: {
+					unsigned long log_age;
+					parseDuration(value, log_age);
+					s->setLogAge(log_age);
+					break;
+				}
+				case ck_input_limit: {
+					unsigned long input_limit;
+					parseSize(value, input_limit);
+					s->setInputLimit(input_limit);
+					break;
+				}
+				case ck_input_timeout: {
+					unsigned long input_timeout;
+					parseDuration(value, input_timeout);
+					s->setInputTimeout(input_timeout);
+					break;
+				}
+				case ck_log_compress:
+					s->setLogCompress(value == "no" ? 0 : value == "yes" ? DEFAULT_COMPRESS_LEVEL : value[0] - '0');
 					break;
 				case ck_before: {
 					std::vector<std::string> before_argv;
@@ -234,16 +683,11 @@ bool Config::parseConfigFile() {
 						before_argv.push_back(value.substr(0, space));
 						value.erase(0, space == std::string::npos ? space : space + 1);
 					}
-					if (s->getBefore() == before_argv)
-						break;
 					s->setBefore(before_argv);
 					break;
 				}
 				case ck_run:
-					if (s->getRun() == value)
-						break;
-					if (s->setRun(value))
-						running = true;
+					s->setRun(value);
 					break;
 				case ck_after: {
 					std::vector<std::string> after_argv;
@@ -252,32 +696,98 @@ bool Config::parseConfigFile() {
 						after_argv.push_back(value.substr(0, space));
 						value.erase(0, space == std::string::npos ? space : space + 1);
 					}
-					if (s->getAfter() == after_argv)
-						break;
 					s->setAfter(after_argv);
 					break;
 				}
 				case ck_notify:
-					if (s->getNotify() == value)
-						break;
 					s->setNotify(value);
 					break;
+				case ck_start_priority:
+					s->setStartPriority(std::stoi(value));
+					break;
+				case ck_start_after: {
+					std::vector<std::string> start_after;
+					while (!value.empty()) {
+						std::string::size_type space = value.find_first_of(' ');
+						if (space != 0)
+							start_after.push_back(value.substr(0, space));
+						value.erase(0, space == std::string::npos ? space : space + 1);
+					}
+					s->setStartAfter(start_after);
+					break;
+				}
+				case ck_ready_pattern:
+					s->setReadyPattern(value);
+					break;
+				case ck_ready_timeout: {
+					unsigned long ready_timeout;
+					parseDuration(value, ready_timeout);
+					s->setReadyTimeout(ready_timeout);
+					break;
+				}
+				case ck_stop_pattern:
+					s->setStopPattern(value);
+					break;
+				case ck_crash_pattern:
+					s->setCrashPattern(value);
+					break;
+				case ck_restart_countdown: {
+					std::vector<time_t> restart_countdown;
+					parseCountdown(value, restart_countdown);
+					s->setRestartCountdown(restart_countdown);
+					break;
+				}
+				case ck_stop_timeout: {
+					unsigned long stop_timeout;
+					parseDuration(value, stop_timeout);
+					s->setStopTimeout(stop_timeout);
+					break;
+				}
+				case ck_kill_timeout: {
+					unsigned long kill_timeout;
+					parseDuration(value, kill_timeout);
+					s->setKillTimeout(kill_timeout);
+					break;
+				}
 			}
 		}
-		/*// Add worlds
-		for (std::string world : temp_worlds[block.first])
-			s->addWorld(world);*/
+		if (retention) {
+			struct retention keep;
+			const struct conf_entry *entries = section.entries;
+			keep.last = entries[ck_keep_last].linenum ? std::stoi(entries[ck_keep_last].value) : 0;
+			keep.hourly = entries[ck_keep_hourly].linenum ? std::stoi(entries[ck_keep_hourly].value) : 0;
+			keep.daily = entries[ck_keep_daily].linenum ? std::stoi(entries[ck_keep_daily].value) : 0;
+			keep.weekly = entries[ck_keep_weekly].linenum ? std::stoi(entries[ck_keep_weekly].value) : 0;
+			keep.monthly = entries[ck_keep_monthly].linenum ? std::stoi(entries[ck_keep_monthly].value) : 0;
+			s->setRetention(keep);
+		}
+		// Back up only these, or everything if none are given
+		if (s->getWorlds() != section.worlds)
+			s->setWorlds(section.worlds);
+
+		// Remember what the server has now, including keys taken out since
+		if (applied == nullptr)
+			sections[block.first] = applied = new conf_section();
+		else
+			for (int ck = 0; ck < ck_count; ++ck)
+				if (!section.entries[ck].linenum && !isRetention(ck))
+					section.entries[ck] = std::move(applied->entries[ck]);
+		*applied = std::move(section);
 		// Start server?
 		if (running)
 			s->start();
 	}
-	for (auto block : servers) {
-		if (temp_config.find(block.first) == temp_config.end()) {
-			std::cout << "[" << block.first << "] is no longer in the config file!" << std::endl;
-			block.second->stop();
-			delete servers[block.first];
-			servers.erase(block.first);
+	for (auto server_it = servers.begin(); server_it != servers.end();) {
+		if (read_sections.find(server_it->first) != read_sections.end()) {
+			++server_it;
+			continue;
 		}
+		std::cout << "[" << server_it->first << "] is no longer in the config file!" << std::endl;
+		server_it->second->stop();
+		delete server_it->second;
+		delete sections[server_it->first];
+		sections.erase(server_it->first);
+		server_it = servers.erase(server_it);
 	}
 
 	return true;
@@ -290,6 +800,8 @@ Config::Config(std::string path) {
 }
 
 Config::~Config() {
-	for (std::pair<std::string, Server*> block : servers)
+	for (const auto &block : servers)
+		delete block.second;
+	for (const auto &block : sections)
 		delete block.second;
 }
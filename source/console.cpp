@@ -0,0 +1,152 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include "console.hpp"
+#include "supervisor.hpp"
+
+void Console::check() {
+	timer = 0;
+	if (pipefd[1] == -1 || !pending())
+		return;
+	if (written - unread() == consumed) {
+		stall();
+		return;
+	}
+	watchStall();
+}
+
+void Console::close() {
+	if (pipefd[0] == -1)
+		return;
+	Supervisor::get()->events()->remove(pipefd[1]);
+	if (timer)
+		Supervisor::get()->events()->cancel(timer);
+	timer = 0;
+	queue.clear();
+	sent = 0;
+	::close(pipefd[0]);
+	::close(pipefd[1]);
+	pipefd[0] = pipefd[1] = -1;
+}
+
+void Console::flush() {
+	while (sent < queue.size()) {
+		ssize_t bytes = ::write(pipefd[1], queue.data() + sent, queue.size() - sent);
+		if (bytes == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			// EPIPE: nothing is reading, and nothing will
+			std::cerr << "Could not write to console (" << errno << "), dropping " << queue.size() - sent << " bytes" << std::endl;
+			sent = queue.size();
+			break;
+		}
+		sent += bytes;
+		written += bytes;
+	}
+
+	if (sent == queue.size()) {
+		queue.clear();
+		sent = 0;
+		watchWritable(false);
+	}
+	else {
+		// Don't let what's been written pile up at the front
+		if (sent > queue.size() / 2) {
+			queue.erase(0, sent);
+			sent = 0;
+		}
+		watchWritable(true);
+	}
+	if (!timer)
+		watchStall();
+}
+
+void Console::onStall(std::function<void(size_t)> on_stall) {
+	this->on_stall = on_stall;
+}
+
+bool Console::open() {
+	if (pipe2(pipefd, O_CLOEXEC) == -1) {
+		std::cerr << "pipe error (" << errno << ")" << std::endl;
+		return false;
+	}
+	// Children get the read end, which must stay blocking
+	fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
+	if (!Supervisor::get()->events()->add(pipefd[1], 0, [this](uint32_t) { flush(); })) {
+		::close(pipefd[0]);
+		::close(pipefd[1]);
+		pipefd[0] = pipefd[1] = -1;
+		return false;
+	}
+	written = consumed = 0;
+	return true;
+}
+
+int Console::output() {
+	return pipefd[0];
+}
+
+size_t Console::pending() {
+	return queue.size() - sent + unread();
+}
+
+void Console::setLimit(size_t limit) {
+	this->limit = limit;
+}
+
+void Console::setTimeout(time_t timeout) {
+	this->timeout = timeout;
+}
+
+void Console::stall() {
+	size_t dropped = queue.size() - sent;
+	queue.clear();
+	sent = 0;
+	watchWritable(false);
+	// Not checked again until more input is written, so this is reported once
+	if (on_stall)
+		on_stall(dropped);
+}
+
+size_t Console::unread() {
+	int bytes = 0;
+	if (pipefd[1] == -1 || ioctl(pipefd[1], FIONREAD, &bytes) == -1)
+		return 0;
+	return bytes;
+}
+
+void Console::watchStall() {
+	if (!timeout || !pending())
+		return;
+	consumed = written - unread();
+	timer = Supervisor::get()->events()->after(timeout * 1000, [this]() { check(); });
+}
+
+void Console::watchWritable(bool writable) {
+	Supervisor::get()->events()->modify(pipefd[1], writable ? (uint32_t)EPOLLOUT : 0);
+}
+
+bool Console::write(std::string input, bool force) {
+	if (pipefd[1] == -1)
+		return false;
+	if (!force && limit && pending() + input.size() > limit)
+		return false;
+	bool idle = queue.size() == sent;
+	queue += input;
+	// Otherwise we're already waiting to write more
+	if (idle)
+		flush();
+	return true;
+}
+
+Console::Console() {
+}
+
+Console::~Console() {
+	close();
+}
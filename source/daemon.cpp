@@ -0,0 +1,525 @@
+#include <algorithm>
+#include <condition_variable>
+#include <errno.h>
+#include <iostream>
+#include <mutex>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "catalog.hpp"
+#include "daemon.hpp"
+
+// Output a client may fall behind by while following logs, before it is cut off
+#define FOLLOW_BACKLOG (4 * 1024 * 1024)
+
+void Daemon::acceptClient() {
+	int fd;
+	while (fd = sock->accept(), fd != -1) {
+		unsigned long id = next_client++;
+		Socket *client = new Socket(fd);
+		if (!loop.add(fd, EPOLLIN | EPOLLRDHUP, [this, id](uint32_t events) { clientEvent(id, events); })) {
+			delete client;
+			continue;
+		}
+		clients[id] = client;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		std::cerr << "accept error (" << errno << ")" << std::endl;
+}
+
+void Daemon::clientEvent(unsigned long id, uint32_t events) {
+	auto client_it = clients.find(id);
+	if (client_it == clients.end())
+		return;
+	Socket *client = client_it->second;
+
+	if (events & EPOLLOUT) {
+		if (!client->flush()) {
+			closeClient(id);
+			return;
+		}
+		if (!client->pending())
+			loop.modify(client->fd(), EPOLLIN | EPOLLRDHUP);
+	}
+	if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+		return;
+
+	bool open = client->read() && !(events & (EPOLLHUP | EPOLLERR));
+	while (client->hasMessage() && clients.find(id) != clients.end())
+		handleRequest(id, client->nextMessage());
+	if (!open)
+		closeClient(id);
+}
+
+void Daemon::closeClient(unsigned long id) {
+	auto client_it = clients.find(id);
+	if (client_it == clients.end())
+		return;
+	loop.remove(client_it->second->fd());
+	delete client_it->second;
+	clients.erase(client_it);
+	auto range = followers.equal_range(id);
+	for (auto follower_it = range.first; follower_it != range.second; ++follower_it)
+		*follower_it->second = false;
+	followers.erase(range.first, range.second);
+}
+
+void Daemon::configChanged() {
+	// Read, and only applied if it has no errors, on the actions thread like
+	// the reload command
+	actions->submit([this]() {
+		std::cout << "Config file changed, reloading..." << std::endl;
+		if (!config->parseConfigFile()) {
+			std::cerr << "Config file has errors, keeping the previous config." << std::endl;
+			return;
+		}
+		updateConfig();
+		std::cout << "Reloaded config." << std::endl;
+	});
+}
+
+size_t Daemon::forEachServer(std::function<bool(Server*)> action, std::function<void(Server*)> done) {
+	std::mutex mtx;
+	std::condition_variable cv;
+	size_t remaining = servers.size(), succeeded = 0;
+	for (auto block : servers) {
+		Server *s = block.second;
+		fanout->submit([&, s]() {
+			bool ok = action(s);
+			std::lock_guard<std::mutex> lck(mtx);
+			if (ok) {
+				done(s);
+				++succeeded;
+			}
+			if (--remaining == 0)
+				cv.notify_one();
+		});
+	}
+	std::unique_lock<std::mutex> lck(mtx);
+	while (remaining)
+		cv.wait(lck);
+	return succeeded;
+}
+
+void Daemon::handleRequest(unsigned long client, std::string_view line) {
+	struct request req;
+	if (!parseRequest(line, req)) {
+		sendReply(client, { 0, st_bad, "Malformed request \"" + std::string(line) + "\"!" });
+		return;
+	}
+	Reply reply = replyTo(client, req.id);
+
+	if (req.command == "quit") {
+		reply(st_ok, "Stopping daemon.");
+		loop.stop();
+		return;
+	}
+	if (req.command == "user" && (req.server.empty() || req.argument.empty())) {
+		reply(st_bad, "Custom commands require a server name and a command!");
+		return;
+	}
+	if (req.command == "restore" && (req.server.empty() || req.argument.empty())) {
+		reply(st_bad, "\"restore\" requires a server name and a backup!");
+		return;
+	}
+	if (req.command == "logs") {
+		if (req.server.empty()) {
+			reply(st_bad, "\"logs\" requires a server name!");
+			return;
+		}
+		actions->submit([this, client, req]() { sendLogs(client, req); });
+		return;
+	}
+	if (req.command == "backups") {
+		if (req.server.empty()) {
+			reply(st_bad, "\"backups\" requires a server name!");
+			return;
+		}
+		actions->submit([this, client, req]() { sendBackups(client, req); });
+		return;
+	}
+	if (req.command == "status") {
+		actions->submit([this, client, req]() { sendStatus(client, req); });
+		return;
+	}
+	if (req.command != "reload" && req.command != "start" && req.command != "restart" && req.command != "stop" && req.command != "backup" && req.command != "restore" && req.command != "user" && req.command != "cancel") {
+		reply(st_bad, "Unknown command \"" + req.command + "\"!");
+		return;
+	}
+	actions->submit([this, req, reply]() { runCommand(req, reply); });
+}
+
+Reply Daemon::replyTo(unsigned long client, unsigned long id) {
+	return [this, client, id](enum status code, std::string text) {
+		(isSuccess(code) || code == st_partial ? std::cout : std::cerr) << text << std::endl;
+		struct reply rep = { id, code, text };
+		loop.post([this, client, rep]() { sendReply(client, rep); });
+	};
+}
+
+void Daemon::restored(std::string name, std::string backup, bool was_running, bool ok, Reply reply) {
+	// Back to how it was, restored or not, unless a reload removed it meanwhile
+	auto block_it = servers.find(name);
+	if (was_running && block_it != servers.end() && block_it->second->start())
+		reply(st_partial, "Starting server [" + name + "]");
+	if (ok)
+		reply(st_ok, "Restored server [" + name + "] from " + backup);
+	else
+		reply(st_error, "Could not restore server [" + name + "] from " + backup + ", see the daemon's log!");
+	std::vector<std::function<void()>> held = std::move(restoring[name]);
+	restoring.erase(name);
+	for (std::function<void()> &command : held)
+		command();
+}
+
+void Daemon::run() {
+	if (!loop.add(sock->fd(), EPOLLIN, [this](uint32_t) { acceptClient(); }))
+		return;
+	loop.run();
+	loop.remove(sock->fd());
+
+	// Restores hand their replies to the actions thread when they are done
+	{
+		std::unique_lock<std::mutex> lck(restores_mtx);
+		while (restores)
+			restores_cv.wait(lck);
+	}
+	// Let any actions that were already dispatched finish
+	delete actions;
+	actions = nullptr;
+}
+
+void Daemon::runCommand(struct request req, Reply reply) {
+	std::string command = req.command, name = req.server;
+	if (command == "reload") {
+		reply(st_partial, "Reloading config file...");
+		bool ok = config->parseConfigFile();
+		updateConfig();
+		if (ok)
+			reply(st_ok, "Successfully reloaded config.");
+		else
+			reply(st_error, "Please fix your config file and try again - no servers were modified.");
+		return;
+	}
+	// Commands for a server being restored wait until it is done, in order
+	auto restoring_it = restoring.find(name);
+	if (restoring_it != restoring.end()) {
+		restoring_it->second.push_back([this, req, reply]() { runCommand(req, reply); });
+		return;
+	}
+	// Servers started or stopped by hand are no longer waiting to start
+	if (command == "start" || command == "stop" || command == "restart" || command == "restore")
+		startup->cancel(name);
+	if (command == "restart" && name.empty()) {
+		reply(st_partial, "Stopping all servers...");
+		stopAll();
+		reply(st_partial, "Stopped.");
+		bool ok = config->parseConfigFile();
+		if (!ok)
+			reply(st_partial, "Please fix your config file - starting servers from the previous config.");
+		updateConfig();
+		reply(st_partial, "Config has " + std::to_string(servers.size()) + " servers.");
+		size_t count = startup->start();
+		reply(st_partial, "Starting " + std::to_string(count) + " servers, " + std::to_string(config->getStartJobs()) + " at a time.");
+		reply(ok ? st_ok : st_error, "Restarted all servers.");
+		return;
+	}
+
+	if (name.empty()) {
+		// Attempt command on all servers at once
+		std::function<bool(Server*)> action;
+		std::string verb;
+		if (command == "start") {
+			action = &Server::start;
+			verb = "Starting";
+		}
+		else if (command == "restart") {
+			action = &Server::restart;
+			verb = "Restarting";
+		}
+		else if (command == "stop") {
+			action = &Server::stop;
+			verb = "Stopped";
+		}
+		else if (command == "backup") {
+			action = &Server::backup;
+			verb = "Backing up";
+		}
+		else if (command == "cancel") {
+			action = &Server::cancelRestart;
+			verb = "Cancelled restart of";
+		}
+		else {
+			reply(st_bad, "\"" + command + "\" requires a server name!");
+			return;
+		}
+		size_t count = forEachServer(action, [&](Server *s) { reply(st_partial, verb + " server [" + s->getName() + "]"); });
+		reply(st_ok, "Done (" + std::to_string(count) + " of " + std::to_string(servers.size()) + " servers).");
+		return;
+	}
+
+	auto block_it = servers.find(name);
+	if (block_it == servers.end()) {
+		reply(st_not_found, "No server named [" + name + "]!");
+		return;
+	}
+	Server *s = block_it->second;
+	if (command == "start") {
+		if (s->start())
+			reply(st_ok, "Starting server [" + name + "]");
+		else
+			reply(st_conflict, "Server [" + name + "] is already running!");
+	}
+	else if (command == "restart") {
+		if (s->restart())
+			reply(st_ok, "Restarting server [" + name + "]");
+		else
+			reply(st_conflict, "Server [" + name + "] is not running!");
+	}
+	else if (command == "stop") {
+		if (s->stop())
+			reply(st_ok, "Stopped server [" + name + "]");
+		else
+			reply(st_conflict, "Server [" + name + "] is not running!");
+	}
+	else if (command == "backup") {
+		if (s->backup())
+			reply(st_ok, "Backing up server [" + name + "]");
+		else if (s->getBackup().empty())
+			reply(st_error, "Server [" + name + "] has no backup directory!");
+		else
+			reply(st_conflict, "Server [" + name + "] is not running!");
+	}
+	else if (command == "cancel") {
+		if (s->cancelRestart())
+			reply(st_ok, "Cancelled restart of server [" + name + "]");
+		else
+			reply(st_conflict, "Server [" + name + "] is not counting down to a restart!");
+	}
+	else if (command == "restore") {
+		std::string dir = s->getBackup();
+		Catalog *catalog = dir.empty() ? nullptr : Catalog::get(dir);
+		std::vector<struct catalog_entry> backups = catalog == nullptr ? std::vector<struct catalog_entry>() : catalog->list(name);
+		auto backup_it = std::find_if(backups.begin(), backups.end(), [&](const struct catalog_entry &entry) { return entry.name == req.argument; });
+		if (backup_it == backups.end()) {
+			reply(st_not_found, "Server [" + name + "] has no backup named " + req.argument + "!");
+			return;
+		}
+		bool was_running = s->stop();
+		if (was_running)
+			reply(st_partial, "Stopped server [" + name + "]");
+		reply(st_partial, "Restoring server [" + name + "] from " + req.argument + "...");
+		restoring[name];
+		{
+			std::lock_guard<std::mutex> lck(restores_mtx);
+			++restores;
+		}
+		std::string backup = req.argument;
+		bool started = s->restore(*backup_it, [this, name, backup, was_running, reply](bool ok) {
+			actions->submit([this, name, backup, was_running, reply, ok]() { restored(name, backup, was_running, ok, reply); });
+			std::lock_guard<std::mutex> lck(restores_mtx);
+			if (--restores == 0)
+				restores_cv.notify_all();
+		});
+		if (!started) {
+			{
+				std::lock_guard<std::mutex> lck(restores_mtx);
+				--restores;
+			}
+			restored(name, backup, was_running, false, reply);
+		}
+	}
+	else if (command == "user") {
+		s->send(req.argument + '\n');
+		size_t pending = s->pendingInput();
+		if (pending)
+			reply(st_ok, "Queued custom command for [" + name + "] (" + std::to_string(pending) + " bytes waiting to be read)");
+		else
+			reply(st_ok, "Sent custom command to [" + name + "]");
+	}
+}
+
+void Daemon::sendBackups(unsigned long client, struct request req) {
+	auto block_it = servers.find(req.server);
+	if (block_it == servers.end()) {
+		replyTo(client, req.id)(st_not_found, "No server named [" + req.server + "]!");
+		return;
+	}
+	std::string dir = block_it->second->getBackup();
+	if (dir.empty()) {
+		replyTo(client, req.id)(st_error, "Server [" + req.server + "] has no backup directory!");
+		return;
+	}
+	// The first look at a directory reads all of it, so not on the actions thread
+	fanout->submit([this, client, req, dir]() {
+		unsigned long id = req.id;
+		Catalog *catalog = Catalog::get(dir);
+		if (catalog == nullptr) {
+			replyTo(client, id)(st_error, "Could not read the catalog in " + dir + "!");
+			return;
+		}
+		// Straight from the catalog, like logs this skips the daemon's own log
+		std::vector<struct catalog_entry> backups = catalog->list(req.server);
+		unsigned long long total = 0;
+		std::string lines;
+		for (const struct catalog_entry &entry : backups) {
+			char when[32];
+			struct tm local;
+			strftime(when, sizeof (when), "%Y-%m-%d %H:%M:%S", localtime_r(&entry.time, &local));
+			std::string line = std::string(when) + "  " + entry.name + "  " + entry.format + "  " + std::to_string(entry.size) + " bytes  " +
+					std::to_string(entry.duration) + " ms  " + entry.checksum;
+			if (entry.parent != "-")
+				line += "  after " + entry.parent;
+			lines += line + '\n';
+			total += entry.size;
+		}
+		std::string summary = std::to_string(backups.size()) + " backups of [" + req.server + "], " + std::to_string(total) + " bytes.";
+		loop.post([this, client, id, lines, summary]() {
+			if (!lines.empty())
+				sendOutput(client, id, lines.substr(0, lines.size() - 1), nullptr);
+			sendReply(client, { id, st_ok, summary });
+		});
+	});
+}
+
+void Daemon::sendLogs(unsigned long client, struct request req) {
+	auto block_it = servers.find(req.server);
+	if (block_it == servers.end()) {
+		replyTo(client, req.id)(st_not_found, "No server named [" + req.server + "]!");
+		return;
+	}
+	// Output is sent straight from the supervisor thread to the event loop,
+	// without going through replyTo (and the daemon's own log)
+	bool follow = req.argument == "-f";
+	unsigned long id = req.id;
+	std::shared_ptr<std::atomic<bool>> following;
+	if (follow) {
+		following = std::make_shared<std::atomic<bool>>(true);
+		loop.post([this, client, following]() {
+			if (clients.find(client) == clients.end())
+				*following = false;
+			else
+				followers.emplace(client, following);
+		});
+	}
+	block_it->second->tail([this, client, id, following](std::string_view output) {
+		if (output.empty()) {
+			if (*following)
+				loop.post([this, client, id]() { sendReply(client, { id, st_ok, "Server was removed from the config." }); });
+			return false;
+		}
+		loop.post([this, client, id, text = std::string(output), following]() { sendOutput(client, id, text, following); });
+		return following && *following;
+	}, follow);
+	if (!follow)
+		loop.post([this, client, id]() { sendReply(client, { id, st_ok, "" }); });
+}
+
+void Daemon::sendOutput(unsigned long client, unsigned long id, std::string output, std::shared_ptr<std::atomic<bool>> following) {
+	// Stopped following, drop whatever was still on its way
+	if (following && !*following)
+		return;
+	auto client_it = clients.find(client);
+	if (client_it == clients.end())
+		return;
+	Socket *s = client_it->second;
+	if (following && s->pending() > FOLLOW_BACKLOG) {
+		*following = false;
+		sendReply(client, { id, st_error, "Fell too far behind, no longer following." });
+		return;
+	}
+	// One partial reply per line, queued together
+	std::string prefix = std::to_string(id) + '\t' + std::to_string(st_partial) + '\t', lines;
+	std::string_view rest(output);
+	while (!rest.empty()) {
+		std::string_view::size_type newline = rest.find('\n');
+		if (!lines.empty())
+			lines += '\n';
+		lines += prefix;
+		lines += rest.substr(0, newline);
+		rest.remove_prefix(newline == std::string_view::npos ? rest.size() : newline + 1);
+	}
+	s->sendLine(lines);
+	if (s->pending())
+		loop.modify(s->fd(), EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+}
+
+void Daemon::sendReply(unsigned long client, struct reply rep) {
+	auto client_it = clients.find(client);
+	if (client_it == clients.end())
+		return;
+	Socket *s = client_it->second;
+	s->sendLine(formatReply(rep));
+	if (s->pending())
+		loop.modify(s->fd(), EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+}
+
+void Daemon::sendStatus(unsigned long client, struct request req) {
+	if (!req.server.empty() && servers.find(req.server) == servers.end()) {
+		replyTo(client, req.id)(st_not_found, "No server named [" + req.server + "]!");
+		return;
+	}
+	// Asked for often, so like backups this skips the daemon's own log
+	std::string lines;
+	size_t count = 0;
+	for (auto block : servers) {
+		if (!req.server.empty() && block.first != req.server)
+			continue;
+		std::string line = "[" + block.first + "] " + stateName(block.second->getState());
+		long ready_time = block.second->getReadyTime();
+		if (ready_time >= 0)
+			line += " (ready " + std::to_string(ready_time) + " ms after launch)";
+		lines += line + '\n';
+		++count;
+	}
+	unsigned long id = req.id;
+	std::string summary = req.server.empty() ? std::to_string(count) + " servers." : "";
+	loop.post([this, client, id, lines, summary]() {
+		if (!lines.empty())
+			sendOutput(client, id, lines.substr(0, lines.size() - 1), nullptr);
+		sendReply(client, { id, st_ok, summary });
+	});
+}
+
+void Daemon::stopAll() {
+	forEachServer(&Server::stop, [](Server *s) { std::cout << "Stopped [" << s->getName() << "]" << std::endl; });
+}
+
+void Daemon::updateConfig() {
+	servers = config->getServers();
+	scheduler->update(servers, config->getBackupJobs(), config->getBackupStagger());
+	startup->update(servers, config->getStartJobs());
+	if (config->getJobs() != jobs) {
+		delete fanout;
+		jobs = config->getJobs();
+		fanout = new ThreadPool(jobs);
+	}
+}
+
+Daemon::Daemon(Config *config, Socket *sock) {
+	this->config = config;
+	this->sock = sock;
+	servers = config->getServers();
+
+	// Actions run one at a time, in the order they were received
+	actions = new ThreadPool(1);
+	jobs = config->getJobs();
+	fanout = new ThreadPool(jobs);
+	scheduler = new Scheduler(&loop, actions);
+	scheduler->update(servers, config->getBackupJobs(), config->getBackupStagger());
+	startup = new Startup(&loop, actions);
+	startup->update(servers, config->getStartJobs());
+	actions->submit([this]() { startup->start(); });
+	watcher = new Watcher(&loop, [this]() { configChanged(); });
+	watcher->open(config->getPath());
+}
+
+Daemon::~Daemon() {
+	while (!clients.empty())
+		closeClient(clients.begin()->first);
+	delete watcher;
+	delete startup;
+	delete scheduler;
+	if (actions != nullptr)
+		delete actions;
+	delete fanout;
+}
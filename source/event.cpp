@@ -0,0 +1,148 @@
+#include <errno.h>
+#include <iostream>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "event.hpp"
+
+#define MAX_EVENTS 64
+
+bool EventLoop::add(int fd, uint32_t events, std::function<void(uint32_t)> handler) {
+	uint64_t id = next_id++;
+	struct epoll_event ev = {};
+	ev.events = events;
+	ev.data.u64 = id;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		std::cerr << "epoll_ctl error (" << errno << ")" << std::endl;
+		return false;
+	}
+	handlers[id] = handler;
+	ids[fd] = id;
+	return true;
+}
+
+unsigned long EventLoop::after(unsigned long ms, std::function<void()> func) {
+	unsigned long id = next_timer++;
+	time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+	timers[id] = { deadline, func };
+	deadlines.insert({ deadline, id });
+	return id;
+}
+
+void EventLoop::cancel(unsigned long id) {
+	auto timer_it = timers.find(id);
+	if (timer_it == timers.end())
+		return;
+	auto range = deadlines.equal_range(timer_it->second.first);
+	for (auto deadline_it = range.first; deadline_it != range.second; ++deadline_it) {
+		if (deadline_it->second == id) {
+			deadlines.erase(deadline_it);
+			break;
+		}
+	}
+	timers.erase(timer_it);
+}
+
+bool EventLoop::modify(int fd, uint32_t events) {
+	auto id_it = ids.find(fd);
+	if (id_it == ids.end())
+		return false;
+	struct epoll_event ev = {};
+	ev.events = events;
+	ev.data.u64 = id_it->second;
+	return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) != -1;
+}
+
+void EventLoop::post(std::function<void()> func) {
+	post_mtx.lock();
+	posted.push(func);
+	post_mtx.unlock();
+	uint64_t one = 1;
+	write(wakefd, &one, sizeof (one));
+}
+
+void EventLoop::remove(int fd) {
+	auto id_it = ids.find(fd);
+	if (id_it == ids.end())
+		return;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	handlers.erase(id_it->second);
+	ids.erase(id_it);
+}
+
+void EventLoop::run() {
+	struct epoll_event events[MAX_EVENTS];
+	while (!stopped) {
+		int count = epoll_wait(epfd, events, MAX_EVENTS, timeout());
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+			std::cerr << "epoll_wait error (" << errno << ")" << std::endl;
+			return;
+		}
+		for (int i = 0; i < count; ++i) {
+			if (events[i].data.u64 == 0) {
+				runPosted();
+				continue;
+			}
+			// The handler may remove itself (or others), so look it up every time
+			auto handler_it = handlers.find(events[i].data.u64);
+			if (handler_it == handlers.end())
+				continue;
+			std::function<void(uint32_t)> handler = handler_it->second;
+			handler(events[i].events);
+		}
+		runTimers();
+	}
+}
+
+void EventLoop::runPosted() {
+	uint64_t count;
+	read(wakefd, &count, sizeof (count));
+
+	std::queue<std::function<void()>> ready;
+	post_mtx.lock();
+	ready.swap(posted);
+	post_mtx.unlock();
+	while (!ready.empty()) {
+		ready.front()();
+		ready.pop();
+	}
+}
+
+void EventLoop::runTimers() {
+	time_point now = std::chrono::steady_clock::now();
+	while (!deadlines.empty() && deadlines.begin()->first <= now) {
+		unsigned long id = deadlines.begin()->second;
+		deadlines.erase(deadlines.begin());
+		std::function<void()> func = timers[id].second;
+		timers.erase(id);
+		func();
+	}
+}
+
+void EventLoop::stop() {
+	post([this]() { stopped = true; });
+}
+
+int EventLoop::timeout() {
+	if (deadlines.empty())
+		return -1;
+	auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadlines.begin()->first - std::chrono::steady_clock::now());
+	return remaining.count() < 0 ? 0 : remaining.count();
+}
+
+EventLoop::EventLoop() {
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+}
+
+EventLoop::~EventLoop() {
+	close(wakefd);
+	close(epfd);
+}
@@ -0,0 +1,438 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+#include <zlib.h>
+#include "extract.hpp"
+#include "pool.hpp"
+
+#define EXTRACT_BLOCK  (1024 * 1024)
+#define EXTRACT_MEMORY (64 * 1024 * 1024)
+// Inflated blocks waiting to be read, at most
+#define EXTRACT_QUEUE  16
+// Most of a file written by one job
+#define EXTRACT_WRITE  (4 * 1024 * 1024)
+// Longest name (or pax header) taken from an archive
+#define EXTRACT_NAME   (1024 * 1024)
+
+// A file being written, closed once its last write is done
+struct extract_file {
+	int fd;
+	std::string path;
+	struct stat st;
+};
+
+static void keepAttributes(int fd, const struct stat &st) {
+	// Changing the owner clears set-id bits, so the mode goes after it
+	if (fchown(fd, st.st_uid, st.st_gid) == -1 && errno != EPERM)
+		std::cerr << "Could not change owner of restored file (" << errno << ")" << std::endl;
+	fchmod(fd, st.st_mode & 07777);
+	struct timespec times[2] = { { 0, UTIME_OMIT }, st.st_mtim };
+	futimens(fd, times);
+}
+
+// Reads a tar header number: octal, or base-256 if the high bit is set
+static unsigned long long number(const unsigned char *field, size_t size) {
+	unsigned long long value = 0;
+	if (field[0] & 0x80) {
+		value = field[0] & 0x7f;
+		for (size_t i = 1; i < size; ++i)
+			value = (value << 8) | field[i];
+		return value;
+	}
+	for (size_t i = 0; i < size && field[i]; ++i)
+		if (field[i] >= '0' && field[i] <= '7')
+			value = (value << 3) | (field[i] - '0');
+	return value;
+}
+
+// Takes the path and link target out of a pax extended header, a series of
+// "<length> <key>=<value>\n" records
+static void parsePax(std::string text, std::string &path, std::string &link) {
+	std::string::size_type start = 0;
+	while (start < text.size()) {
+		std::string::size_type space = text.find(' ', start);
+		unsigned long length = strtoul(text.c_str() + start, NULL, 10);
+		if (space == std::string::npos || space + 1 >= start + length || start + length > text.size())
+			return;
+		std::string record = text.substr(space + 1, start + length - space - 2);
+		start += length;
+		std::string::size_type equals = record.find('=');
+		if (equals == std::string::npos)
+			continue;
+		if (record.compare(0, equals, "path") == 0)
+			path = record.substr(equals + 1);
+		else if (record.compare(0, equals, "linkpath") == 0)
+			link = record.substr(equals + 1);
+	}
+}
+
+// Turns an entry's name into a path relative to the directory extracted to,
+// refusing anything that would end up outside it
+static bool relativePath(std::string name, std::string &relative) {
+	relative.clear();
+	if (!name.empty() && name[0] == '/')
+		return false;
+	std::string::size_type start = 0;
+	while (start < name.size()) {
+		std::string::size_type slash = name.find('/', start);
+		if (slash == std::string::npos)
+			slash = name.size();
+		std::string part = name.substr(start, slash - start);
+		start = slash + 1;
+		if (part.empty() || part == ".")
+			continue;
+		if (part == "..")
+			return false;
+		relative += (relative.empty() ? "" : "/") + part;
+	}
+	return true;
+}
+
+static std::string parentOf(std::string relative) {
+	std::string::size_type slash = relative.rfind('/');
+	return slash == std::string::npos ? "" : relative.substr(0, slash);
+}
+
+bool Extractor::decompress(int fd) {
+	z_stream strm = {};
+	if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+		return false;
+	std::vector<unsigned char> input(EXTRACT_BLOCK);
+	// A gzip file may be several members one after the other (Archive
+	// writes one for each world), each with its own checksum
+	bool ok = true, ended = false, full = false;
+	while (ok) {
+		if (strm.avail_in == 0 && !full) {
+			ssize_t bytes = ::read(fd, input.data(), input.size());
+			if (bytes == -1) {
+				if (errno == EINTR)
+					continue;
+				ok = false;
+				break;
+			}
+			// Cut short, unless the last member was complete
+			if (bytes == 0) {
+				ok = ended;
+				break;
+			}
+			strm.next_in = input.data();
+			strm.avail_in = bytes;
+		}
+		if (ended) {
+			inflateReset(&strm);
+			ended = false;
+		}
+		std::vector<unsigned char> output(EXTRACT_BLOCK);
+		strm.next_out = output.data();
+		strm.avail_out = output.size();
+		int ret = inflate(&strm, Z_NO_FLUSH);
+		// Nothing was left over from filling the last block, after all
+		if (ret == Z_BUF_ERROR && full) {
+			full = false;
+			continue;
+		}
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			ok = false;
+			break;
+		}
+		ended = ret == Z_STREAM_END;
+		full = strm.avail_out == 0 && !ended;
+		output.resize(output.size() - strm.avail_out);
+		if (output.empty())
+			continue;
+		std::unique_lock<std::mutex> lck(mtx);
+		while (inflated.size() >= EXTRACT_QUEUE && !failed)
+			cv.wait(lck);
+		if (failed)
+			break;
+		inflated.push_back(std::move(output));
+		cv.notify_all();
+	}
+	inflateEnd(&strm);
+	return ok;
+}
+
+bool Extractor::extract(std::string file, std::string dest) {
+	int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		std::cerr << "Could not open " << file << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	if (mkdir(dest.c_str(), 0700) == -1) {
+		std::cerr << "Could not create " << dest << " (" << errno << ")" << std::endl;
+		close(fd);
+		return false;
+	}
+	this->dest = dest;
+	made = { "" };
+	directories.clear();
+	links.clear();
+	inflated.clear();
+	block.clear();
+	position = pending = 0;
+	failed = false;
+	inflating = true;
+	workers = new ThreadPool(threads);
+	bool decompressed = false;
+	std::thread inflater([this, fd, &decompressed]() {
+		decompressed = decompress(fd);
+		std::lock_guard<std::mutex> lck(mtx);
+		inflating = false;
+		cv.notify_all();
+	});
+
+	bool ok = readEntries();
+	if (ok) {
+		// What follows the end is padding, but the last checksum comes after it
+		std::unique_lock<std::mutex> lck(mtx);
+		while (inflating && !failed) {
+			inflated.clear();
+			cv.notify_all();
+			cv.wait(lck);
+		}
+		inflated.clear();
+	}
+	else
+		fail();
+	inflater.join();
+	close(fd);
+	// Waits for the files still being written
+	delete workers;
+	workers = nullptr;
+	if (!decompressed)
+		std::cerr << "Could not extract " << file << ", it is damaged or cut short" << std::endl;
+	ok = ok && decompressed && !failed;
+
+	// Only now, so nothing was written through them
+	for (const struct extract_link &link : links) {
+		if (!ok)
+			break;
+		std::string path = dest + '/' + link.path;
+		if (link.type == '1') {
+			if (::link((dest + '/' + link.target).c_str(), path.c_str()) == -1) {
+				std::cerr << "Could not link " << path << " (" << errno << ")" << std::endl;
+				ok = false;
+			}
+			continue;
+		}
+		if (symlink(link.target.c_str(), path.c_str()) == -1) {
+			std::cerr << "Could not create " << path << " (" << errno << ")" << std::endl;
+			ok = false;
+			continue;
+		}
+		lchown(path.c_str(), link.st.st_uid, link.st.st_gid);
+		struct timespec times[2] = { { 0, UTIME_OMIT }, link.st.st_mtim };
+		utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+	}
+	// And last, as filling them in changed their modification times
+	for (auto dir_it = directories.rbegin(); ok && dir_it != directories.rend(); ++dir_it) {
+		int dir_fd = open((dir_it->first.empty() ? dest : dest + '/' + dir_it->first).c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (dir_fd != -1) {
+			keepAttributes(dir_fd, dir_it->second);
+			close(dir_fd);
+		}
+	}
+	block.clear();
+	made.clear();
+	directories.clear();
+	links.clear();
+	return ok;
+}
+
+void Extractor::fail() {
+	std::lock_guard<std::mutex> lck(mtx);
+	failed = true;
+	cv.notify_all();
+}
+
+void Extractor::finishFile(struct extract_file *file) {
+	keepAttributes(file->fd, file->st);
+	if (close(file->fd) == -1) {
+		std::cerr << "Could not write " << file->path << " (" << errno << ")" << std::endl;
+		fail();
+	}
+	delete file;
+}
+
+bool Extractor::makeDirectory(std::string relative) {
+	if (made.count(relative))
+		return true;
+	if (!makeDirectory(parentOf(relative)))
+		return false;
+	std::string path = dest + '/' + relative;
+	if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+		std::cerr << "Could not create " << path << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	made.insert(relative);
+	return true;
+}
+
+bool Extractor::read(unsigned char *data, size_t size) {
+	while (size) {
+		if (position == block.size()) {
+			std::unique_lock<std::mutex> lck(mtx);
+			while (inflated.empty() && inflating && !failed)
+				cv.wait(lck);
+			if (failed || inflated.empty())
+				return false;
+			block = std::move(inflated.front());
+			inflated.pop_front();
+			position = 0;
+			cv.notify_all();
+			continue;
+		}
+		size_t bytes = std::min(size, block.size() - position);
+		// No data to copy to when skipping
+		if (data != nullptr) {
+			memcpy(data, block.data() + position, bytes);
+			data += bytes;
+		}
+		position += bytes;
+		size -= bytes;
+	}
+	return true;
+}
+
+bool Extractor::readEntries() {
+	std::string long_name, long_link, pax_name, pax_link;
+	for (;;) {
+		unsigned char header[512];
+		if (!read(header, sizeof (header)))
+			return false;
+		// End of archive: an empty record
+		if (std::all_of(header, header + sizeof (header), [](unsigned char c) { return c == 0; }))
+			return true;
+		unsigned int sum = 0;
+		for (size_t i = 0; i < sizeof (header); ++i)
+			sum += i >= 148 && i < 156 ? ' ' : header[i];
+		if (sum != number(header + 148, 8)) {
+			std::cerr << "Archive has a damaged entry in it" << std::endl;
+			return false;
+		}
+		char type = header[156];
+		unsigned long long size = number(header + 124, 12), padding = (512 - size % 512) % 512;
+
+		// Long names and pax headers are for the entry after them
+		if (type == 'L' || type == 'K' || type == 'x') {
+			if (size > EXTRACT_NAME) {
+				std::cerr << "Archive has a name too long in it" << std::endl;
+				return false;
+			}
+			std::vector<unsigned char> data(size);
+			if (!read(data.data(), size) || !read(nullptr, padding))
+				return false;
+			std::string text(data.begin(), data.end());
+			if (type == 'x')
+				parsePax(text, pax_name, pax_link);
+			else
+				(type == 'L' ? long_name : long_link) = text.substr(0, text.find('\0'));
+			continue;
+		}
+		std::string name((const char*)header, strnlen((const char*)header, 100));
+		std::string link((const char*)header + 157, strnlen((const char*)header + 157, 100));
+		// POSIX ustar keeps the start of long names in a prefix
+		if (memcmp(header + 257, "ustar", 6) == 0 && header[345])
+			name = std::string((const char*)header + 345, strnlen((const char*)header + 345, 155)) + '/' + name;
+		name = !pax_name.empty() ? pax_name : !long_name.empty() ? long_name : name;
+		link = !pax_link.empty() ? pax_link : !long_link.empty() ? long_link : link;
+		long_name.clear();
+		long_link.clear();
+		pax_name.clear();
+		pax_link.clear();
+
+		std::string relative;
+		if (!relativePath(name, relative)) {
+			std::cerr << "Archive has " << name << " in it, outside of where it is extracted" << std::endl;
+			return false;
+		}
+		struct stat st = {};
+		st.st_mode = number(header + 100, 8);
+		st.st_uid = number(header + 108, 8);
+		st.st_gid = number(header + 116, 8);
+		st.st_mtim.tv_sec = number(header + 136, 12);
+		bool is_file = type == '0' || type == '\0' || type == '7';
+		if (relative.empty() && type != '5') {
+			std::cerr << "Archive has " << name << " in it, which is not a directory" << std::endl;
+			return false;
+		}
+		if (type == '5') {
+			if (!makeDirectory(relative))
+				return false;
+			directories.push_back({ relative, st });
+		}
+		else if (is_file) {
+			if (!makeDirectory(parentOf(relative)) || !writeFile(relative, st, size))
+				return false;
+		}
+		else if (type == '1' || type == '2') {
+			struct extract_link entry = { type, relative, link, st };
+			if (type == '1' && !relativePath(link, entry.target)) {
+				std::cerr << "Archive links " << name << " to " << link << ", outside of where it is extracted" << std::endl;
+				return false;
+			}
+			if (!makeDirectory(parentOf(relative)))
+				return false;
+			links.push_back(entry);
+		}
+		// Devices, pipes and the like are skipped, as backups leave them out
+		if (!read(nullptr, (is_file ? 0 : size) + padding))
+			return false;
+	}
+}
+
+bool Extractor::writeFile(std::string relative, const struct stat &st, unsigned long long size) {
+	std::string path = dest + '/' + relative;
+	// An archive may have a file more than once, the last one counts
+	int fd;
+	while ((fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)) == -1 && errno == EEXIST && unlink(path.c_str()) == 0);
+	if (fd == -1) {
+		std::cerr << "Could not create " << path << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	std::shared_ptr<struct extract_file> file(new extract_file { fd, path, st }, [this](struct extract_file *file) { finishFile(file); });
+	for (unsigned long long offset = 0; offset < size;) {
+		size_t bytes = std::min(size - offset, (unsigned long long)EXTRACT_WRITE);
+		auto data = std::make_shared<std::vector<unsigned char>>(bytes);
+		if (!read(data->data(), bytes))
+			return false;
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			while (pending && pending + bytes > memory && !failed)
+				cv.wait(lck);
+			if (failed)
+				return false;
+			pending += bytes;
+		}
+		workers->submit([this, file, data, offset]() {
+			bool ok = true;
+			for (size_t done = 0; ok && done < data->size();) {
+				ssize_t written = pwrite(file->fd, data->data() + done, data->size() - done, offset + done);
+				if (written == -1 && errno != EINTR)
+					ok = false;
+				else if (written > 0)
+					done += written;
+			}
+			if (!ok)
+				std::cerr << "Could not write " << file->path << " (" << errno << ")" << std::endl;
+			std::lock_guard<std::mutex> lck(mtx);
+			if (!ok)
+				failed = true;
+			pending -= data->size();
+			cv.notify_all();
+		});
+		offset += bytes;
+	}
+	return true;
+}
+
+Extractor::Extractor(size_t threads, size_t memory) {
+	this->threads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+	this->memory = memory ? memory : EXTRACT_MEMORY;
+}
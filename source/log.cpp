@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <limits.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "compress.hpp"
+#include "log.hpp"
+#include "supervisor.hpp"
+
+#define LOG_BUF_SIZE   65536
+#define LOG_READ_SIZE  16384
+#define LOG_LINE_LIMIT (1024 * 1024)
+// Lines per writev (each line takes 3 iovecs: timestamp, line, line break)
+#define LOG_BATCH      (IOV_MAX / 3)
+// Recent output kept in memory for tail
+#define LOG_RING_SIZE  (64 * 1024)
+
+void Log::close() {
+	if (pipefd[0] == -1)
+		return;
+	// The pipe is read on the supervisor thread, so it is taken down there
+	Supervisor::get()->call([&]() {
+		// Once our write end is gone, anything left in the pipe can be drained
+		::close(pipefd[1]);
+		pipefd[1] = -1;
+		readOutput(true);
+		Supervisor::get()->events()->remove(pipefd[0]);
+		::close(pipefd[0]);
+		pipefd[0] = -1;
+		if (fd != -1)
+			::close(fd);
+		fd = -1;
+	});
+}
+
+int Log::input() {
+	return pipefd[1];
+}
+
+void Log::keep(const struct iovec *iov, size_t count) {
+	std::string batch;
+	for (size_t i = 0; i < count; ++i) {
+		const char *data = (const char*)iov[i].iov_base;
+		size_t length = iov[i].iov_len;
+		if (!followers.empty())
+			batch.append(data, length);
+		if (length > LOG_RING_SIZE) {
+			data += length - LOG_RING_SIZE;
+			length = LOG_RING_SIZE;
+		}
+		size_t first = std::min(length, LOG_RING_SIZE - ring_end);
+		memcpy(ring.data() + ring_end, data, first);
+		memcpy(ring.data(), data + first, length - first);
+		if (ring_end + length >= LOG_RING_SIZE)
+			ring_full = true;
+		ring_end = (ring_end + length) % LOG_RING_SIZE;
+	}
+
+	for (auto it = followers.begin(); it != followers.end();) {
+		if ((*it)(batch))
+			++it;
+		else
+			it = followers.erase(it);
+	}
+}
+
+bool Log::open() {
+	if (pipe2(pipefd, O_CLOEXEC) == -1) {
+		std::cerr << "pipe error (" << errno << ")" << std::endl;
+		return false;
+	}
+	// Children get the write end, which must stay blocking
+	fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+	if (!openFile() || !Supervisor::get()->events()->add(pipefd[0], EPOLLIN, [this](uint32_t) { readOutput(false); })) {
+		::close(pipefd[0]);
+		::close(pipefd[1]);
+		pipefd[0] = pipefd[1] = -1;
+		if (fd != -1)
+			::close(fd);
+		fd = -1;
+		return false;
+	}
+	return true;
+}
+
+// Leaves fd as it was if the file can't be opened
+bool Log::openFile() {
+	int opened_fd = ::open(file.c_str(), O_CREAT | O_APPEND | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (opened_fd == -1) {
+		std::cerr << "Could not open log file " << file << " for writing! (" << errno << ")" << std::endl;
+		return false;
+	}
+	fd = opened_fd;
+	// The file used to be created by the server's user, keep it that way
+	if (fchown(fd, user, group) == -1 && errno != EPERM)
+		std::cerr << "Could not change owner of " << file << " (" << errno << ")" << std::endl;
+	struct stat st;
+	size = fstat(fd, &st) == -1 ? 0 : st.st_size;
+	opened = time(NULL);
+	return true;
+}
+
+void Log::readOutput(bool closing) {
+	while (true) {
+		size_t available;
+		char *space = buffer.reserve(LOG_READ_SIZE, available);
+		if (space == NULL) {
+			// A single line filled the buffer, break it here
+			writeLines(true);
+			continue;
+		}
+		ssize_t bytes = read(pipefd[0], space, available);
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes <= 0) {
+			// Nothing more to read for now, unless everything is being closed
+			if (closing || bytes == 0)
+				writeLines(true);
+			return;
+		}
+		buffer.commit(bytes);
+		writeLines(false);
+	}
+}
+
+void Log::rotate() {
+	char suffix[32];
+	time_t now = time(NULL);
+	struct tm local;
+	strftime(suffix, sizeof (suffix), ".%Y%m%d-%H%M%S", localtime_r(&now, &local));
+	std::string rotated = file + suffix;
+	for (int n = 1; access(rotated.c_str(), F_OK) == 0; ++n)
+		rotated = file + suffix + '-' + std::to_string(n);
+
+	if (rename(file.c_str(), rotated.c_str()) == -1) {
+		std::cerr << "Could not rotate log file " << file << " (" << errno << ")" << std::endl;
+		// Try again once the limits are reached again
+		size = 0;
+		opened = now;
+		return;
+	}
+	// Output keeps going to the old file until the new one is open
+	int old = fd;
+	if (!openFile()) {
+		if (rename(rotated.c_str(), file.c_str()) == -1)
+			std::cerr << "Could not rename " << rotated << " back to " << file << " (" << errno << ")" << std::endl;
+		std::cerr << "Still writing to the old log file, will try rotating it again" << std::endl;
+		size = 0;
+		opened = now;
+		return;
+	}
+	::close(old);
+	if (compress)
+		Compressor::get()->compress(rotated, compress);
+}
+
+void Log::setCompress(int compress) {
+	this->compress = compress;
+}
+
+void Log::setFile(std::string file, uid_t user, gid_t group) {
+	this->file = file;
+	this->user = user;
+	this->group = group;
+}
+
+void Log::setMaxAge(time_t max_age) {
+	this->max_age = max_age;
+}
+
+void Log::setMaxSize(size_t max_size) {
+	this->max_size = max_size;
+}
+
+void Log::tail(std::function<bool(std::string_view)> follower, bool follow) {
+	std::string recent;
+	if (ring_full) {
+		recent.assign(ring.begin() + ring_end, ring.end());
+		recent.append(ring.begin(), ring.begin() + ring_end);
+		// The oldest line has been partly overwritten
+		std::string::size_type newline = recent.find('\n');
+		recent.erase(0, newline == std::string::npos ? newline : newline + 1);
+	}
+	else
+		recent.assign(ring.begin(), ring.begin() + ring_end);
+	if (!recent.empty() && !follower(recent))
+		return;
+	if (follow)
+		followers.push_back(follower);
+}
+
+void Log::watch(std::function<bool(std::string_view)> watcher) {
+	this->watcher = watcher;
+}
+
+void Log::writeLines(bool all) {
+	time_t now = time(NULL);
+	if (now != stamped) {
+		struct tm local;
+		stamp_length = strftime(stamp, sizeof (stamp), "[%Y-%m-%d %H:%M:%S] ", localtime_r(&now, &local));
+		stamped = now;
+	}
+
+	struct iovec iov[LOG_BATCH * 3];
+	size_t count = 0;
+	while (true) {
+		bool more = buffer.hasLine() || (all && buffer.size());
+		if (count && (!more || count == LOG_BATCH * 3)) {
+			keep(iov, count);
+			// Write the batch, picking up after short writes
+			struct iovec *next = iov;
+			while (fd != -1 && count) {
+				ssize_t bytes = writev(fd, next, count);
+				if (bytes == -1) {
+					if (errno == EINTR)
+						continue;
+					std::cerr << "Could not write to log file " << file << " (" << errno << ")" << std::endl;
+					break;
+				}
+				size += bytes;
+				while (count && (size_t)bytes >= next->iov_len) {
+					bytes -= next->iov_len;
+					++next;
+					--count;
+				}
+				if (count) {
+					next->iov_base = (char*)next->iov_base + bytes;
+					next->iov_len -= bytes;
+				}
+			}
+			count = 0;
+			if ((max_size && size >= max_size) || (max_age && now - opened >= max_age))
+				rotate();
+		}
+		if (!more)
+			break;
+		std::string_view line = buffer.hasLine() ? buffer.nextLine() : buffer.take();
+		if (watcher && !watcher(line))
+			watcher = nullptr;
+		iov[count++] = { stamp, stamp_length };
+		iov[count++] = { (void*)line.data(), line.size() };
+		iov[count++] = { (void*)"\n", 1 };
+	}
+}
+
+Log::Log() : buffer(LOG_BUF_SIZE, LOG_LINE_LIMIT), ring(LOG_RING_SIZE) {
+}
+
+Log::~Log() {
+	close();
+	if (followers.empty())
+		return;
+	// Followers are otherwise only ever called from the supervisor thread
+	Supervisor::get()->call([&]() {
+		for (auto &follower : followers)
+			follower(std::string_view());
+	});
+}
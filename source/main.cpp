@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <fstream>
 #include <iostream>
+#include <set>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
@@ -10,6 +11,8 @@
 #include <unistd.h>
 #include <vector>
 #include "config.hpp"
+#include "daemon.hpp"
+#include "protocol.hpp"
 #include "server.hpp"
 #include "usock.hpp"
 
@@ -23,6 +26,11 @@ enum _cmd_t {
 	stop,
 	backup,
 	user,
+	logs,
+	backups,
+	restore,
+	status,
+	cancel,
 };
 typedef enum _cmd_t Command_t;
 
@@ -74,6 +82,19 @@ int main(int argc, char *argv[]) {
 				cmd.type = backup;
 			else if (argument == "--command")
 				cmd.type = user;
+			else if (argument == "--backups")
+				cmd.type = backups;
+			else if (argument == "--restore")
+				cmd.type = restore;
+			else if (argument == "--status")
+				cmd.type = status;
+			else if (argument == "--cancel")
+				cmd.type = cancel;
+			else if (argument == "--logs") {
+				cmd.type = logs;
+				if (argv[arg + 1] != NULL && std::string(argv[arg + 1]) == "-f")
+					cmd.additional = argv[++arg];
+			}
 			else {
 				std::cerr << "Unexpected argument \"" << argv[arg] << "\"!" << std::endl;
 				return 1;
@@ -87,6 +108,26 @@ int main(int argc, char *argv[]) {
 				}
 				cmd.additional = argv[++arg];
 			}
+			if (cmd.type == restore) {
+				if (cmd.server_name.empty() || argv[arg + 1] == NULL) {
+					std::cerr << "--restore requires a server name and a backup (see --backups)!" << std::endl;
+					return 1;
+				}
+				cmd.additional = argv[++arg];
+			}
+			if (cmd.type == logs && cmd.server_name.empty()) {
+				std::cerr << "--logs requires a server name!" << std::endl;
+				return 1;
+			}
+			if (cmd.type == backups && cmd.server_name.empty()) {
+				std::cerr << "--backups requires a server name!" << std::endl;
+				return 1;
+			}
+			// Each request is a single line with tab separated fields
+			if (cmd.server_name.find_first_of("\t\n") != std::string::npos || cmd.additional.find('\n') != std::string::npos) {
+				std::cerr << "Server names can't contain tabs or line breaks, and arguments can't contain line breaks!" << std::endl;
+				return 1;
+			}
 			commands.push_back(cmd);
 		}
 	}
@@ -125,8 +166,10 @@ int main(int argc, char *argv[]) {
 		}
 		bool done = false;
 		int error = 0;
-		// Send command to daemon
+		// Send commands to daemon, all at once
+		std::set<unsigned long> outstanding;
 		for (Command c : commands) {
+			struct request req = { outstanding.size() + 1, "", c.server_name, "" };
 			switch (c.type) {
 				case daemonize:
 					std::cerr << "--daemon did not follow correct path!\n" << std::endl;
@@ -134,7 +177,7 @@ int main(int argc, char *argv[]) {
 					error = 1;
 					break;
 				case quit:
-					sock->sendLine("quit");
+					req.command = "quit";
 					break;
 				case test:
 					std::cerr << "--test did not exit after testing!\n" << std::endl;
@@ -142,25 +185,72 @@ int main(int argc, char *argv[]) {
 					error = 1;
 					break;
 				case reload:
-					sock->sendLine("reload");
+					req.command = "reload";
 					break;
 				case start:
-					sock->sendLine("start" + (c.server_name.empty() ? "" : " " + c.server_name));
+					req.command = "start";
 					break;
 				case restart:
-					sock->sendLine("restart" + (c.server_name.empty() ? "" : " " + c.server_name));
+					req.command = "restart";
 					break;
 				case stop:
-					sock->sendLine("stop" + (c.server_name.empty() ? "" : " " + c.server_name));
+					req.command = "stop";
 					break;
 				case backup:
-					sock->sendLine("backup" + (c.server_name.empty() ? "" : " " + c.server_name));
+					req.command = "backup";
 					break;
 				case user:
-					sock->sendLine("user " + c.server_name + '\n' + c.additional);
+					req.command = "user";
+					req.argument = c.additional;
+					break;
+				case logs:
+					req.command = "logs";
+					req.argument = c.additional;
+					break;
+				case backups:
+					req.command = "backups";
+					break;
+				case restore:
+					req.command = "restore";
+					req.argument = c.additional;
+					break;
+				case status:
+					req.command = "status";
+					break;
+				case cancel:
+					req.command = "cancel";
 			}
 			if (done)
 				break;
+			sock->sendLine(formatRequest(req));
+			outstanding.insert(req.id);
+		}
+		// Wait for the final reply to each of them
+		bool open = true;
+		while (!outstanding.empty() && open) {
+			open = sock->read();
+			while (sock->hasMessage()) {
+				struct reply rep;
+				if (!parseReply(sock->nextMessage(), rep))
+					continue;
+				if (!isFinal(rep.code)) {
+					std::cout << rep.text << std::endl;
+					continue;
+				}
+				if (isSuccess(rep.code)) {
+					if (!rep.text.empty())
+						std::cout << rep.text << std::endl;
+				}
+				else {
+					std::cerr << rep.text << std::endl;
+					error = 1;
+				}
+				outstanding.erase(rep.id);
+			}
+		}
+		if (!outstanding.empty()) {
+			std::cerr << "Connection to daemon closed before all commands finished!" << std::endl;
+			error = 1;
 		}
 		delete sock;
 		return error;
@@ -200,128 +290,12 @@ int main(int argc, char *argv[]) {
 		return err;
 	}
 
-	// Start default servers
-	std::map<std::string, Server*> servers(config.getServers());
-	std::cout << "Config has " << servers.size() << " servers." << std::endl;
-	for (auto block : servers) {
-		if (block.second->defaultStartup()) {
-			std::cout << "Starting server [" << block.first << "]" << std::endl;
-			block.second->start();
-		}
-	}
-	// Act as daemon
-	bool quit = false;
-	while (!quit) {
-		if (sock->accept() == -1) {
-			int err = errno;
-			std::cerr << "accept error" << std::endl;
-			delete sock;
-			unlink((data_loc + "/socket").c_str());
-			return err;
-		}
-
-		sock->read();
-		std::string command, name;
-		while (sock->hasMessage()) {
-			command = sock->nextMessage();
-			name.clear();
-
-			std::string::size_type space = command.find_first_of(' ');
-			if (space != std::string::npos) {
-				name = command.substr(space + 1);
-				command.erase(space);
-			}
-			if (command == "quit") {
-				quit = true;
-				break;
-			}
-			if (command == "reload") {
-				std::cout << "Reloading config file..." << std::endl;
-				if (config.parseConfigFile())
-					std::cout << "Successfully reloaded config." << std::endl;
-				else
-					std::cout << "Please fix your config file and try again - no servers were modified." << std::endl;
-				continue;
-			}
-			if (command == "restart" && name.empty()) {
-				std::cout << "Stopping all servers..." << std::endl;
-				for (auto block : servers)
-					block.second->stop();
-				std::cout << "Stopped." << std::endl;
-				config = Config("/etc/mc-daemon.conf");
-				if (config.error())
-					return 1;
-				servers = config.getServers();
-				std::cout << "Config has " << servers.size() << " servers." << std::endl;
-				for (auto block : servers) {
-					Server *s = block.second;
-					if (s->defaultStartup()) {
-						std::cout << "Starting server [" << s->getName() << "]" << std::endl;
-						s->start();
-					}
-				}
-				break;
-			}
-
-			// Handle command
-			if (name.empty()) {
-				// Attempt command on all servers
-				for (auto block : servers) {
-					Server *s = block.second;
-					if (command == "start") {
-						if (!s->start())
-							continue;
-						std::cout << "Starting";
-					}
-					else if (command == "restart") {
-						if (!s->restart())
-							continue;
-						std::cout << "Restarting";
-					}
-					else if (command == "stop") {
-						if (!s->stop())
-							continue;
-						std::cout << "Stopped";
-					}
-					else if (command == "backup") {
-						if (!s->backup())
-							continue;
-						std::cout << "Backing up";
-					}
-					std::cout << " server [" << s->getName() << "]" << std::endl;
-				}
-			}
-			else {
-				auto block_it = servers.find(name);
-				if (block_it == servers.end())
-					std::cout << "No server named [" << name << "]!" << std::endl;
-				else {
-					Server *s = block_it->second;
-					if (command == "start")
-						std::cout << (s->start() ? "Starting server [" + name + "]" : "Server [" + name + "] is already running!") << std::endl;
-					else if (command == "restart")
-						std::cout << (s->restart() ? "Restarting server [" + name + "]" : "Server [" + name + "] is not running!") << std::endl;
-					else if (command == "stop")
-						std::cout << (s->stop() ? "Stopped server [" + name + "]" : "Server [" + name + "] is not running!") << std::endl;
-					else if (command == "backup")
-						std::cout << (s->backup() ? "Backing up server [" + name + "]" : "Server [" + name + "] is not running!") << std::endl;
-					else if (command == "user") {
-						if (!sock->hasMessage()) {
-							std::cout << "Expected next line to contain custom command, but message queue was empty!" << std::endl;
-							continue;
-						}
-						std::cout << "Sending custom command to [" + name + "]:" << std::endl;
-						std::string message = sock->nextMessage();
-						s->send(message + '\n');
-					}
-				}
-			}
-		}
-	}
+	// Act as daemon, starting default servers
+	std::cout << "Config has " << config.getServers().size() << " servers." << std::endl;
+	Daemon mcd(&config, sock);
+	mcd.run();
 	std::cout << "Stopping servers..." << std::endl;
-	for (auto block : servers)
-		if (block.second->stop())
-			std::cout << "Stopped [" << block.first << "]" << std::endl;
+	mcd.stopAll();
 	delete sock;
 	unlink((data_loc + "/socket").c_str());
 }
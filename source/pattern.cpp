@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <ctype.h>
+#include "pattern.hpp"
+
+// The longest run of plain text every match of one alternative must contain.
+// Anything inside groups or brackets is skipped, which only makes it shorter.
+static std::string requiredText(std::string_view alternative) {
+	std::string best, run;
+	bool literal = false; // Whether the last thing seen was a character in run
+	int depth = 0;
+	auto endRun = [&]() {
+		if (run.size() > best.size())
+			best = run;
+		run.clear();
+		literal = false;
+	};
+
+	for (size_t i = 0; i < alternative.size(); ++i) {
+		char c = alternative[i];
+		if (c == '\\' && i + 1 < alternative.size()) {
+			// Letters and digits are classes, anchors, references or character
+			// codes; anything else is escaped punctuation, which is plain text
+			char escaped = alternative[++i];
+			if (isalnum((unsigned char)escaped) || depth) {
+				// What a code stands for isn't worked out, but its digits (or
+				// control letter) mustn't be taken as text
+				if (escaped == 'x')
+					i = std::min(i + 2, alternative.size() - 1);
+				else if (escaped == 'u')
+					i = std::min(i + 4, alternative.size() - 1);
+				else if (escaped == 'c')
+					i = std::min(i + 1, alternative.size() - 1);
+				endRun();
+			}
+			else {
+				run += alternative[i];
+				literal = true;
+			}
+		}
+		else if (c == '[') {
+			size_t j = i + 1;
+			if (j < alternative.size() && alternative[j] == '^')
+				++j;
+			while (j < alternative.size() && alternative[j] != ']')
+				j += alternative[j] == '\\' ? 2 : 1;
+			i = j;
+			endRun();
+		}
+		else if (c == '(' || c == ')') {
+			depth += c == '(' ? 1 : -1;
+			endRun();
+		}
+		else if (c == '*' || c == '?' || c == '{') {
+			// The character before may not be there at all
+			if (literal)
+				run.pop_back();
+			if (c == '{')
+				while (i < alternative.size() && alternative[i] != '}')
+					++i;
+			endRun();
+		}
+		else if (c == '+') {
+			// Needed once, but more may follow it
+			endRun();
+		}
+		else if (c == '.' || c == '^' || c == '$' || depth)
+			endRun();
+		else {
+			run += c;
+			literal = true;
+		}
+	}
+	endRun();
+	return best;
+}
+
+bool Pattern::compile(std::string source) {
+	std::regex regex;
+	if (!source.empty()) {
+		try {
+			regex.assign(source, std::regex::ECMAScript | std::regex::optimize);
+		}
+		catch (const std::regex_error&) {
+			return false;
+		}
+	}
+
+	// Split at top level |, every alternative needs its own text to look for
+	std::vector<std::string> literals;
+	int depth = 0;
+	size_t start = 0;
+	for (size_t i = 0; i <= source.size(); ++i) {
+		if (i < source.size() && source[i] == '\\') {
+			++i;
+			continue;
+		}
+		if (i < source.size() && source[i] == '[') {
+			while (i + 1 < source.size() && source[i + 1] != ']')
+				i += source[i + 1] == '\\' ? 2 : 1;
+			continue;
+		}
+		if (i < source.size() && (source[i] == '(' || source[i] == ')')) {
+			depth += source[i] == '(' ? 1 : -1;
+			continue;
+		}
+		if (i < source.size() && (source[i] != '|' || depth))
+			continue;
+		std::string text = requiredText(std::string_view(source).substr(start, i - start));
+		if (text.empty()) {
+			// Could match anywhere, so every line has to be checked
+			literals.clear();
+			break;
+		}
+		literals.push_back(text);
+		start = i + 1;
+	}
+
+	this->source = source;
+	this->regex = regex;
+	this->literals = literals;
+	compiled = !source.empty();
+	return true;
+}
+
+std::vector<std::string> Pattern::getLiterals() {
+	return literals;
+}
+
+std::string Pattern::getSource() {
+	return source;
+}
+
+bool Pattern::match(std::string_view line) {
+	if (!compiled)
+		return false;
+	if (!literals.empty()) {
+		bool found = false;
+		for (const std::string &literal : literals)
+			if (line.find(literal) != std::string_view::npos) {
+				found = true;
+				break;
+			}
+		if (!found)
+			return false;
+	}
+	return std::regex_search(line.begin(), line.end(), regex);
+}
+
+bool Pattern::search(std::string_view line) {
+	return compiled && std::regex_search(line.begin(), line.end(), regex);
+}
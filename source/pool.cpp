@@ -0,0 +1,39 @@
+#include "pool.hpp"
+
+void ThreadPool::submit(std::function<void()> job) {
+	mtx.lock();
+	jobs.push(job);
+	mtx.unlock();
+	cv.notify_one();
+}
+
+void ThreadPool::work() {
+	std::unique_lock<std::mutex> lck(mtx);
+	while (true) {
+		while (jobs.empty() && !stopping)
+			cv.wait(lck);
+		if (jobs.empty())
+			break;
+		std::function<void()> job = jobs.front();
+		jobs.pop();
+		lck.unlock();
+		job();
+		lck.lock();
+	}
+}
+
+ThreadPool::ThreadPool(size_t threads) {
+	if (threads == 0)
+		threads = 1;
+	for (size_t i = 0; i < threads; ++i)
+		workers.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool() {
+	mtx.lock();
+	stopping = true;
+	mtx.unlock();
+	cv.notify_all();
+	for (std::thread &worker : workers)
+		worker.join();
+}
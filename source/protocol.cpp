@@ -0,0 +1,69 @@
+#include "protocol.hpp"
+
+// Splits off the next tab separated field of line, starting at pos
+static std::string_view nextField(std::string_view line, std::string_view::size_type &pos) {
+	if (pos == std::string_view::npos)
+		return std::string_view();
+	std::string_view::size_type tab = line.find_first_of('\t', pos);
+	std::string_view field = line.substr(pos, tab == std::string_view::npos ? tab : tab - pos);
+	pos = tab == std::string_view::npos ? tab : tab + 1;
+	return field;
+}
+
+static bool parseNumber(std::string_view field, unsigned long &number) {
+	if (field.empty() || field.size() > 19 || field.find_first_not_of("0123456789") != std::string_view::npos)
+		return false;
+	number = 0;
+	for (char digit : field)
+		number = number * 10 + (digit - '0');
+	return true;
+}
+
+bool isFinal(enum status code) {
+	return code != st_partial;
+}
+
+bool isSuccess(enum status code) {
+	return code >= 200 && code < 300;
+}
+
+std::string formatRequest(const struct request &req) {
+	std::string line = std::to_string(req.id) + '\t' + req.command;
+	if (!req.server.empty() || !req.argument.empty())
+		line += '\t' + req.server;
+	if (!req.argument.empty())
+		line += '\t' + req.argument;
+	return line;
+}
+
+bool parseRequest(std::string_view line, struct request &req) {
+	// Whatever sent a line break inside a field meant it as two requests
+	if (line.find('\n') != std::string_view::npos)
+		return false;
+	std::string_view::size_type pos = 0;
+	if (!parseNumber(nextField(line, pos), req.id))
+		return false;
+	req.command = nextField(line, pos);
+	req.server = nextField(line, pos);
+	// The argument is everything else, tabs included
+	req.argument = pos == std::string_view::npos ? std::string_view() : line.substr(pos);
+	return !req.command.empty();
+}
+
+std::string formatReply(const struct reply &rep) {
+	std::string text = rep.text;
+	for (char &c : text)
+		if (c == '\n')
+			c = ' ';
+	return std::to_string(rep.id) + '\t' + std::to_string(rep.code) + '\t' + text;
+}
+
+bool parseReply(std::string_view line, struct reply &rep) {
+	std::string_view::size_type pos = 0;
+	unsigned long code;
+	if (!parseNumber(nextField(line, pos), rep.id) || !parseNumber(nextField(line, pos), code))
+		return false;
+	rep.code = (enum status)code;
+	rep.text = pos == std::string_view::npos ? std::string_view() : line.substr(pos);
+	return true;
+}
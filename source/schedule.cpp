@@ -0,0 +1,133 @@
+#include <map>
+#include <sstream>
+#include <vector>
+#include "schedule.hpp"
+
+// How far ahead to look for a matching day (leap days included)
+#define SCHEDULE_MAX_DAYS (8 * 366)
+
+static const std::map<std::string, std::string> aliases = {
+	{ "@hourly", "0 * * * *" },
+	{ "@daily", "0 0 * * *" },
+	{ "@weekly", "0 0 * * 0" },
+	{ "@monthly", "0 0 1 * *" }
+};
+
+static bool parseNumber(std::string value, int &number) {
+	if (value.empty() || value.size() > 2 || value.find_first_not_of("0123456789") != std::string::npos)
+		return false;
+	number = std::stoi(value);
+	return true;
+}
+
+// Sets a bit for every value a field allows, numbered from 0
+static bool parseField(std::string field, int min, int max, uint64_t &bits) {
+	bits = 0;
+	std::stringstream items(field);
+	std::string item;
+	while (std::getline(items, item, ',')) {
+		int step = 1, first = min, last = max;
+		std::string::size_type slash = item.find('/');
+		if (slash != std::string::npos) {
+			if (!parseNumber(item.substr(slash + 1), step) || step == 0)
+				return false;
+			item.erase(slash);
+		}
+		if (item != "*") {
+			std::string::size_type dash = item.find('-');
+			if (!parseNumber(item.substr(0, dash), first))
+				return false;
+			if (dash != std::string::npos) {
+				if (!parseNumber(item.substr(dash + 1), last))
+					return false;
+			}
+			// Like cron, 5/10 means 5-max/10
+			else if (slash == std::string::npos)
+				last = first;
+		}
+		if (first < min || last > max || first > last)
+			return false;
+		for (int value = first; value <= last; value += step)
+			bits |= 1ULL << value;
+	}
+	return !field.empty() && field.back() != ',';
+}
+
+bool Schedule::matchesDay(const struct tm &day) {
+	if (!(months & (1 << (day.tm_mon + 1))))
+		return false;
+	bool dom = days & (1U << day.tm_mday), dow = weekdays & (1 << day.tm_wday);
+	if (any_day || any_weekday)
+		return dom && dow;
+	return dom || dow;
+}
+
+bool Schedule::parse(std::string line) {
+	auto alias_it = aliases.find(line);
+	if (alias_it != aliases.end())
+		line = alias_it->second;
+	std::stringstream stream(line);
+	std::vector<std::string> fields;
+	std::string field;
+	while (stream >> field)
+		fields.push_back(field);
+	if (fields.size() != 5)
+		return false;
+
+	uint64_t minute_bits, hour_bits, day_bits, month_bits, weekday_bits;
+	if (!parseField(fields[0], 0, 59, minute_bits) ||
+			!parseField(fields[1], 0, 23, hour_bits) ||
+			!parseField(fields[2], 1, 31, day_bits) ||
+			!parseField(fields[3], 1, 12, month_bits) ||
+			!parseField(fields[4], 0, 7, weekday_bits))
+		return false;
+	// Sunday is 0 or 7
+	if (weekday_bits & (1 << 7))
+		weekday_bits = (weekday_bits | 1) & 0x7f;
+
+	minutes = minute_bits;
+	hours = hour_bits;
+	days = day_bits;
+	months = month_bits;
+	weekdays = weekday_bits;
+	any_day = fields[2][0] == '*';
+	any_weekday = fields[4][0] == '*';
+	return true;
+}
+
+time_t Schedule::next(time_t after) {
+	struct tm day;
+	time_t start = after - after % 60 + 60;
+	localtime_r(&start, &day);
+	int hour = day.tm_hour, minute = day.tm_min;
+	for (int i = 0; i < SCHEDULE_MAX_DAYS; ++i) {
+		if (matchesDay(day)) {
+			for (int h = hour; h < 24; ++h) {
+				if (!(hours & (1U << h)))
+					continue;
+				for (int m = h == hour ? minute : 0; m < 60; ++m) {
+					if (!(minutes & (1ULL << m)))
+						continue;
+					struct tm when = day;
+					when.tm_hour = h;
+					when.tm_min = m;
+					when.tm_sec = 0;
+					when.tm_isdst = -1;
+					time_t at = mktime(&when);
+					// Skipped over by a daylight saving change, or otherwise
+					// already past
+					if (at > after)
+						return at;
+				}
+			}
+		}
+		// Start of the next day (noon avoids daylight saving surprises)
+		day.tm_mday += 1;
+		day.tm_hour = 12;
+		day.tm_min = day.tm_sec = 0;
+		day.tm_isdst = -1;
+		mktime(&day);
+		hour = minute = 0;
+	}
+	return -1;
+}
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include "scheduler.hpp"
+
+// One slot per minute of the hour
+#define WHEEL_SLOTS 60
+
+void Scheduler::at(time_t when, std::function<void()> func) {
+	time_t now = time(NULL);
+	unsigned long ms = when > now ? (when - now) * 1000 : 0;
+	// Timers belong to the event loop's thread, the work to the actions thread
+	loop->post([this, ms, func]() {
+		auto id = std::make_shared<unsigned long>();
+		*id = loop->after(ms, [this, id, func]() {
+			timers.erase(*id);
+			actions->submit(func);
+		});
+		timers.insert(*id);
+	});
+}
+
+void Scheduler::dispatch() {
+	time_t now = time(NULL);
+	while (!waiting.empty() && running.size() < jobs) {
+		if (last_start && now < last_start + stagger) {
+			if (!retry_armed) {
+				retry_armed = true;
+				at(last_start + stagger, [this]() {
+					retry_armed = false;
+					dispatch();
+				});
+			}
+			return;
+		}
+		std::string name = waiting.front();
+		waiting.pop_front();
+		auto server_it = servers.find(name);
+		if (server_it == servers.end())
+			continue;
+		if (!server_it->second->backup()) {
+			if (server_it->second->getBackup().empty())
+				std::cerr << "Skipped scheduled backup of [" << name << "], it has no backup directory" << std::endl;
+			else
+				std::cerr << "Skipped scheduled backup of [" << name << "], it is not running" << std::endl;
+			continue;
+		}
+		std::cout << "Started scheduled backup of [" << name << "]" << std::endl;
+		running.insert(name);
+		last_start = now;
+	}
+}
+
+void Scheduler::finished(std::string name) {
+	if (running.erase(name))
+		dispatch();
+}
+
+void Scheduler::insert(std::string name, time_t after) {
+	time_t when = schedules[name].next(after);
+	if (when == -1)
+		return;
+	time_t minute = when / 60;
+	wheel[minute % WHEEL_SLOTS].push_back({ name, minute });
+}
+
+void Scheduler::tick() {
+	time_t now = time(NULL), minute = now / 60;
+	if (minute < current) {
+		// The clock went back, count everything again from now
+		update(servers, jobs, stagger);
+		at((current + 1) * 60, [this]() { tick(); });
+		return;
+	}
+	// Normally one slot, more if this is late (every slot once at most, so
+	// backups missed while the clock jumped ahead only run once)
+	for (time_t m = current + 1; m <= minute && m <= current + WHEEL_SLOTS; ++m) {
+		std::vector<struct schedule_entry> slot;
+		slot.swap(wheel[m % WHEEL_SLOTS]);
+		for (struct schedule_entry &entry : slot) {
+			if (entry.minute > minute) {
+				// Due on a later turn of the wheel
+				wheel[m % WHEEL_SLOTS].push_back(entry);
+				continue;
+			}
+			if (std::find(waiting.begin(), waiting.end(), entry.server) == waiting.end() && running.find(entry.server) == running.end())
+				waiting.push_back(entry.server);
+			insert(entry.server, minute * 60 + 59);
+		}
+	}
+	current = minute;
+	dispatch();
+	at((minute + 1) * 60, [this]() { tick(); });
+}
+
+void Scheduler::update(std::map<std::string, Server*> servers, size_t jobs, time_t stagger) {
+	for (auto block : this->servers)
+		if (servers.find(block.first) == servers.end()) {
+			running.erase(block.first);
+			waiting.erase(std::remove(waiting.begin(), waiting.end(), block.first), waiting.end());
+		}
+	this->servers = servers;
+	this->jobs = jobs;
+	this->stagger = stagger;
+
+	bool started = current != 0;
+	time_t now = time(NULL);
+	current = now / 60;
+	schedules.clear();
+	wheel.assign(WHEEL_SLOTS, std::vector<struct schedule_entry>());
+	for (auto block : servers) {
+		std::string name = block.first;
+		block.second->onBackup([this, name](bool) {
+			loop->post([this, name]() { actions->submit([this, name]() { finished(name); }); });
+		});
+		if (block.second->getBackupSchedule().empty() || !schedules[name].parse(block.second->getBackupSchedule())) {
+			schedules.erase(name);
+			continue;
+		}
+		insert(name, now);
+	}
+	if (!started)
+		at((current + 1) * 60, [this]() { tick(); });
+	dispatch();
+}
+
+Scheduler::Scheduler(EventLoop *loop, ThreadPool *actions) {
+	this->loop = loop;
+	this->actions = actions;
+}
+
+Scheduler::~Scheduler() {
+	// The loop has stopped by now, so its timers can be cancelled from here
+	for (unsigned long id : timers)
+		loop->cancel(id);
+	for (auto block : servers)
+		block.second->onBackup(nullptr);
+}
@@ -1,18 +1,187 @@
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
 #include <fcntl.h>
 #include <iostream>
+#include <memory>
+#include <set>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include "archive.hpp"
+#include "catalog.hpp"
+#include "compress.hpp"
+#include "backup.hpp"
+#include "extract.hpp"
+#include "pool.hpp"
 #include "server.hpp"
+#include "snapshot.hpp"
+#include "spawn.hpp"
+#include "supervisor.hpp"
+#include "throttle.hpp"
 
-/*void Server::addWorld(std::string world) {
-	worlds.push_back(world);
-}*/
+// Start of a line the server logged itself: bracketed parts like "[time]
+// [thread/LEVEL]: " (or "date [LEVEL] " before 1.7), and then the message
+// right away, rather than the "<player> " or "[player] " of chat and /say
+#define LOG_PREFIX "^[^<\\[]*(\\[[^\\]]*\\] ?)+(: )?"
+// What servers print once "save-all" is done (vanilla, and before 1.13)
+#define DEFAULT_SAVE_PATTERN LOG_PREFIX "Saved the game|" LOG_PREFIX "Save complete"
+// What servers print once they are ready for players (vanilla, and servers
+// based on it)
+#define DEFAULT_READY_PATTERN LOG_PREFIX "Done \\(.*\\)! For help"
+// What servers print when told to stop (by the daemon, or by someone in game)
+#define DEFAULT_STOP_PATTERN LOG_PREFIX "Stopping (the )?server"
+// What servers print when they crash
+#define DEFAULT_CRASH_PATTERN LOG_PREFIX "Encountered an unexpected exception|" LOG_PREFIX "This crash report has been saved"
+// Backups done by the daemon itself (rather than tar) that may run at once
+#define BACKUP_THREADS 4
+
+// Takes snapshots, and nothing else: saves are off until one is done, so it
+// mustn't wait behind anything slow
+static ThreadPool *snapshotPool() {
+	static ThreadPool pool(BACKUP_THREADS);
+	return &pool;
+}
+
+// Runs restores and walks of a server's files, off the supervisor's thread
+static ThreadPool *jobPool() {
+	static ThreadPool pool(BACKUP_THREADS);
+	return &pool;
+}
+
+// Writes and prunes backups. Its threads become idle (see becomeIdle) for
+// good, so nothing else may run on them.
+static ThreadPool *idlePool() {
+	static ThreadPool pool(BACKUP_THREADS);
+	return &pool;
+}
+
+// Deletes the backups a server's retention policy no longer keeps, one at a
+// time, so stopping part way leaves the catalog matching what's on disk
+static void prune(std::string dir, std::string server, struct retention keep) {
+	Catalog *catalog = Catalog::get(dir);
+	if (catalog == nullptr)
+		return;
+	bool dedup = false;
+	for (const struct catalog_entry &entry : catalog->expired(server, keep)) {
+		if (entry.format == "dedup") {
+			if (!BackupStore(dir).remove(entry.name))
+				continue;
+			dedup = true;
+		}
+		else if (unlink((dir + '/' + entry.name).c_str()) == -1 && errno != ENOENT) {
+			std::cerr << "Could not remove backup " << dir << '/' << entry.name << " (" << errno << ")" << std::endl;
+			continue;
+		}
+		catalog->remove(server, entry.name);
+		std::cout << "Pruned backup " << entry.name << " of [" << server << "]" << std::endl;
+	}
+	unsigned long long freed = 0;
+	if (dedup && BackupStore(dir).collect(freed))
+		std::cout << "Freed " << freed << " bytes of unused chunks in " << dir << std::endl;
+}
+
+// How long is left before a restart, for players
+static std::string remaining(time_t seconds) {
+	if (seconds >= 60 && seconds % 60 == 0)
+		return std::to_string(seconds / 60) + (seconds == 60 ? " minute" : " minutes");
+	return std::to_string(seconds) + (seconds == 1 ? " second" : " seconds");
+}
+
+std::string stateName(enum server_state state) {
+	switch (state) {
+		case ss_stopped:
+			return "stopped";
+		case ss_starting:
+			return "starting";
+		case ss_ready:
+			return "ready";
+		case ss_stopping:
+			return "stopping";
+		case ss_backing_up:
+			return "backing up";
+		case ss_crashed:
+			return "crashed";
+	}
+	return "unknown";
+}
+
+void Server::archive(unsigned long gen) {
+	if (gen != generation)
+		return;
+	// What was written since the last backup, the save just made included
+	auto changes = std::make_shared<std::set<std::string>>();
+	if (!tracker.take(*changes) || last_backup.empty())
+		changes.reset();
+	else if (changes->empty()) {
+		std::cout << "Nothing in [" << name << "] changed since " << last_backup << ", skipped backing it up" << std::endl;
+		archived(gen, true, last_backup);
+		return;
+	}
+	// Only dedup backups can take the rest from the last one
+	if (backup_format != "dedup")
+		changes.reset();
+	backup_changes = changes;
+	if (!backup_snapshot) {
+		store(gen, path, false);
+		return;
+	}
+	std::string source = path, snapshot_dir = path;
+	while (snapshot_dir.size() > 1 && snapshot_dir.back() == '/')
+		snapshot_dir.pop_back();
+	snapshot_dir += ".snapshot";
+	size_t threads = backup_threads;
+	std::vector<std::string> directories = worlds;
+	// Saves are off until it is done, so it gets all the disk it can
+	runJob(snapshotPool(), [this, gen, source, snapshot_dir, threads, directories, changes]() {
+		Snapshot snapshot(threads);
+		snapshot.setChanges(changes.get());
+		snapshot.setDirectories(directories);
+		auto start = std::chrono::steady_clock::now();
+		bool ok = snapshot.take(source, snapshot_dir);
+		long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+		if (ok)
+			std::cout << "Snapshot of [" << name << "] taken in " << ms << " ms (" << snapshot.getCloned() << " files cloned, " << snapshot.getCopied() << " copied)" << std::endl;
+		else {
+			std::cerr << "Could not snapshot [" << name << "], backing up in place" << std::endl;
+			Snapshot::remove(snapshot_dir);
+		}
+		Supervisor::get()->post([this, gen, ok, snapshot_dir]() { snapshotted(gen, ok ? snapshot_dir : ""); });
+	});
+}
+
+void Server::archived(unsigned long gen, bool ok, std::string backup) {
+	archiving = false;
+	backup_changes.reset();
+	if (on_backup)
+		on_backup(ok);
+	if (gen != generation)
+		return;
+	// The changes it was given are gone, so the next one reads everything
+	if (ok)
+		last_backup = backup;
+	else
+		tracker.reset();
+	if (saves_off) {
+		console.write("save-on\n", true);
+		saves_off = busy = false;
+		if (state == ss_backing_up)
+			state = ready ? ss_ready : ss_starting;
+	}
+	if (ok)
+		console.write("say §1Backup finished.\n", true);
+	else
+		console.write("say §1An error occured while backing up, please alert an administrator!\n", true);
+	runCommands();
+}
 
 bool Server::backup() {
 	if (backup_dir.empty()) {
 		std::cerr << "No backup directory specified in config!" << std::endl;
-		return true;
+		return false;
 	}
 	if (!running)
 		return false;
@@ -20,86 +189,241 @@ bool Server::backup() {
 	return true;
 }
 
-bool Server::defaultStartup() {
-	return default_startup;
+void Server::becameReady(bool found) {
+	if (ready_timer) {
+		Supervisor::get()->events()->cancel(ready_timer);
+		ready_timer = 0;
+	}
+	if (found) {
+		ready = true;
+		ready_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - launched).count();
+		if (state == ss_starting)
+			state = ss_ready;
+		std::cout << "Server [" << name << "] is ready, " << ready_time << " ms after it was launched" << std::endl;
+	}
+	else
+		std::cerr << "Server [" << name << "] did not say it was ready within " << ready_timeout << " seconds" << std::endl;
+	// Once per launch: saying so after the timeout only shows in its state
+	if (ready_told)
+		return;
+	ready_told = true;
+	if (on_ready)
+		on_ready(found);
 }
 
-pid_t Server::execute(std::vector<std::string> args) {
-	pid_t child = fork();
-	if (!child) {
-		// set up file descriptors
-		close(fds[1]);
-		dup2(fds[0], 0);
+bool Server::cancelRestart() {
+	bool cancelled = false;
+	Supervisor::get()->call([&]() {
+		if (!restart_timer)
+			return;
+		Supervisor::get()->events()->cancel(restart_timer);
+		restart_timer = 0;
+		cancelled = true;
+		console.write("say §2Restart cancelled.\n", true);
+	});
+	return cancelled;
+}
 
-		// become proper user/group
-		setgid(group);
-		setuid(user);
+void Server::childExited(int status) {
+	child = -1;
+	if (stop_timer) {
+		Supervisor::get()->events()->cancel(stop_timer);
+		stop_timer = 0;
+	}
+	if (restarting) {
+		restarting = stopping = false;
+		launch();
+		return;
+	}
+	// Said it was stopping (someone stopped it in game) is no crash either
+	if (!stopping && state != ss_stopping) {
+		std::cerr << "Server [" << name << "] exited on its own (status " << status << ")!" << std::endl;
+		if (!notify.empty() && state != ss_crashed)
+			runThen({ notify, "Server " + name + " exited unexpectedly!" }, [](){});
+		state = ss_crashed;
+	}
+	shutdown();
+}
 
-		int logfd;
+// Warns players with `left` seconds to go, and then at each shorter step of
+// the countdown, until it's time to restart
+void Server::countdown(time_t left) {
+	restart_timer = 0;
+	if (left == 0) {
+		restarting = true;
+		commands.push("stop\n");
+		runCommands();
+		return;
+	}
+	console.write("say §4Restarting server in §c" + remaining(left) + "§4!\n", true);
+	time_t next = 0;
+	for (time_t step : restart_countdown)
+		if (step < left && step > next)
+			next = step;
+	restart_timer = Supervisor::get()->events()->after((left - next) * 1000, [this, next]() { countdown(next); });
+}
 
-		// Go to the designated logging directory (if one was set)
-		if (!log.empty()) {
-			if (chdir(log.c_str()) == -1) {
-				std::cerr << "chdir error (" << errno << ")" << std::endl;
-				exit(1);
-			}
-			if (logfd = open(("mcd." + name + ".log").c_str(), O_CREAT | O_APPEND | O_WRONLY, S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH), logfd == -1) {
-				std::cerr << "Could not open log file for writing! (" << errno << ")" << std::endl;
-				exit(1);
-			}
-		}
+bool Server::defaultStartup() {
+	return default_startup;
+}
 
-		// Go to the designated directory
-		if (chdir(path.c_str()) == -1) {
-			std::cerr << "chdir error (" << errno << ")" << std::endl;
-			exit(1);
-		}
-		if (log.empty()) {
-			if (logfd = open(("mcd." + name + ".log").c_str(), O_CREAT | O_APPEND | O_WRONLY, S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH), logfd == -1) {
-				std::cerr << "Could not open log file for writing! (" << errno << ")" << std::endl;
-				exit(1);
-			}
-		}
+// Stopping took too long, signal the server (and whatever it started)
+void Server::escalate(int signal) {
+	stop_timer = 0;
+	if (child == -1)
+		return;
+	if (signal == SIGTERM) {
+		std::cerr << "Server [" << name << "] did not stop within " << stop_timeout << " seconds, sending it SIGTERM" << std::endl;
+		stop_timer = Supervisor::get()->events()->after(kill_timeout * 1000, [this]() { escalate(SIGKILL); });
+	}
+	else
+		std::cerr << "Server [" << name << "] is still running " << kill_timeout << " seconds after SIGTERM, killing it" << std::endl;
+	kill(-child, signal);
+}
 
-		// Redirect stdout and stderr to log file
-		dup2(logfd, 1);
-		dup2(logfd, 2);
-
-		const char *argv[args.size() + 1];
-		std::vector<std::string>::size_type i;
-		for (i = 0; i < args.size(); ++i)
-			argv[i] = args[i].c_str();
-		argv[i] = NULL;
-		if (execvp(argv[0], (char**)argv) == -1)
-			std::cerr << "execvp error when trying to run " << argv[0] << "! (" << errno << ")" << std::endl;
-		close(fds[0]);
-		exit(errno);
+pid_t Server::execute(std::vector<std::string> args, std::function<void(int)> on_exit) {
+	struct spawn_attr attr;
+	attr.args = args;
+	attr.user = user;
+	attr.group = group;
+	attr.cwd = path;
+	attr.input = console.output();
+	attr.output_fd = output.input();
+	attr.session = true;
+
+	int pidfd;
+	pid_t child = spawn(attr, &pidfd);
+	if (child == -1)
+		return -1;
+	if (!Supervisor::get()->watch(child, on_exit, pidfd)) {
+		kill(child, SIGKILL);
+		while (waitpid(child, NULL, 0) == -1 && errno == EINTR);
+		return -1;
 	}
 	return child;
 }
 
+void Server::finish() {
+	// A backup that never got as far as archiving
+	if (save_timer) {
+		Supervisor::get()->events()->cancel(save_timer);
+		save_timer = 0;
+		archiving = false;
+		if (on_backup)
+			on_backup(false);
+	}
+	// Never got ready, and the timeout didn't say so yet
+	if (ready_timer) {
+		Supervisor::get()->events()->cancel(ready_timer);
+		ready_timer = 0;
+	}
+	if (!ready_told && on_ready)
+		on_ready(false);
+	if (restart_timer) {
+		Supervisor::get()->events()->cancel(restart_timer);
+		restart_timer = 0;
+	}
+	if (stop_timer) {
+		Supervisor::get()->events()->cancel(stop_timer);
+		stop_timer = 0;
+	}
+	output.watch(nullptr);
+	output.close();
+	console.close();
+	tracker.close();
+	// Backups that never got to run
+	for (; !commands.empty(); commands.pop())
+		if (commands.front() == "backup\n" && on_backup)
+			on_backup(false);
+	busy = ready = ready_told = stop_queued = stopping = restarting = saves_off = false;
+	// Left as crashed until it is started again
+	if (state != ss_crashed)
+		state = ss_stopped;
+	++generation;
+	running = false;
+	std::cout << "Server [" << name << "] stopped" << std::endl;
+	// Once one of them wakes the server may be deleted (taken out of the
+	// config), so nothing of it is used after
+	std::vector<std::promise<void>> waiters;
+	waiters.swap(stop_waiters);
+	for (std::promise<void> &waiter : waiters)
+		waiter.set_value();
+}
+
 std::vector<std::string> Server::getAfter() {
 	return after;
 }
 
-std::vector<std::string> Server::getBefore() {
-	return before;
+std::string Server::getBackup() {
+	return backup_dir;
+}
+
+std::string Server::getCrashPattern() {
+	return crash_pattern.getSource();
 }
 
-std::condition_variable *Server::getCv() {
-	return cv;
+std::string Server::getBackupFormat() {
+	return backup_format;
+}
+
+size_t Server::getBackupMemory() {
+	return backup_memory;
+}
+
+size_t Server::getBackupRate() {
+	return backup_rate;
+}
+
+struct retention Server::getRetention() {
+	return retention;
+}
+
+std::string Server::getBackupSchedule() {
+	return backup_schedule;
+}
+
+size_t Server::getBackupThreads() {
+	return backup_threads;
+}
+
+bool Server::getBackupSnapshot() {
+	return backup_snapshot;
+}
+
+std::vector<std::string> Server::getBefore() {
+	return before;
 }
 
 gid_t Server::getGroup() {
 	return group;
 }
 
+size_t Server::getInputLimit() {
+	return input_limit;
+}
+
+time_t Server::getInputTimeout() {
+	return input_timeout;
+}
+
 std::string Server::getLog() {
 	return log;
 }
 
-std::mutex *Server::getMtx() {
-	return mtx;
+time_t Server::getLogAge() {
+	return log_age;
+}
+
+int Server::getLogCompress() {
+	return log_compress;
+}
+
+time_t Server::getKillTimeout() {
+	return kill_timeout;
+}
+
+size_t Server::getLogSize() {
+	return log_size;
 }
 
 std::string Server::getName() {
@@ -110,26 +434,120 @@ std::string Server::getNotify() {
 	return notify;
 }
 
+std::string Server::getSavePattern() {
+	return save_pattern.getSource();
+}
+
+time_t Server::getSaveTimeout() {
+	return save_timeout;
+}
+
 std::string Server::getPath() {
 	return path;
 }
 
+std::string Server::getReadyPattern() {
+	return ready_pattern.getSource();
+}
+
+time_t Server::getReadyTimeout() {
+	return ready_timeout;
+}
+
+long Server::getReadyTime() {
+	long time = -1;
+	Supervisor::get()->call([&]() { time = ready_time; });
+	return time;
+}
+
+std::vector<time_t> Server::getRestartCountdown() {
+	return restart_countdown;
+}
+
 std::string Server::getRun() {
 	return run;
 }
 
+std::vector<std::string> Server::getStartAfter() {
+	return start_after;
+}
+
+int Server::getStartPriority() {
+	return start_priority;
+}
+
+enum server_state Server::getState() {
+	enum server_state current = ss_stopped;
+	Supervisor::get()->call([&]() { current = state; });
+	return current;
+}
+
+std::string Server::getStopPattern() {
+	return stop_pattern.getSource();
+}
+
+time_t Server::getStopTimeout() {
+	return stop_timeout;
+}
+
 uid_t Server::getUser() {
 	return user;
 }
 
-bool Server::hasCommand() {
-	return !commands.empty();
+std::vector<std::string> Server::getWorlds() {
+	return worlds;
 }
 
-std::string Server::popCommand() {
-	std::string cmd = commands.front();
-	commands.pop();
-	return cmd;
+void Server::launch() {
+	if (child = execute({ run }, [this](int status) { childExited(status); }), child == -1) {
+		std::cerr << "Could not run server [" << name << "]!" << std::endl;
+		shutdown();
+		return;
+	}
+	busy = ready = ready_told = false;
+	state = ss_starting;
+	launched = std::chrono::steady_clock::now();
+	ready_time = -1;
+	if (ready_timer)
+		Supervisor::get()->events()->cancel(ready_timer);
+	ready_timer = 0;
+	if (ready_pattern.getSource().empty())
+		becameReady(true);
+	else {
+		unsigned long gen = generation;
+		ready_timer = Supervisor::get()->events()->after(ready_timeout * 1000, [this, gen]() {
+			ready_timer = 0;
+			if (gen == generation)
+				becameReady(false);
+		});
+	}
+	runCommands();
+}
+
+std::string Server::logFile() {
+	// Where output from before, run, after, and notify goes
+	std::string log_dir = log.empty() ? path : log[0] == '/' ? log : path + '/' + log;
+	return log_dir + "/mcd." + name + ".log";
+}
+
+void Server::onBackup(std::function<void(bool)> on_backup) {
+	if (running)
+		Supervisor::get()->call([&]() { this->on_backup = on_backup; });
+	else
+		this->on_backup = on_backup;
+}
+
+void Server::onReady(std::function<void(bool)> on_ready) {
+	if (running)
+		Supervisor::get()->call([&]() { this->on_ready = on_ready; });
+	else
+		this->on_ready = on_ready;
+}
+
+size_t Server::pendingInput() {
+	size_t pending = 0;
+	Supervisor::get()->call([&]() { pending = console.pending(); });
+	return pending;
 }
 
 bool Server::restart() {
@@ -139,133 +557,297 @@ bool Server::restart() {
 	return true;
 }
 
-void Server::runServer() {
-	std::cout << "Thread created" << std::endl;
-
-	// Create communication pipe
-	pipe(fds);
-
-	pid_t child;
-	signal(SIGTERM, SIG_IGN);
-
-	/*
-	 * Before
-	 */
-	if (!before.empty()) {
-		if (child = execute(before), child == -1)
-			return;
-		while (waitpid(child, NULL, 0) == -1 && errno == EINTR);
+bool Server::restore(struct catalog_entry backup, std::function<void(bool)> done) {
+	bool idle = false;
+	Supervisor::get()->call([&]() {
+		idle = !running && !archiving && !restoring;
+		if (idle)
+			restoring = true;
+	});
+	if (!idle) {
+		std::cerr << "Server [" << name << "] has to be stopped, and not being backed up or restored, to be restored" << std::endl;
+		return false;
 	}
+	// Read on the worker, while the config may change
+	std::string name = this->name, path = this->path, backup_dir = this->backup_dir;
+	std::vector<std::string> worlds = this->worlds;
+	size_t backup_threads = this->backup_threads, backup_memory = this->backup_memory;
+	auto replace = [=]() -> bool {
+		std::string live = path;
+		while (live.size() > 1 && live.back() == '/')
+			live.pop_back();
+		// Next to the server, so it can be renamed into place
+		std::string staging = live + ".restore";
+		if (!Snapshot::remove(staging))
+			return false;
+		auto start = std::chrono::steady_clock::now();
+		bool ok;
+		if (backup.format == "dedup")
+			ok = BackupStore(backup_dir).restore(backup.name, staging, backup_threads);
+		else
+			ok = Extractor(backup_threads, backup_memory).extract(backup_dir + '/' + backup.name, staging);
+		if (!ok) {
+			std::cerr << "Could not restore [" << name << "] from " << backup.name << std::endl;
+			Snapshot::remove(staging);
+			return false;
+		}
 
-	// Notify
-	if (!notify.empty()) {
-		if (child = execute({ notify, "Starting " + name + "." }), child == -1)
-			return;
-		while (waitpid(child, NULL, 0) == -1 && errno == EINTR);
-	}
+		// Each world (or the whole directory) is exchanged with its restored copy
+		// in one step, so it is never missing or half there
+		std::vector<std::string> swaps = worlds;
+		if (swaps.empty()) {
+			swaps.push_back("");
+			struct stat st;
+			if (stat(live.c_str(), &st) == 0) {
+				chown(staging.c_str(), st.st_uid, st.st_gid);
+				chmod(staging.c_str(), st.st_mode & 07777);
+			}
+		}
+		for (const std::string &world : swaps) {
+			std::string from = world.empty() ? staging : staging + '/' + world, to = world.empty() ? live : live + '/' + world;
+			if (access(from.c_str(), F_OK) == -1) {
+				std::cerr << "Backup " << backup.name << " has no " << world << ", left the one in [" << name << "] as it is" << std::endl;
+				continue;
+			}
+			if (renameat2(AT_FDCWD, from.c_str(), AT_FDCWD, to.c_str(), RENAME_EXCHANGE) == 0)
+				continue;
+			// Not there now, so simply moved in
+			if (errno == ENOENT) {
+				for (std::string::size_type slash = world.find('/'); slash != std::string::npos; slash = world.find('/', slash + 1))
+					mkdir((live + '/' + world.substr(0, slash)).c_str(), 0755);
+				if (rename(from.c_str(), to.c_str()) == 0)
+					continue;
+			}
+			std::cerr << "Could not move " << from << " to " << to << " (" << errno << "), what was replaced already is in " << staging << std::endl;
+			return false;
+		}
+		// Now holding what was replaced
+		Snapshot::remove(staging);
+		long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "Restored [" << name << "] from " << backup.name << " in " << ms << " ms" << std::endl;
+		return true;
+	};
+	// Takes as long as reading the whole backup, so not on the caller's thread
+	Supervisor::get()->call([&]() {
+		runJob(jobPool(), [this, replace, done]() {
+			bool ok = replace();
+			Supervisor::get()->post([this, ok, done]() {
+				restoring = false;
+				done(ok);
+			});
+		});
+	});
+	return true;
+}
 
-	/*
-	 * Run
-	 */
-	if (child = execute({ run }), child == -1)
-		return;
-	std::unique_lock<std::mutex> lck(*mtx);
-	std::string command;
-	bool stop = false;
-	while (!stop) {
-		while (commands.empty())
-			cv->wait(lck);
-		command = popCommand();
-		lck.unlock();
+void Server::runCommands() {
+	while (!busy && !commands.empty()) {
+		std::string command = commands.front();
+		commands.pop();
 		if (command == "backup\n") {
-			write(fds[1], "say §1Server is backing up. There might be lag while this process completes.\n", 78);
-			write(fds[1], "save-all\nsave-off\n", 18);
-			sleep(5);
-
-			std::vector<std::string> tar = { "tar", "-zcf" };
-			time_t t = time(NULL);
-			struct tm* now = localtime(&t);
-			// TODO add backup_dir to config
-			tar.push_back(backup_dir + '/' +
-					name + '_' +
-					std::to_string(now->tm_year + 1900) + '-' + std::to_string(now->tm_mon + 1) + '-' + std::to_string(now->tm_mday) + '-' + std::to_string(now->tm_hour) + '-' + std::to_string(now->tm_min) + '-' + std::to_string(now->tm_sec) +
-					".tgz");
-			tar.push_back(".");
-			pid_t tar_pid = execute(tar);
-
-			int tar_stat;
-			while (waitpid(tar_pid, &tar_stat, 0) == -1 && errno == EINTR);
-
-			write(fds[1], "save-on\n", 8);
-			if (WEXITSTATUS(tar_stat))
-				write(fds[1], "say §1An error occured while backing up, please alert an administrator!\n", 73);
-			else
-				write(fds[1], "say §1Backup finished.\n", 24);
-			lck.lock();
+			if (archiving) {
+				std::cerr << "Server [" << name << "] is already being backed up" << std::endl;
+				if (on_backup)
+					on_backup(false);
+				continue;
+			}
+			busy = saves_off = archiving = true;
+			if (state == ss_starting || state == ss_ready)
+				state = ss_backing_up;
+			console.write("say §1Server is backing up. There might be lag while this process completes.\n", true);
+			// Until then, scan looks for the save to finish
+			unsigned long gen = generation;
+			save_timer = Supervisor::get()->events()->after(save_timeout * 1000, [this, gen]() {
+				save_timer = 0;
+				saved(gen, false);
+			});
+			console.write("save-off\nsave-all\n", true);
 			continue;
 		}
 		if (command == "restart\n") {
-			write(fds[1], "say §4Restarting server in §c10§4 seconds!\n", 46);
-			sleep(10);
-			write(fds[1], "stop\n", 5);
-			while (waitpid(child, NULL, 0) == -1 && errno == EINTR);
-			if (child = execute({ run }), child == -1)
-				return;
-			lck.lock();
+			// Commands keep going while it counts down
+			if (restart_timer || restarting) {
+				std::cerr << "Server [" << name << "] is already restarting" << std::endl;
+				continue;
+			}
+			countdown(restart_countdown.empty() ? 0 : restart_countdown.front());
 			continue;
 		}
 		if (command == "stop\n") {
+			// Stopping for good overrides a restart still counting down
+			if (restart_timer) {
+				Supervisor::get()->events()->cancel(restart_timer);
+				restart_timer = 0;
+			}
 			// Notify
-			if (!notify.empty())
-				if (execute({ notify, "Stopping " + name + "..." }) == -1)
-					return;
-			stop = true;
+			if (!notify.empty() && !restarting)
+				runThen({ notify, "Stopping " + name + "..." }, [](){});
+			busy = stopping = true;
+			state = ss_stopping;
+			console.write(command, true);
+			if (stop_timeout)
+				stop_timer = Supervisor::get()->events()->after(stop_timeout * 1000, [this]() { escalate(SIGTERM); });
+			continue;
 		}
-		write(fds[1], command.c_str(), command.size());
-		lck.lock();
+		if (!console.write(command))
+			std::cerr << "Server [" << name << "] has " << console.pending() << " bytes of input it has not read yet, dropping \"" << command.substr(0, std::min<size_t>(command.find('\n'), 32)) << "\"" << std::endl;
 	}
-	lck.unlock();
-	std::cout << "Waiting for server to stop..." << std::endl;
-	while (waitpid(child, NULL, 0) == -1 && errno == EINTR);
+}
 
-	// Notify
-	if (!notify.empty()) {
-		if (child = execute({ notify, "Stopped " + name + "." }), child == -1)
-			return;
-		while (waitpid(child, NULL, 0) == -1 && errno == EINTR);
-	}
+void Server::runJob(ThreadPool *pool, std::function<void()> job) {
+	++jobs;
+	pool->submit([this, job]() {
+		job();
+		// Posted after whatever the job posted back, so that has run by then
+		Supervisor::get()->post([this]() {
+			if (--jobs > 0)
+				return;
+			// The server may be deleted as soon as a waiter is woken
+			std::vector<std::promise<void>> waiters = std::move(job_waiters);
+			job_waiters.clear();
+			for (std::promise<void> &waiter : waiters)
+				waiter.set_value();
+		});
+	});
+}
 
-	/*
-	 * After
-	 */
-	if (!after.empty()) {
-		if (child = execute(after), child == -1)
-			return;
-		while (waitpid(child, NULL, 0) == -1 && errno == EINTR);
+void Server::runThen(std::vector<std::string> args, std::function<void()> next) {
+	if (args.empty()) {
+		next();
+		return;
 	}
+	if (execute(args, [next](int) { next(); }) == -1)
+		next();
+}
 
-	close(fds[0]);
+void Server::saved(unsigned long gen, bool found) {
+	if (gen != generation)
+		return;
+	if (found) {
+		Supervisor::get()->events()->cancel(save_timer);
+		save_timer = 0;
+	}
+	else if (!save_pattern.getSource().empty())
+		std::cerr << "Server [" << name << "] did not finish saving within " << save_timeout << " seconds, backing up anyway" << std::endl;
+	archive(gen);
+}
 
-	std::cout << "Thread exiting" << std::endl;
+void Server::scan(std::string_view line) {
+	// Only what could change something now is looked for
+	bool want_save = save_timer;
+	bool want_ready = child != -1 && !ready;
+	bool want_stop = child != -1 && state != ss_stopping;
+	bool want_crash = child != -1 && state != ss_crashed;
+	if (want_ready && ready_pattern.match(line))
+		becameReady(true);
+	if (want_save && save_pattern.match(line))
+		saved(generation, true);
+	if (want_stop && stop_pattern.match(line))
+		state = ss_stopping;
+	if (want_crash && crash_pattern.match(line)) {
+		state = ss_crashed;
+		std::cerr << "Server [" << name << "] crashed: " << line << std::endl;
+		if (!notify.empty())
+			runThen({ notify, "Server " + name + " crashed!" }, [](){});
+	}
 }
 
 void Server::send(std::string message) {
-	mtx->lock();
-	commands.push(message);
-	mtx->unlock();
-	cv->notify_one();
+	Supervisor::get()->post([this, message]() {
+		if (!running)
+			return;
+		commands.push(message);
+		runCommands();
+	});
 }
 
 void Server::setAfter(std::vector<std::string> after) {
-	this->after = after;
+	if (running)
+		Supervisor::get()->call([&]() { this->after = after; });
+	else
+		this->after = after;
 }
 
 void Server::setBackup(std::string backup) {
-	backup_dir = backup;
+	auto set = [&]() {
+		if (backup == backup_dir)
+			return;
+		backup_dir = backup;
+		// The last backup isn't there to build on anymore
+		last_backup.clear();
+		if (running)
+			track();
+	};
+	if (running)
+		Supervisor::get()->call(set);
+	else
+		set();
+}
+
+void Server::setBackupFormat(std::string backup_format) {
+	auto set = [&]() {
+		// Only a dedup backup can be built on
+		if (backup_format != this->backup_format)
+			last_backup.clear();
+		this->backup_format = backup_format;
+	};
+	if (running)
+		Supervisor::get()->call(set);
+	else
+		set();
+}
+
+void Server::setBackupMemory(size_t backup_memory) {
+	if (running)
+		Supervisor::get()->call([&]() { this->backup_memory = backup_memory; });
+	else
+		this->backup_memory = backup_memory;
+}
+
+void Server::setBackupRate(size_t backup_rate) {
+	if (running)
+		Supervisor::get()->call([&]() { this->backup_rate = backup_rate; });
+	else
+		this->backup_rate = backup_rate;
+}
+
+void Server::setRetention(struct retention retention) {
+	if (running)
+		Supervisor::get()->call([&]() { this->retention = retention; });
+	else
+		this->retention = retention;
+}
+
+void Server::setBackupSchedule(std::string backup_schedule) {
+	if (running)
+		Supervisor::get()->call([&]() { this->backup_schedule = backup_schedule; });
+	else
+		this->backup_schedule = backup_schedule;
+}
+
+void Server::setBackupSnapshot(bool backup_snapshot) {
+	if (running)
+		Supervisor::get()->call([&]() { this->backup_snapshot = backup_snapshot; });
+	else
+		this->backup_snapshot = backup_snapshot;
+}
+
+void Server::setBackupThreads(size_t backup_threads) {
+	if (running)
+		Supervisor::get()->call([&]() { this->backup_threads = backup_threads; });
+	else
+		this->backup_threads = backup_threads;
 }
 
 void Server::setBefore(std::vector<std::string> before) {
-	this->before = before;
+	if (running)
+		Supervisor::get()->call([&]() { this->before = before; });
+	else
+		this->before = before;
+}
+
+bool Server::setCrashPattern(std::string crash_pattern) {
+	return setPattern(this->crash_pattern, crash_pattern);
 }
 
 void Server::setDefault(bool default_startup) {
@@ -280,6 +862,22 @@ bool Server::setGroup(gid_t group) {
 	return ret;
 }
 
+void Server::setInputLimit(size_t input_limit) {
+	this->input_limit = input_limit;
+	if (running)
+		Supervisor::get()->call([&]() { console.setLimit(input_limit); });
+	else
+		console.setLimit(input_limit);
+}
+
+void Server::setInputTimeout(time_t input_timeout) {
+	this->input_timeout = input_timeout;
+	if (running)
+		Supervisor::get()->call([&]() { console.setTimeout(input_timeout); });
+	else
+		console.setTimeout(input_timeout);
+}
+
 bool Server::setLog(std::string log) {
 	bool ret = running;
 	if (ret)
@@ -288,8 +886,62 @@ bool Server::setLog(std::string log) {
 	return ret;
 }
 
+void Server::setKillTimeout(time_t kill_timeout) {
+	if (running)
+		Supervisor::get()->call([&]() { this->kill_timeout = kill_timeout; });
+	else
+		this->kill_timeout = kill_timeout;
+}
+
+void Server::setLogAge(time_t log_age) {
+	this->log_age = log_age;
+	if (running)
+		Supervisor::get()->call([&]() { output.setMaxAge(log_age); });
+	else
+		output.setMaxAge(log_age);
+}
+
+void Server::setLogCompress(int log_compress) {
+	this->log_compress = log_compress;
+	if (running)
+		Supervisor::get()->call([&]() { output.setCompress(log_compress); });
+	else
+		output.setCompress(log_compress);
+}
+
+void Server::setLogSize(size_t log_size) {
+	this->log_size = log_size;
+	if (running)
+		Supervisor::get()->call([&]() { output.setMaxSize(log_size); });
+	else
+		output.setMaxSize(log_size);
+}
+
 void Server::setNotify(std::string notify) {
-	this->notify = notify;
+	if (running)
+		Supervisor::get()->call([&]() { this->notify = notify; });
+	else
+		this->notify = notify;
+}
+
+bool Server::setPattern(Pattern &pattern, std::string source) {
+	bool ok = true;
+	if (running)
+		Supervisor::get()->call([&]() { ok = pattern.compile(source); });
+	else
+		ok = pattern.compile(source);
+	return ok;
+}
+
+bool Server::setReadyPattern(std::string ready_pattern) {
+	return setPattern(this->ready_pattern, ready_pattern);
+}
+
+void Server::setReadyTimeout(time_t ready_timeout) {
+	if (running)
+		Supervisor::get()->call([&]() { this->ready_timeout = ready_timeout; });
+	else
+		this->ready_timeout = ready_timeout;
 }
 
 bool Server::setPath(std::string path) {
@@ -300,6 +952,13 @@ bool Server::setPath(std::string path) {
 	return ret;
 }
 
+void Server::setRestartCountdown(std::vector<time_t> restart_countdown) {
+	if (running)
+		Supervisor::get()->call([&]() { this->restart_countdown = restart_countdown; });
+	else
+		this->restart_countdown = restart_countdown;
+}
+
 bool Server::setRun(std::string run) {
 	bool ret = running;
 	if (ret)
@@ -308,6 +967,42 @@ bool Server::setRun(std::string run) {
 	return ret;
 }
 
+bool Server::setSavePattern(std::string save_pattern) {
+	return setPattern(this->save_pattern, save_pattern);
+}
+
+void Server::setSaveTimeout(time_t save_timeout) {
+	if (running)
+		Supervisor::get()->call([&]() { this->save_timeout = save_timeout; });
+	else
+		this->save_timeout = save_timeout;
+}
+
+bool Server::setStopPattern(std::string stop_pattern) {
+	return setPattern(this->stop_pattern, stop_pattern);
+}
+
+void Server::setStopTimeout(time_t stop_timeout) {
+	if (running)
+		Supervisor::get()->call([&]() { this->stop_timeout = stop_timeout; });
+	else
+		this->stop_timeout = stop_timeout;
+}
+
+void Server::setStartAfter(std::vector<std::string> start_after) {
+	if (running)
+		Supervisor::get()->call([&]() { this->start_after = start_after; });
+	else
+		this->start_after = start_after;
+}
+
+void Server::setStartPriority(int start_priority) {
+	if (running)
+		Supervisor::get()->call([&]() { this->start_priority = start_priority; });
+	else
+		this->start_priority = start_priority;
+}
+
 bool Server::setUser(uid_t user) {
 	bool ret = running;
 	if (ret)
@@ -316,43 +1011,251 @@ bool Server::setUser(uid_t user) {
 	return ret;
 }
 
-bool Server::start() {
+void Server::setWorlds(std::vector<std::string> worlds) {
 	if (running)
-		return false;
+		Supervisor::get()->call([&]() {
+			this->worlds = worlds;
+			track();
+		});
+	else
+		this->worlds = worlds;
+}
 
-	// Start server
-	mtx = new std::mutex;
-	cv = new std::condition_variable;
-	thread = new std::thread(&Server::runServer, this);
-	running = true;
-	return true;
+void Server::shutdown() {
+	busy = stopping = true;
+	if (state != ss_crashed)
+		state = ss_stopping;
+	std::vector<std::string> stopped_notify;
+	if (!notify.empty())
+		stopped_notify = { notify, "Stopped " + name + "." };
+	runThen(stopped_notify, [this]() {
+		runThen(after, [this]() { finish(); });
+	});
+}
+
+void Server::snapshotted(unsigned long gen, std::string snapshot) {
+	if (snapshot.empty()) {
+		// Back up the live directory instead, with saves still off
+		if (gen == generation)
+			store(gen, path, false);
+		else
+			archived(gen, false, "");
+		return;
+	}
+	// The snapshot won't change, so the server can save again while it's stored
+	if (gen == generation) {
+		console.write("save-on\n", true);
+		saves_off = busy = false;
+		if (state == ss_backing_up)
+			state = ready ? ss_ready : ss_starting;
+	}
+	store(gen, snapshot, true);
+	if (gen == generation)
+		runCommands();
+}
+
+void Server::stalled(size_t dropped) {
+	std::cerr << "Server [" << name << "] has not read its input for " << input_timeout << " seconds, dropped " << dropped << " bytes!" << std::endl;
+	if (!notify.empty())
+		runThen({ notify, "Server " + name + " is not reading its input!" }, [](){});
+	// It will never see the stop command, don't wait on it forever
+	if (stopping && child != -1) {
+		std::cerr << "Killing server [" << name << "]" << std::endl;
+		kill(-child, SIGKILL);
+	}
+}
+
+bool Server::start() {
+	bool started = false;
+	Supervisor::get()->call([&]() {
+		if (running || restoring)
+			return;
+		if (!console.open())
+			return;
+		output.setFile(logFile(), user, group);
+		if (!output.open()) {
+			console.close();
+			return;
+		}
+		started = running = busy = true;
+		state = ss_starting;
+		ready_time = -1;
+		output.watch([this](std::string_view line) {
+			scan(line);
+			return true;
+		});
+		track();
+		std::vector<std::string> starting_notify;
+		if (!notify.empty())
+			starting_notify = { notify, "Starting " + name + "." };
+		runThen(before, [this, starting_notify]() {
+			runThen(starting_notify, [this]() { launch(); });
+		});
+	});
+	return started;
 }
 
 bool Server::stop() {
-	if (!running)
-		return false;
-	this->send("stop\n");
-	thread->join();
-	delete thread; thread = nullptr;
-	delete cv;     cv = nullptr;
-	delete mtx;    mtx = nullptr;
-	running = false;
-	return true;
+	bool was_running = false;
+	std::future<void> stopped;
+	Supervisor::get()->call([&]() {
+		if (!running)
+			return;
+		was_running = true;
+		stop_waiters.emplace_back();
+		stopped = stop_waiters.back().get_future();
+		if (!stop_queued) {
+			stop_queued = true;
+			// A restart that is already stopping it stops it for good instead
+			if (restarting)
+				restarting = false;
+			else {
+				commands.push("stop\n");
+				runCommands();
+			}
+		}
+	});
+	if (was_running)
+		stopped.wait();
+	return was_running;
+}
+
+void Server::store(unsigned long gen, std::string source, bool snapshot) {
+	if (backup_format == "dedup") {
+		std::string store_dir = backup_dir, prefix = name;
+		size_t rate = backup_rate;
+		struct retention keep = retention;
+		std::vector<std::string> directories = worlds;
+		std::shared_ptr<std::set<std::string>> changes = backup_changes;
+		std::string base = last_backup;
+		runJob(idlePool(), [this, gen, source, snapshot, store_dir, prefix, rate, keep, directories, changes, base]() {
+			becomeIdle();
+			Throttle throttle(rate);
+			BackupStore store(store_dir);
+			store.setChanges(changes.get(), base);
+			store.setDirectories(directories);
+			store.setThrottle(&throttle);
+			struct catalog_entry entry;
+			entry.time = time(NULL);
+			auto start = std::chrono::steady_clock::now();
+			struct backup_stats stats;
+			bool ok = store.snapshot(source, prefix, entry.name, stats);
+			if (ok)
+				std::cout << "Backed up [" << prefix << "] as " << entry.name << ": " << stats.files << " files (" << stats.unchanged << " unchanged), " <<
+					stats.new_chunks << " of " << stats.chunks << " chunks new, " << stats.bytes_read << " bytes read, " << stats.bytes_stored << " stored" << std::endl;
+			else
+				std::cerr << "Backup of [" << prefix << "] failed!" << std::endl;
+			if (snapshot)
+				Snapshot::remove(source);
+			if (ok) {
+				entry.server = prefix;
+				entry.format = "dedup";
+				entry.size = stats.bytes_stored;
+				entry.duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+				entry.checksum = Catalog::checksum(store_dir + "/snapshots/" + entry.name + ".manifest");
+				entry.parent = stats.parent.empty() ? "-" : stats.parent;
+				Catalog *catalog = Catalog::get(store_dir);
+				if (catalog != nullptr)
+					catalog->add(entry);
+			}
+			Supervisor::get()->post([this, gen, ok, entry]() { archived(gen, ok, entry.name); });
+			if (ok)
+				prune(store_dir, prefix, keep);
+		});
+		return;
+	}
+	time_t t = time(NULL);
+	struct tm* now = localtime(&t);
+	std::string file = backup_dir + '/' +
+			name + '_' +
+			std::to_string(now->tm_year + 1900) + '-' + std::to_string(now->tm_mon + 1) + '-' + std::to_string(now->tm_mday) + '-' + std::to_string(now->tm_hour) + '-' + std::to_string(now->tm_min) + '-' + std::to_string(now->tm_sec) +
+			".tgz";
+	std::string store_dir = backup_dir, prefix = name;
+	size_t threads = backup_threads, memory = backup_memory, rate = backup_rate;
+	uid_t owner = user;
+	gid_t owner_group = group;
+	struct retention keep = retention;
+	std::vector<std::string> directories = worlds;
+	runJob(idlePool(), [this, gen, source, snapshot, file, store_dir, prefix, threads, memory, rate, owner, owner_group, keep, directories]() {
+		becomeIdle();
+		Throttle throttle(rate);
+		Archive archive(threads, memory);
+		archive.setDirectories(directories);
+		archive.setOwner(owner, owner_group);
+		archive.setThrottle(&throttle);
+		struct catalog_entry entry;
+		entry.time = time(NULL);
+		auto start = std::chrono::steady_clock::now();
+		bool ok = archive.write(source, file);
+		if (snapshot)
+			Snapshot::remove(source);
+		if (ok) {
+			entry.server = prefix;
+			entry.name = file.substr(file.rfind('/') + 1);
+			entry.format = "tar";
+			entry.size = archive.getSize();
+			entry.duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+			entry.checksum = archive.getChecksum();
+			entry.parent = "-";
+			Catalog *catalog = Catalog::get(store_dir);
+			if (catalog != nullptr)
+				catalog->add(entry);
+		}
+		Supervisor::get()->post([this, gen, ok, entry]() { archived(gen, ok, entry.name); });
+		if (ok)
+			prune(store_dir, prefix, keep);
+	});
+}
+
+void Server::tail(std::function<bool(std::string_view)> follower, bool follow) {
+	Supervisor::get()->call([&]() { output.tail(follower, follow); });
+}
+
+void Server::track() {
+	std::string root = path, backup = backup_dir;
+	while (root.size() > 1 && root.back() == '/')
+		root.pop_back();
+	while (backup.size() > 1 && backup.back() == '/')
+		backup.pop_back();
+	// Written to all the time, and no part of a world: the daemon's log and
+	// the server's own, and backups kept inside the server's directory
+	std::vector<std::string> excludes = { logFile(), root + "/logs" };
+	if (!backup.empty())
+		excludes.push_back(backup);
+	std::string log_dir = logFile();
+	log_dir.erase(log_dir.rfind('/'));
+	if (log_dir != root)
+		excludes.push_back(log_dir);
+	// Watching every directory takes a walk over all of them
+	std::function<void()> build = tracker.open(root, worlds, excludes);
+	if (build)
+		runJob(jobPool(), build);
+	last_backup.clear();
 }
 
 Server::Server(std::string name) {
 	this->name = name;
-
-	mtx = nullptr;
-	cv = nullptr;
-	thread = nullptr;
+	save_pattern.compile(DEFAULT_SAVE_PATTERN);
+	ready_pattern.compile(DEFAULT_READY_PATTERN);
+	stop_pattern.compile(DEFAULT_STOP_PATTERN);
+	crash_pattern.compile(DEFAULT_CRASH_PATTERN);
+	console.setLimit(input_limit);
+	console.onStall([this](size_t dropped) { stalled(dropped); });
 }
 
 Server::~Server() {
-	if (thread != nullptr)
-		delete thread;
-	if (cv != nullptr)
-		delete cv;
-	if (mtx != nullptr)
-		delete mtx;
+	// Servers that never backed up don't need the supervisor
+	if (jobs == 0)
+		return;
+	std::future<void> done;
+	bool waiting = false;
+	Supervisor::get()->call([&]() {
+		if (jobs == 0)
+			return;
+		job_waiters.emplace_back();
+		done = job_waiters.back().get_future();
+		waiting = true;
+	});
+	if (waiting)
+		done.wait();
 }
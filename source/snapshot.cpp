@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <iostream>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "pool.hpp"
+#include "snapshot.hpp"
+
+// Bytes copied at a time, when a file can't be cloned
+#define SNAPSHOT_COPY (1024 * 1024)
+
+// Copies the rest of a file by hand, for filesystems copy_file_range can't do
+static bool copyData(int in, int out) {
+	std::vector<char> buf(SNAPSHOT_COPY);
+	for (;;) {
+		ssize_t bytes = read(in, buf.data(), buf.size());
+		if (bytes == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (bytes == 0)
+			return true;
+		for (ssize_t done = 0; done < bytes;) {
+			ssize_t written = write(out, buf.data() + done, bytes - done);
+			if (written == -1) {
+				if (errno == EINTR)
+					continue;
+				return false;
+			}
+			done += written;
+		}
+	}
+}
+
+static void keepAttributes(int fd, const struct stat &st) {
+	// Changing the owner clears set-id bits, so the mode goes after it
+	if (fchown(fd, st.st_uid, st.st_gid) == -1 && errno != EPERM)
+		std::cerr << "Could not change owner of snapshot file (" << errno << ")" << std::endl;
+	fchmod(fd, st.st_mode & 07777);
+	struct timespec times[2] = { st.st_atim, st.st_mtim };
+	futimens(fd, times);
+}
+
+static int removeEntry(const char *path, const struct stat*, int type, struct FTW*) {
+	if ((type == FTW_DP ? rmdir(path) : unlink(path)) == -1 && errno != ENOENT) {
+		std::cerr << "Could not delete " << path << " (" << errno << ")" << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+bool Snapshot::copyDirectory(std::string source, std::string dest) {
+	DIR *dirp = opendir(source.c_str());
+	if (dirp == NULL) {
+		std::cerr << "Could not open " << source << " for snapshot (" << errno << ")" << std::endl;
+		return false;
+	}
+	std::vector<std::string> names;
+	struct dirent *ent;
+	while ((ent = readdir(dirp)) != NULL)
+		if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."))
+			names.push_back(ent->d_name);
+	closedir(dirp);
+
+	for (const std::string &file : names) {
+		{
+			std::lock_guard<std::mutex> lck(mtx);
+			if (failed)
+				return false;
+		}
+		if (!copyEntry(source + '/' + file, dest + '/' + file))
+			return false;
+	}
+	return true;
+}
+
+bool Snapshot::copyEntry(std::string from, std::string to) {
+	struct stat st;
+	if (lstat(from.c_str(), &st) == -1) {
+		// Deleted since the directory was read
+		if (errno == ENOENT)
+			return true;
+		std::cerr << "Could not stat " << from << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		if (mkdir(to.c_str(), 0700) == -1) {
+			std::cerr << "Could not create " << to << " (" << errno << ")" << std::endl;
+			return false;
+		}
+		if (!copyDirectory(from, to))
+			return false;
+		// Files are still being copied into it
+		made.push_back({ to, st });
+	}
+	else if (S_ISLNK(st.st_mode)) {
+		std::vector<char> target(st.st_size + 1);
+		ssize_t length = readlink(from.c_str(), target.data(), target.size());
+		if (length == -1)
+			return true;
+		if (symlink(std::string(target.data(), length).c_str(), to.c_str()) == -1) {
+			std::cerr << "Could not create " << to << " (" << errno << ")" << std::endl;
+			return false;
+		}
+		lchown(to.c_str(), st.st_uid, st.st_gid);
+		struct timespec times[2] = { st.st_atim, st.st_mtim };
+		utimensat(AT_FDCWD, to.c_str(), times, AT_SYMLINK_NOFOLLOW);
+	}
+	else if (S_ISREG(st.st_mode)) {
+		std::unique_lock<std::mutex> lck(mtx);
+		++pending;
+		lck.unlock();
+		workers->submit([this, from, to, st]() { copyFile(from, to, st); });
+	}
+	// Sockets, pipes and devices aren't backed up anyway
+	return true;
+}
+
+void Snapshot::copyFile(std::string source, std::string dest, struct stat st) {
+	bool ok = true, clone = false;
+	int in = open(source.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (in == -1) {
+		// Deleted since the directory was read
+		if (errno != ENOENT) {
+			std::cerr << "Could not open " << source << " for snapshot (" << errno << ")" << std::endl;
+			ok = false;
+		}
+	}
+	else {
+		int out = open(dest.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (out == -1) {
+			std::cerr << "Could not create " << dest << " (" << errno << ")" << std::endl;
+			ok = false;
+		}
+		else {
+			clone = ioctl(out, FICLONE, in) == 0;
+			if (!clone) {
+				// Still lets the kernel copy (or share) the data where it can
+				ssize_t bytes;
+				while ((bytes = copy_file_range(in, NULL, out, NULL, SNAPSHOT_COPY, 0)) > 0 || (bytes == -1 && errno == EINTR));
+				if (bytes == -1)
+					ok = (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) && copyData(in, out);
+			}
+			if (ok)
+				keepAttributes(out, st);
+			if (close(out) == -1)
+				ok = false;
+			if (!ok)
+				std::cerr << "Could not copy " << source << " to snapshot (" << errno << ")" << std::endl;
+		}
+		close(in);
+	}
+
+	std::lock_guard<std::mutex> lck(mtx);
+	if (!ok)
+		failed = true;
+	else if (in != -1)
+		++(clone ? cloned : copied);
+	--pending;
+	cv.notify_all();
+}
+
+size_t Snapshot::getCloned() {
+	return cloned;
+}
+
+size_t Snapshot::getCopied() {
+	return copied;
+}
+
+bool Snapshot::remove(std::string path) {
+	if (access(path.c_str(), F_OK) == -1)
+		return true;
+	return nftw(path.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS) == 0;
+}
+
+void Snapshot::setChanges(const std::set<std::string> *changes) {
+	this->changes = changes;
+}
+
+void Snapshot::setDirectories(std::vector<std::string> directories) {
+	this->directories = directories;
+}
+
+bool Snapshot::take(std::string source, std::string dest) {
+	struct stat st;
+	if (stat(source.c_str(), &st) == -1 || !S_ISDIR(st.st_mode)) {
+		std::cerr << "Could not snapshot " << source << ", not a directory" << std::endl;
+		return false;
+	}
+	// Left over from a snapshot that was never cleaned up
+	if (!remove(dest))
+		return false;
+	if (mkdir(dest.c_str(), 0700) == -1) {
+		std::cerr << "Could not create " << dest << " (" << errno << ")" << std::endl;
+		return false;
+	}
+
+	pending = cloned = copied = 0;
+	failed = false;
+	workers = new ThreadPool(threads);
+	made = { { dest, st } };
+	// Just what changed, or the directories asked for
+	std::vector<std::string> roots = directories;
+	if (changes) {
+		roots.clear();
+		for (const std::string &path : *changes) {
+			std::string::size_type slash = path.size();
+			while ((slash = path.rfind('/', slash - 1)) != std::string::npos && !changes->count(path.substr(0, slash)));
+			if (slash == std::string::npos)
+				roots.push_back(path);
+		}
+	}
+	bool ok = roots.empty() && !changes ? copyDirectory(source, dest) : true;
+	for (const std::string &root : roots) {
+		// Every directory on the way, so nested ones (e.g. worlds/nether) have a parent
+		bool found = true;
+		for (std::string::size_type slash = root.find('/'); ok && found && slash != std::string::npos; slash = root.find('/', slash + 1)) {
+			std::string relative = root.substr(0, slash), to = dest + '/' + relative;
+			struct stat dir_st;
+			if (stat((source + '/' + relative).c_str(), &dir_st) == -1 || !S_ISDIR(dir_st.st_mode))
+				found = false;
+			else if (mkdir(to.c_str(), 0700) == -1 && errno != EEXIST) {
+				std::cerr << "Could not create " << to << " (" << errno << ")" << std::endl;
+				ok = false;
+			}
+			else
+				made.push_back({ to, dir_st });
+		}
+		if (!changes && (!found || access((source + '/' + root).c_str(), F_OK) == -1)) {
+			// Not made by the server yet (a dimension nobody visited)
+			std::cerr << "Skipped " << source << '/' << root << " in snapshot, it does not exist" << std::endl;
+			continue;
+		}
+		if (ok && found)
+			ok = copyEntry(source + '/' + root, dest + '/' + root);
+	}
+	std::unique_lock<std::mutex> lck(mtx);
+	if (!ok)
+		failed = true;
+	cv.wait(lck, [this]() { return pending == 0; });
+	ok = !failed;
+	lck.unlock();
+	delete workers;
+	workers = nullptr;
+
+	for (auto dir_it = made.rbegin(); dir_it != made.rend(); ++dir_it) {
+		int fd = open(dir_it->first.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd != -1) {
+			keepAttributes(fd, dir_it->second);
+			close(fd);
+		}
+	}
+	made.clear();
+	return ok;
+}
+
+Snapshot::Snapshot(size_t threads) {
+	this->threads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+}
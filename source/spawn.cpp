@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "spawn.hpp"
+
+#define SPAWN_STACK_SIZE (64 * 1024)
+
+// 32 bit x86 has 16 bit ids in the plain calls
+#ifdef SYS_setresuid32
+#define SPAWN_SETGROUPS SYS_setgroups32
+#define SPAWN_SETRESGID SYS_setresgid32
+#define SPAWN_SETRESUID SYS_setresuid32
+#else
+#define SPAWN_SETGROUPS SYS_setgroups
+#define SPAWN_SETRESGID SYS_setresgid
+#define SPAWN_SETRESUID SYS_setresuid
+#endif
+
+// Everything the child needs, prepared before it is created
+struct spawn_job {
+	char *const *argv;
+	uid_t user;
+	gid_t group;
+	bool drop_groups;
+	const char *cwd;
+	const char *output;
+	int input;
+	int output_fd;
+	bool session;
+
+	// Set by the child if it fails before exec
+	const char *failed;
+	int error;
+};
+
+static int child(void *arg) {
+	struct spawn_job *job = (struct spawn_job*)arg;
+
+	// The daemon ignores these, children should not
+	signal(SIGPIPE, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	if (job->session && setsid() == -1) {
+		job->failed = "setsid";
+		goto fail;
+	}
+
+	// set up file descriptors
+	if (job->input != -1 && dup2(job->input, 0) == -1) {
+		job->failed = "dup2";
+		goto fail;
+	}
+	if (job->output_fd != -1 && (dup2(job->output_fd, 1) == -1 || dup2(job->output_fd, 2) == -1)) {
+		job->failed = "dup2";
+		goto fail;
+	}
+
+	// become proper user/group
+	// glibc's setgroups/setgid/setuid make every thread of the process change
+	// ids too, and the daemon's threads (sharing this address space) would be
+	// signalled to do so; the system calls only change this one
+	if (job->drop_groups && syscall(SPAWN_SETGROUPS, 1, &job->group) == -1) {
+		job->failed = "setgroups";
+		goto fail;
+	}
+	if (job->group != (gid_t)-1 && syscall(SPAWN_SETRESGID, job->group, job->group, job->group) == -1) {
+		job->failed = "setgid";
+		goto fail;
+	}
+	if (job->user != (uid_t)-1 && syscall(SPAWN_SETRESUID, job->user, job->user, job->user) == -1) {
+		job->failed = "setuid";
+		goto fail;
+	}
+
+	// Go to the designated directory
+	if (job->cwd != NULL && chdir(job->cwd) == -1) {
+		job->failed = "chdir";
+		goto fail;
+	}
+
+	// Redirect stdout and stderr to log file
+	if (job->output != NULL && job->output_fd == -1) {
+		int logfd = open(job->output, O_CREAT | O_APPEND | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (logfd == -1) {
+			job->failed = "open log file";
+			goto fail;
+		}
+		if (dup2(logfd, 1) == -1 || dup2(logfd, 2) == -1) {
+			job->failed = "dup2";
+			goto fail;
+		}
+		if (logfd > 2)
+			close(logfd);
+	}
+
+	execvp(job->argv[0], job->argv);
+	job->failed = "execvp";
+fail:
+	job->error = errno;
+	_exit(127);
+}
+
+pid_t spawn(const struct spawn_attr &attr, int *pidfd) {
+	if (pidfd != NULL)
+		*pidfd = -1;
+	if (attr.args.empty())
+		return -1;
+
+	std::vector<char*> argv;
+	for (const std::string &arg : attr.args)
+		argv.push_back((char*)arg.c_str());
+	argv.push_back(NULL);
+
+	struct spawn_job job = {
+		.argv = argv.data(),
+		.user = attr.user,
+		.group = attr.group,
+		.drop_groups = attr.group != (gid_t)-1 && geteuid() == 0,
+		.cwd = attr.cwd.empty() ? NULL : attr.cwd.c_str(),
+		.output = attr.output.empty() ? NULL : attr.output.c_str(),
+		.input = attr.input,
+		.output_fd = attr.output_fd,
+		.session = attr.session,
+		.failed = NULL,
+		.error = 0,
+	};
+
+	// The child runs on its own stack, in our address space, while we wait
+	char *stack = (char*)mmap(NULL, SPAWN_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED) {
+		std::cerr << "mmap error (" << errno << ")" << std::endl;
+		return -1;
+	}
+	int flags = CLONE_VM | CLONE_VFORK | SIGCHLD;
+	int fd = -1;
+	pid_t pid = clone(child, stack + SPAWN_STACK_SIZE, flags | (pidfd != NULL ? CLONE_PIDFD : 0), &job, &fd);
+	// Kernels before 5.2 don't know CLONE_PIDFD
+	if (pid == -1 && errno == EINVAL && pidfd != NULL)
+		pid = clone(child, stack + SPAWN_STACK_SIZE, flags, &job, NULL);
+	int err = errno;
+	munmap(stack, SPAWN_STACK_SIZE);
+
+	if (pid == -1) {
+		std::cerr << "clone error when trying to run " << attr.args[0] << "! (" << err << ")" << std::endl;
+		return -1;
+	}
+	if (job.failed != NULL)
+		std::cerr << job.failed << " error when trying to run " << attr.args[0] << "! (" << job.error << ")" << std::endl;
+	if (pidfd != NULL)
+		*pidfd = fd;
+	return pid;
+}
@@ -0,0 +1,83 @@
+#include <algorithm>
+#include <iostream>
+#include "startup.hpp"
+
+void Startup::cancel(std::string name) {
+	if (name.empty())
+		waiting.clear();
+	else
+		waiting.erase(std::remove(waiting.begin(), waiting.end(), name), waiting.end());
+}
+
+void Startup::dispatch() {
+	while (starting.size() < jobs && !waiting.empty()) {
+		auto next_it = waiting.end();
+		for (auto waiting_it = waiting.begin(); waiting_it != waiting.end(); ++waiting_it)
+			if (startable(*waiting_it) && (next_it == waiting.end() || servers[*waiting_it]->getStartPriority() > servers[*next_it]->getStartPriority()))
+				next_it = waiting_it;
+		if (next_it == waiting.end()) {
+			if (!starting.empty())
+				return;
+			// Every one left waits for another that is left
+			for (auto waiting_it = waiting.begin(); waiting_it != waiting.end(); ++waiting_it)
+				if (next_it == waiting.end() || servers[*waiting_it]->getStartPriority() > servers[*next_it]->getStartPriority())
+					next_it = waiting_it;
+			std::cerr << "Server [" << *next_it << "] starts after servers that wait for it, starting it anyway" << std::endl;
+		}
+		std::string name = *next_it;
+		waiting.erase(next_it);
+		std::cout << "Starting server [" << name << "]" << std::endl;
+		if (servers[name]->start())
+			starting.insert(name);
+	}
+}
+
+void Startup::finished(std::string name) {
+	if (starting.erase(name))
+		dispatch();
+}
+
+size_t Startup::start() {
+	for (auto block : servers)
+		if (block.second->defaultStartup() && std::find(waiting.begin(), waiting.end(), block.first) == waiting.end() && starting.find(block.first) == starting.end())
+			waiting.push_back(block.first);
+	size_t count = waiting.size() + starting.size();
+	dispatch();
+	return count;
+}
+
+// Servers it starts after that are still to start, or not ready yet, hold it
+// back; any others (not starting with the daemon, or started by hand) don't
+bool Startup::startable(std::string name) {
+	for (const std::string &other : servers[name]->getStartAfter())
+		if (starting.find(other) != starting.end() || std::find(waiting.begin(), waiting.end(), other) != waiting.end())
+			return false;
+	return true;
+}
+
+void Startup::update(std::map<std::string, Server*> servers, size_t jobs) {
+	for (auto block : this->servers)
+		if (servers.find(block.first) == servers.end()) {
+			starting.erase(block.first);
+			cancel(block.first);
+		}
+	this->servers = servers;
+	this->jobs = jobs;
+	for (auto block : servers) {
+		std::string name = block.first;
+		block.second->onReady([this, name](bool) {
+			loop->post([this, name]() { actions->submit([this, name]() { finished(name); }); });
+		});
+	}
+	dispatch();
+}
+
+Startup::Startup(EventLoop *loop, ThreadPool *actions) {
+	this->loop = loop;
+	this->actions = actions;
+}
+
+Startup::~Startup() {
+	for (auto block : servers)
+		block.second->onReady(nullptr);
+}
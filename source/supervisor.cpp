@@ -0,0 +1,94 @@
+#include <errno.h>
+#include <future>
+#include <iostream>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "supervisor.hpp"
+
+// How often to poll for a child's exit, on kernels without pidfd_open
+#define POLL_INTERVAL 100
+
+static void pollExit(EventLoop *loop, pid_t child, std::function<void(int)> on_exit) {
+	int status;
+	pid_t ret = waitpid(child, &status, WNOHANG);
+	if (ret == 0 || (ret == -1 && errno == EINTR))
+		loop->after(POLL_INTERVAL, [loop, child, on_exit]() { pollExit(loop, child, on_exit); });
+	else
+		on_exit(ret == -1 ? -1 : status);
+}
+
+void Supervisor::call(std::function<void()> func) {
+	if (inThread()) {
+		func();
+		return;
+	}
+	std::promise<void> done;
+	loop.post([&]() {
+		func();
+		done.set_value();
+	});
+	done.get_future().wait();
+}
+
+EventLoop *Supervisor::events() {
+	return &loop;
+}
+
+bool Supervisor::inThread() {
+	return std::this_thread::get_id() == thread->get_id();
+}
+
+void Supervisor::post(std::function<void()> func) {
+	loop.post(func);
+}
+
+bool Supervisor::watch(pid_t child, std::function<void(int)> on_exit, int pidfd) {
+	if (pidfd == -1)
+		pidfd = syscall(SYS_pidfd_open, child, 0);
+	if (pidfd == -1) {
+		if (errno != ENOSYS) {
+			std::cerr << "pidfd_open error (" << errno << ")" << std::endl;
+			return false;
+		}
+		pollExit(&loop, child, on_exit);
+		return true;
+	}
+	bool added = loop.add(pidfd, EPOLLIN, [this, pidfd, child, on_exit](uint32_t) {
+		loop.remove(pidfd);
+		close(pidfd);
+		int status;
+		while (waitpid(child, &status, 0) == -1) {
+			if (errno != EINTR) {
+				status = -1;
+				break;
+			}
+		}
+		on_exit(status);
+	});
+	if (!added)
+		close(pidfd);
+	return added;
+}
+
+Supervisor *Supervisor::get() {
+	static Supervisor supervisor;
+	return &supervisor;
+}
+
+Supervisor::Supervisor() {
+	// Servers are stopped through the daemon, and a child closing its console
+	// must not take the daemon down with it
+	signal(SIGTERM, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	thread = new std::thread(&EventLoop::run, &loop);
+}
+
+Supervisor::~Supervisor() {
+	loop.stop();
+	thread->join();
+	delete thread;
+}
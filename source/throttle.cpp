@@ -0,0 +1,30 @@
+#include <algorithm>
+#include <thread>
+#include "throttle.hpp"
+
+// Most a throttled reader can get ahead of the rate, in seconds
+#define THROTTLE_BURST 0.1
+
+void Throttle::take(size_t bytes) {
+	if (!rate)
+		return;
+	std::unique_lock<std::mutex> lck(mtx);
+	auto now = std::chrono::steady_clock::now();
+	tokens = std::min(burst, tokens + std::chrono::duration<double>(now - filled).count() * rate);
+	filled = now;
+	tokens -= bytes;
+	if (tokens >= 0)
+		return;
+	// In debt: pay it off before reading more. Other threads see the debt too,
+	// so they wait their turn behind this one.
+	double wait = -tokens / rate;
+	lck.unlock();
+	std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+}
+
+Throttle::Throttle(size_t rate) {
+	this->rate = rate;
+	burst = rate * THROTTLE_BURST;
+	tokens = burst;
+	filled = std::chrono::steady_clock::now();
+}
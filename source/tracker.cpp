@@ -0,0 +1,225 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "supervisor.hpp"
+#include "tracker.hpp"
+
+#define TRACKER_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_DONT_FOLLOW | IN_ONLYDIR | IN_EXCL_UNLINK)
+#define TRACKER_READ   65536
+
+// Whether a path is one of the excluded ones, or named after one (like a
+// rotated log)
+static bool isExcluded(std::string full, const std::vector<std::string> &excludes) {
+	for (const std::string &exclude : excludes)
+		if (full.compare(0, exclude.size(), exclude) == 0 && (full.size() == exclude.size() || full[exclude.size()] == '.'))
+			return true;
+	return false;
+}
+
+void Tracker::close() {
+	if (fd == -1)
+		return;
+	Supervisor::get()->events()->remove(fd);
+	::close(fd);
+	fd = -1;
+	watches.clear();
+	missing.clear();
+	changed.clear();
+	everything = true;
+	building = false;
+}
+
+void Tracker::built(unsigned long opened, std::map<int, std::string> found, std::set<std::string> not_found, bool ran_out) {
+	// Closed or opened again since
+	if (opened != generation || fd == -1)
+		return;
+	watches.insert(found.begin(), found.end());
+	missing.insert(not_found.begin(), not_found.end());
+	if (ran_out)
+		exhausted = everything = true;
+	building = false;
+}
+
+void Tracker::mark(std::string path) {
+	changed.insert(path);
+}
+
+std::function<void()> Tracker::open(std::string root, std::vector<std::string> directories, std::vector<std::string> excludes) {
+	close();
+	this->root = root;
+	this->directories = directories;
+	this->excludes = excludes;
+	everything = true;
+	exhausted = false;
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd == -1) {
+		std::cerr << "Could not track changes in " << root << " (" << errno << ")" << std::endl;
+		return nullptr;
+	}
+	// The walk's own descriptor, so closing this one can't hand its number
+	// to something else while it still adds watches
+	int walk_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (walk_fd == -1 || !Supervisor::get()->events()->add(fd, EPOLLIN, [this](uint32_t) { readEvents(); })) {
+		if (walk_fd != -1)
+			::close(walk_fd);
+		::close(fd);
+		fd = -1;
+		return nullptr;
+	}
+	building = true;
+	unsigned long opened = ++generation;
+	// Events on watches not handed over yet are dropped, but until then
+	// everything counts as changed anyway
+	return [this, opened, walk_fd, root, directories, excludes]() {
+		std::map<int, std::string> found;
+		std::set<std::string> not_found;
+		bool ran_out = false;
+		if (directories.empty())
+			ran_out = !watchTree(walk_fd, root, "", excludes, found);
+		for (size_t i = 0; i < directories.size() && !ran_out; ++i) {
+			const std::string &directory = directories[i];
+			struct stat st;
+			if (stat((root + '/' + directory).c_str(), &st) == -1 || !S_ISDIR(st.st_mode))
+				not_found.insert(directory);
+			else
+				ran_out = !watchTree(walk_fd, root, directory, excludes, found);
+		}
+		::close(walk_fd);
+		Supervisor::get()->post([this, opened, found, not_found, ran_out]() { built(opened, found, not_found, ran_out); });
+	};
+}
+
+void Tracker::readEvents() {
+	alignas(struct inotify_event) char buf[TRACKER_READ];
+	for (;;) {
+		ssize_t bytes = read(fd, buf, sizeof (buf));
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			return;
+		for (char *next = buf; next < buf + bytes;) {
+			const struct inotify_event *event = (const struct inotify_event*)next;
+			next += sizeof (struct inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW) {
+				everything = true;
+				continue;
+			}
+			auto watch_it = watches.find(event->wd);
+			if (watch_it == watches.end())
+				continue;
+			std::string directory = watch_it->second;
+			if (event->mask & IN_IGNORED) {
+				watches.erase(watch_it);
+				continue;
+			}
+			if (!event->len) {
+				// The watched directory itself
+				if (!(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
+					if (!directory.empty())
+						mark(directory);
+				}
+				else if (directory.empty())
+					everything = true;
+				else {
+					mark(directory);
+					// Watched again if it comes back
+					for (const std::string &tracked : directories)
+						if (tracked == directory)
+							missing.insert(directory);
+				}
+				continue;
+			}
+			std::string path = directory.empty() ? std::string(event->name) : directory + '/' + event->name;
+			if (isExcluded(root + '/' + path, excludes))
+				continue;
+			// Anything already in it was missed, but it counts as changed as a whole
+			if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+				watch(path);
+			mark(path);
+		}
+	}
+}
+
+void Tracker::reset() {
+	everything = true;
+}
+
+bool Tracker::take(std::set<std::string> &changes) {
+	changes.clear();
+	if (fd == -1 || building)
+		return false;
+	// Directories that appeared since (a world generated after the server
+	// started) are all new
+	for (auto missing_it = missing.begin(); missing_it != missing.end();) {
+		struct stat st;
+		if (stat((root + '/' + *missing_it).c_str(), &st) == -1 || !S_ISDIR(st.st_mode)) {
+			++missing_it;
+			continue;
+		}
+		watch(*missing_it);
+		mark(*missing_it);
+		missing_it = missing.erase(missing_it);
+	}
+	// Anything still queued happened before now
+	readEvents();
+	bool known = !everything;
+	changes.swap(changed);
+	everything = exhausted;
+	return known;
+}
+
+bool Tracker::watch(std::string relative) {
+	if (exhausted)
+		return false;
+	if (!watchTree(fd, root, relative, excludes, watches)) {
+		exhausted = everything = true;
+		return false;
+	}
+	return true;
+}
+
+bool Tracker::watchTree(int fd, std::string root, std::string relative, const std::vector<std::string> &excludes, std::map<int, std::string> &watches) {
+	std::string full = relative.empty() ? root : root + '/' + relative;
+	if (isExcluded(full, excludes))
+		return true;
+	int wd = inotify_add_watch(fd, full.c_str(), TRACKER_EVENTS);
+	if (wd == -1) {
+		// Gone again already
+		if (errno == ENOENT || errno == ENOTDIR)
+			return true;
+		if (errno == ENOSPC)
+			std::cerr << "Ran out of inotify watches in " << root << ", backups will read every file (see fs.inotify.max_user_watches)" << std::endl;
+		else
+			std::cerr << "Could not watch " << full << " (" << errno << ")" << std::endl;
+		return false;
+	}
+	watches[wd] = relative;
+
+	DIR *dirp = opendir(full.c_str());
+	if (dirp == NULL)
+		return true;
+	std::vector<std::string> subdirectories;
+	struct dirent *ent;
+	while ((ent = readdir(dirp)) != NULL) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		struct stat st;
+		if (ent->d_type == DT_DIR || (ent->d_type == DT_UNKNOWN && lstat((full + '/' + ent->d_name).c_str(), &st) == 0 && S_ISDIR(st.st_mode)))
+			subdirectories.push_back(relative.empty() ? std::string(ent->d_name) : relative + '/' + ent->d_name);
+	}
+	closedir(dirp);
+	for (const std::string &subdirectory : subdirectories)
+		if (!watchTree(fd, root, subdirectory, excludes, watches))
+			return false;
+	return true;
+}
+
+Tracker::~Tracker() {
+	close();
+}
@@ -1,12 +1,17 @@
 //#include <systemd/sd-daemon.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include "usock.hpp"
 
-#define SOCK_BUF_SIZE 512
+#define SOCK_BUF_SIZE   65536
+#define SOCK_READ_SIZE  4096
+#define SOCK_LINE_LIMIT (16 * 1024 * 1024)
 
 int Socket::accept() {
-	return connectfd = ::accept(sockfd, NULL, NULL);
+	return accept4(sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
 }
 
 struct sockaddr_un Socket::addr() {
@@ -25,51 +30,87 @@ int Socket::fd() {
 	return sockfd;
 }
 
+bool Socket::flush() {
+	while (sent < outgoing.size()) {
+		ssize_t bytes = send(sockfd, outgoing.data() + sent, outgoing.size() - sent, MSG_NOSIGNAL);
+		if (bytes == -1) {
+			if (errno == EINTR)
+				continue;
+			// Don't let what's been sent pile up at the front
+			if (sent > outgoing.size() / 2) {
+				outgoing.erase(0, sent);
+				sent = 0;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		sent += bytes;
+	}
+	outgoing.clear();
+	sent = 0;
+	return true;
+}
+
 bool Socket::hasMessage() {
-	return !messages.empty();
+	return incoming.hasLine();
 }
 
 int Socket::listen() {
-	return ::listen(sockfd, 0);
+	if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) == -1)
+		return -1;
+	return ::listen(sockfd, SOMAXCONN);
 }
 
-std::string Socket::nextMessage() {
-	std::string message = messages.front();
-	messages.pop();
-	return message;
+std::string_view Socket::nextMessage() {
+	return incoming.nextLine();
 }
 
-void Socket::read() {
-	char buffer[SOCK_BUF_SIZE] = {};
-	while (::read(connectfd, buffer, SOCK_BUF_SIZE) != -1 && buffer[0] != '\0') {
-		std::string data(buffer);
-		buffer[0] = '\0';
-		std::string::size_type line_break;
-		while (line_break = data.find_first_of('\n'), line_break != std::string::npos) {
-			messages.push(data.substr(0, line_break));
-			data.erase(0, line_break + 1);
+size_t Socket::pending() {
+	return outgoing.size() - sent;
+}
+
+bool Socket::read() {
+	char *space;
+	size_t available;
+	// A line longer than SOCK_LINE_LIMIT ends the connection
+	while (space = incoming.reserve(SOCK_READ_SIZE, available), space != NULL) {
+		ssize_t bytes = ::read(sockfd, space, available);
+		if (bytes == 0)
+			break;
+		if (bytes == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			break;
 		}
-		if (!data.empty())
-			messages.push(data);
+		incoming.commit(bytes);
+		// A short read means there is nothing more to read right now
+		if ((size_t)bytes < available)
+			return true;
 	}
-	close(connectfd);
+	incoming.finish();
+	return false;
 }
 
 void Socket::sendLine(std::string message) {
-	write(sockfd, (message + '\n').c_str(), message.size() + 1);
+	outgoing += message + '\n';
+	flush();
 }
 
-Socket::Socket(std::string path) {
+Socket::Socket(std::string path) : incoming(SOCK_BUF_SIZE, SOCK_LINE_LIMIT) {
 	sock.sun_family = AF_UNIX;
 	strcpy(sock.sun_path, path.c_str());
-	sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
 
-	connectfd = -1;
+Socket::Socket(int fd) : incoming(SOCK_BUF_SIZE, SOCK_LINE_LIMIT) {
+	sock = {};
+	sockfd = fd;
 }
 
 Socket::~Socket() {
-	if (connectfd != -1)
-		close(connectfd);
+	if (sockfd != -1)
+		close(sockfd);
 }
 
 /*std::istream &operator>> (std::istream &in, Socket &s) {
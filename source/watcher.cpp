@@ -0,0 +1,102 @@
+#include <errno.h>
+#include <iostream>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "watcher.hpp"
+
+#define WATCHER_DIRECTORY_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define WATCHER_FILE_EVENTS      (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCHER_READ             65536
+// How long the file must go unchanged before calling back, in milliseconds
+#define WATCHER_SETTLE           2000
+
+void Watcher::changed() {
+	if (timer)
+		loop->cancel(timer);
+	timer = loop->after(WATCHER_SETTLE, [this]() {
+		timer = 0;
+		// It may be a different file by now
+		watchFile();
+		on_change();
+	});
+}
+
+void Watcher::close() {
+	if (fd == -1)
+		return;
+	if (timer)
+		loop->cancel(timer);
+	timer = 0;
+	loop->remove(fd);
+	::close(fd);
+	fd = directory_wd = file_wd = -1;
+}
+
+bool Watcher::open(std::string path) {
+	close();
+	this->path = path;
+	std::string::size_type slash = path.find_last_of('/');
+	std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	name = slash == std::string::npos ? path : path.substr(slash + 1);
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd == -1) {
+		std::cerr << "Could not watch " << path << " for changes (" << errno << ")" << std::endl;
+		return false;
+	}
+	if (!loop->add(fd, EPOLLIN, [this](uint32_t) { readEvents(); })) {
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+	directory_wd = inotify_add_watch(fd, directory.c_str(), WATCHER_DIRECTORY_EVENTS);
+	if (directory_wd == -1)
+		std::cerr << "Could not watch " << directory << " for changes (" << errno << ")" << std::endl;
+	watchFile();
+	return true;
+}
+
+void Watcher::readEvents() {
+	alignas(struct inotify_event) char buf[WATCHER_READ];
+	bool relevant = false;
+	for (;;) {
+		ssize_t bytes = read(fd, buf, sizeof (buf));
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			break;
+		for (char *next = buf; next < buf + bytes;) {
+			const struct inotify_event *event = (const struct inotify_event*)next;
+			next += sizeof (struct inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW)
+				relevant = true;
+			else if (event->wd == file_wd) {
+				// Deleted, watched again once it settles
+				if (event->mask & IN_IGNORED)
+					file_wd = -1;
+				relevant = true;
+			}
+			else if (event->wd == directory_wd && event->len && name == event->name)
+				relevant = true;
+		}
+	}
+	if (relevant)
+		changed();
+}
+
+void Watcher::watchFile() {
+	// Gives the same watch back if it is still the same file, and a new one if
+	// it was replaced (the old one goes once the old file is gone)
+	file_wd = inotify_add_watch(fd, path.c_str(), WATCHER_FILE_EVENTS);
+	if (file_wd == -1 && errno != ENOENT)
+		std::cerr << "Could not watch " << path << " for changes (" << errno << ")" << std::endl;
+}
+
+Watcher::Watcher(EventLoop *loop, std::function<void()> on_change) {
+	this->loop = loop;
+	this->on_change = on_change;
+}
+
+Watcher::~Watcher() {
+	close();
+}